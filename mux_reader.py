@@ -1,37 +1,256 @@
 #!/usr/bin/python3
-"""Reader for stdio-mux output files."""
+"""Reader for stdio-mux output files.
+
+A stdio-mux file is a sequence of packets. Each one has a 12-byte header (the
+stream id, and the timestamp and the size of the message packed in a single
+64-bit integer) followed by the message. The first packet of each stream has
+the name of its process. Packets of different streams are interleaved, but the
+timestamps within a stream never go back, so each stream is read on its own
+and the lines of all of them are merged with a heap. A first pass records the
+offsets of the packets of each stream, so that reading a stream only visits
+its own packets. The messages are never held in memory (the file is mapped
+instead of read), except for the incomplete line of each stream, but the
+offsets take 8 bytes per non-empty packet. Memory therefore grows linearly
+with the number of packets: a file of 20-byte packets needs 40% of its size.
+
+With --index, a sidecar index (FILE.idx, and the packet offsets in
+FILE.idx.offsets) is built on the first use. It has the streams of the file
+and, every so often, the position of a packet that starts a new line in a
+stream, so that --start can skip straight to it.
+"""
 
 import argparse
+import array
+import bisect
 import collections
+import heapq
+import itertools
+import json
+import mmap
+import os
 import struct
 import sys
+from typing import (Any, BinaryIO, Dict, Iterator, List, NamedTuple, Optional,
+                    Sequence, Tuple)
 
 Packet = collections.namedtuple('Packet',
                                 ['stream_id', 'comm', 'timestamp', 'message'])
 
+_HEADER = struct.Struct('=IQ')
+_INDEX_VERSION = 2
+# The type of the packet offsets, in memory and in FILE.idx.offsets.
+_OFFSET_TYPECODE = 'Q'
+# A checkpoint is added to the index after at least this many bytes of a
+# stream.
+_CHECKPOINT_INTERVAL = 1024 * 1024
 
-def _main():
-    parser = argparse.ArgumentParser(description=__doc__)
-    parser.add_argument(
-        'file',
-        type=argparse.FileType('rb'),
-        default=sys.stdin.buffer,
-        help='The output file from stdio-mux')
-    args = parser.parse_args()
+# The lines of a stream, as (timestamp, packet offset, line number, packet).
+# Lines with the same timestamp are printed in the order in which their
+# packets appear in the file.
+_Line = Tuple[int, int, int, Packet]
+
+
+class Stream(NamedTuple):
+    """A stream of a stdio-mux file."""
+    stream_id: int
+    comm: str
+    # The offsets of the non-empty packets that follow the one with the name.
+    packets: Sequence[int]
+    # The (timestamp, position in packets) of packets that start a new line.
+    checkpoints: List[Tuple[int, int]]
+
+
+def _packets(buf: Any, offset: int) -> Iterator[Tuple[int, int, int, int]]:
+    """Yields the (offset, stream_id, timestamp, size) of each message.
+
+    A file that is still being written can end in the middle of a packet, so
+    only the complete packets are yielded.
+    """
+    unpack_from = _HEADER.unpack_from
+    end = len(buf)
+    while offset + _HEADER.size <= end:
+        stream_id, timestamp = unpack_from(buf, offset)
+        offset += _HEADER.size
+        message_length = timestamp & 0xFFFF
+        if offset + message_length > end:
+            return
+        yield offset, stream_id, timestamp >> 16, message_length
+        offset += message_length
+
+
+def _scan(buf: Any, checkpoints: bool) -> Tuple[List[Stream], int]:
+    """Returns the streams of the file, and its last timestamp.
+
+    Each stream holds the offsets of all its non-empty packets, which is 8
+    bytes per packet.
+    """
+    streams: Dict[int, Stream] = {}
+    unindexed: Dict[int, int] = {}
+    at_line_start: Dict[int, bool] = {}
+    last_timestamp = 0
+    for offset, stream_id, timestamp, message_length in _packets(buf, 0):
+        last_timestamp = max(last_timestamp, timestamp)
+        stream = streams.get(stream_id)
+        if stream is None:
+            streams[stream_id] = Stream(
+                stream_id,
+                bytes(buf[offset:offset + message_length]).decode(
+                    errors='replace').strip(), array.array(_OFFSET_TYPECODE),
+                [])
+            unindexed[stream_id] = 0
+            at_line_start[stream_id] = True
+            continue
+        if not message_length:
+            continue
+        stream.packets.append(offset - _HEADER.size)
+        if not checkpoints:
+            continue
+        if (at_line_start[stream_id]
+                and unindexed[stream_id] >= _CHECKPOINT_INTERVAL):
+            stream.checkpoints.append((timestamp, len(stream.packets) - 1))
+            unindexed[stream_id] = 0
+        unindexed[stream_id] += message_length
+        at_line_start[stream_id] = buf[offset + message_length - 1] == 0x0A
+    return list(streams.values()), last_timestamp
+
+
+def _load_index(path: str, f: BinaryIO) -> Tuple[List[Stream], int]:
+    """Returns the streams and last timestamp of f, from its sidecar index.
 
+    The index is (re)built if it is missing or stale.
+    """
+    st = os.fstat(f.fileno())
+    index_path = f'{path}.idx'
+    offsets_path = f'{index_path}.offsets'
+    try:
+        with open(index_path) as index_file:
+            index = json.load(index_file)
+        if (index['version'] == _INDEX_VERSION and index['size'] == st.st_size
+                and index['mtime_ns'] == st.st_mtime_ns):
+            streams = []
+            with open(offsets_path, 'rb') as offsets_file:
+                for stream in index['streams']:
+                    packets = array.array(_OFFSET_TYPECODE)
+                    packets.fromfile(offsets_file, stream['packets'])
+                    streams.append(
+                        Stream(stream['stream_id'], stream['comm'], packets,
+                               [tuple(c) for c in stream['checkpoints']]))
+                if offsets_file.read(1):
+                    raise ValueError(f'{offsets_path} is too long')
+            return streams, index['last_timestamp']
+    except (OSError, ValueError, KeyError, EOFError):
+        pass
+
+    with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as buf:
+        streams, last_timestamp = _scan(buf, checkpoints=True)
+    # The offsets are written first, so that a fresh FILE.idx never refers to
+    # the offsets of an older version of the file.
+    with open(f'{offsets_path}.tmp', 'wb') as offsets_file:
+        for stream in streams:
+            stream.packets.tofile(offsets_file)
+    os.rename(f'{offsets_path}.tmp', offsets_path)
+    index_streams = [{
+        'stream_id': stream.stream_id,
+        'comm': stream.comm,
+        'packets': len(stream.packets),
+        'checkpoints': stream.checkpoints,
+    } for stream in streams]
+    with open(f'{index_path}.tmp', 'w') as index_file:
+        json.dump(
+            {
+                'version': _INDEX_VERSION,
+                'size': st.st_size,
+                'mtime_ns': st.st_mtime_ns,
+                'last_timestamp': last_timestamp,
+                'streams': index_streams,
+            }, index_file)
+    os.rename(f'{index_path}.tmp', index_path)
+    return streams, last_timestamp
+
+
+def _lines(buf: Any, stream: Stream, rank: int, last_timestamp: int,
+           start: Optional[int], end: Optional[int]) -> Iterator[_Line]:
+    """Yields the lines of stream between start and end, in order."""
+    first_packet = 0
+    if start is not None:
+        # Lines that end in the packet of a checkpoint have its timestamp,
+        # so only checkpoints strictly before start can be skipped to.
+        i = bisect.bisect_left(stream.checkpoints, (start, 0))
+        if i:
+            first_packet = stream.checkpoints[i - 1][1]
+    unpack_from = _HEADER.unpack_from
+    # The pieces of the incomplete line, which are only joined once it ends,
+    # so that long lines are not copied over and over.
+    pending: List[str] = []
+    for packet_offset in itertools.islice(stream.packets, first_packet, None):
+        _, timestamp = unpack_from(buf, packet_offset)
+        message_offset = packet_offset + _HEADER.size
+        message_length = timestamp & 0xFFFF
+        timestamp >>= 16
+        if end is not None and timestamp > end:
+            return
+        message = bytes(buf[message_offset:message_offset +
+                            message_length]).decode(errors='replace')
+        if '\n' not in message:
+            pending.append(message)
+            continue
+        *lines, rest = message.split('\n')
+        pending.append(lines[0])
+        lines[0] = ''.join(pending)
+        pending = [rest] if rest else []
+        if start is not None and timestamp < start:
+            continue
+        for i, line in enumerate(lines):
+            yield (timestamp, message_offset, i,
+                   Packet(stream.stream_id, stream.comm, timestamp, line))
+    if not pending:
+        return
+    if ((start is not None and last_timestamp < start)
+            or (end is not None and last_timestamp > end)):
+        return
+    # Incomplete lines go after everything else, in the order in which their
+    # streams first appeared.
+    yield (last_timestamp, len(buf) + rank, 0,
+           Packet(stream.stream_id, stream.comm, last_timestamp,
+                  ''.join(pending)))
+
+
+def _merged_packets(f: BinaryIO, use_index: bool, start: Optional[int],
+                    end: Optional[int]) -> Iterator[Packet]:
+    """Yields the lines of every stream of f in timestamp order."""
+    if os.fstat(f.fileno()).st_size == 0:
+        return
+    if use_index:
+        streams, last_timestamp = _load_index(f.name, f)
+    with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as buf:
+        if not use_index:
+            streams, last_timestamp = _scan(buf, checkpoints=False)
+        lines = [
+            _lines(buf, stream, rank, last_timestamp, start, end)
+            for rank, stream in enumerate(streams)
+        ]
+        for _, _, _, packet in heapq.merge(*lines):
+            yield packet
+
+
+def _sorted_packets(f: BinaryIO) -> Iterator[Packet]:
+    """Yields the lines of every stream of f in timestamp order.
+
+    This holds the whole file in memory, but does not need it to be seekable.
+    """
     buffers = {}
     process_names = {}
     packets = []
     last_timestamp = 0
     while True:
-        header = args.file.read(12)
+        header = f.read(12)
         if not header:
             break
-        stream_id, timestamp = struct.unpack('=IQ', header)
+        stream_id, timestamp = _HEADER.unpack(header)
         message_length = timestamp & 0xFFFF
         timestamp >>= 16
         last_timestamp = max(last_timestamp, timestamp)
-        message = args.file.read(message_length)
+        message = f.read(message_length)
 
         if stream_id not in process_names:
             process_names[stream_id] = message.decode(errors='replace').strip()
@@ -56,6 +275,39 @@ def _main():
                    contents))
 
     packets.sort(key=lambda packet: packet.timestamp)
+    yield from packets
+
+
+def _main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        'file',
+        type=argparse.FileType('rb'),
+        default=sys.stdin.buffer,
+        help='The output file from stdio-mux')
+    parser.add_argument(
+        '--index',
+        action='store_true',
+        help='Use (and build, if needed) the FILE.idx sidecar index')
+    parser.add_argument('--start',
+                        type=int,
+                        help='Skip lines before this timestamp')
+    parser.add_argument('--end',
+                        type=int,
+                        help='Skip lines after this timestamp')
+    parser.add_argument(
+        '--in-memory',
+        action='store_true',
+        help='Sort the whole file in memory. This is done for pipes')
+    args = parser.parse_args()
+
+    if args.in_memory or not args.file.seekable():
+        if args.index or args.start is not None or args.end is not None:
+            parser.error('--index, --start and --end need a seekable file')
+        packets = _sorted_packets(args.file)
+    else:
+        packets = _merged_packets(args.file, args.index, args.start, args.end)
+
     for packet in packets:
         color = '\033[0m'
         if packet.stream_id % 2 == 0:
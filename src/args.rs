@@ -38,6 +38,8 @@ pub enum Language {
     Ruby,
     #[clap(name = "cs")]
     CSharp,
+    #[clap(name = "cs-aot")]
+    CSharpAot,
     #[clap(name = "rs")]
     Rust,
     Go,
@@ -49,6 +51,67 @@ pub enum Language {
     KarelPascal,
 }
 
+/// How the result cache is used.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, ArgEnum)]
+pub enum ResultCacheMode {
+    /// Cached results are always replayed.
+    Use,
+    /// Cached results are replayed, except for a sampled fraction of them, which are run again
+    /// and compared against the cached result.
+    Verify,
+    /// Cached results are never replayed, but all results are stored.
+    Refresh,
+}
+
+/// Whether Landlock is used to restrict the filesystem when sandboxing is disabled.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, ArgEnum)]
+pub enum LandlockMode {
+    /// Landlock is not used.
+    Off,
+    /// Landlock is used if the kernel supports it.
+    Auto,
+    /// Landlock is used, and the run fails if the kernel does not support it.
+    Required,
+}
+
+/// The Transparent Huge Pages policy of the jailed process.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, ArgEnum)]
+pub enum ThpMode {
+    /// The host's policy (from /sys/kernel/mm/transparent_hugepage/enabled) is used.
+    Host,
+    /// Transparent Huge Pages are disabled.
+    Never,
+    /// Transparent Huge Pages are only used for regions that request them with
+    /// `madvise(MADV_HUGEPAGE)`. Requires Linux 6.18.
+    Advised,
+    // There is no `always` mode: the kernel only lets a process narrow the host's policy
+    // (PR_SET_THP_DISABLE), and cgroups have no THP knob. Calling `madvise(MADV_HUGEPAGE)` on the
+    // child's behalf would need an LD_PRELOAD shim, which would miss statically linked binaries
+    // and the runtimes that map their heaps directly, and would only work with a host policy of
+    // `madvise` or `always` anyway.
+}
+
+/// How the CPU time of the runtime's service threads is charged when a service core is used.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, ArgEnum)]
+pub enum ServiceCoreCharge {
+    /// `time` and `time-sys` count all the threads, like without a service core.
+    All,
+    /// `time` and `time-sys` only count the main thread. The CPU time limit is doubled, since the
+    /// rest of the threads can now run on the service core.
+    Main,
+}
+
+/// What happens to the remaining cases after a case fails in multi-case mode.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, ArgEnum)]
+pub enum CasePolicy {
+    /// All cases are run.
+    All,
+    /// The remaining cases of the group of the failed case are skipped.
+    StopGroup,
+    /// All the remaining cases are skipped.
+    StopAll,
+}
+
 /// [`clap`](::clap) arguments for the sandboxing.
 #[derive(Parser, Clone, Debug)]
 #[clap(author, version, about, long_about = None, trailing_var_arg(true))]
@@ -96,6 +159,16 @@ pub struct Args {
     #[clap(long, short = '0', value_name = "PATH")]
     pub stdin: Option<String>,
 
+    /// Redirects stdin from the `CASE.in` entry of a pack built by `omegajail-pack`, given as
+    /// `PACK:CASE`. The entry is copied into a sealed memfd, so nothing is extracted to disk
+    #[clap(
+        long,
+        value_name = "PACK:CASE",
+        conflicts_with = "stdin",
+        conflicts_with = "checker"
+    )]
+    pub stdin_pack: Option<String>,
+
     /// Redirects stdout
     #[clap(long, short = '1', value_name = "PATH")]
     pub stdout: Option<String>,
@@ -108,6 +181,11 @@ pub struct Args {
     #[clap(long, short = 'M', value_name = "PATH")]
     pub meta: Option<String>,
 
+    /// Samples the user-mode callchains of the child and writes them to a file in the collapsed
+    /// stacks format used by flamegraph tools
+    #[clap(long, value_name = "PATH")]
+    pub profile: Option<String>,
+
     /// Sets the time limit
     #[clap(long, short = 't', value_name = "MSEC")]
     pub time_limit: Option<u64>,
@@ -137,15 +215,116 @@ pub struct Args {
     #[clap(long)]
     pub disable_sandboxing: bool,
 
+    /// Restricts the filesystem access of the child with Landlock to the paths that would have
+    /// been mounted in the sandbox. Can only be used with --disable-sandboxing
+    #[clap(long, arg_enum, value_name = "MODE", default_value = "off")]
+    pub landlock: LandlockMode,
+
     /// Additional bind-mounts
     #[clap(long, value_name = "SOURCE:TARGET")]
     pub bind: Vec<String>,
 
+    /// Sets the Transparent Huge Pages policy of the child, and reports the maximum amount of
+    /// memory backed by huge pages in the meta file as `mem-thp`
+    #[clap(long, arg_enum, value_name = "MODE")]
+    pub thp: Option<ThpMode>,
+
+    /// Runs the JIT compiler, garbage collector, and other service threads of the runtime on this
+    /// CPU, which can be shared with other jails, so that they do not preempt the main thread (the
+    /// thread with the most CPU time), which keeps the jail's own CPU. The CPU time of the main
+    /// thread and the rest of the threads is reported in the meta file as `time-main` and
+    /// `time-runtime`
+    #[clap(long, value_name = "CPU")]
+    pub service_core: Option<usize>,
+
+    /// How the CPU time of the runtime threads is charged when --service-core is used
+    #[clap(long, arg_enum, value_name = "CHARGE", default_value = "all")]
+    pub service_core_charge: ServiceCoreCharge,
+
+    /// Sizes the heap and thread pools of the language runtime (Go, .NET, Node, Java, and the
+    /// Haskell RTS) from the memory limit and the CPUs of the jail. Haskell programs also need to be
+    /// compiled with this flag for the hints to be honored
+    #[clap(long)]
+    pub runtime_hints: bool,
+
     /// Allows downgrading to the SIGSYS-based seccomp filter that doesn't provide correct SYSACLL
     /// information always
     #[clap(long)]
     pub allow_sigsys_fallback: bool,
 
+    /// Supervises the jailed process from the small, statically linked `omegajail-init` binary
+    /// instead of a copy of this process, to reduce the memory used by each jail. Jails that
+    /// profile or sample the process (--profile, --thp, --service-core) or that disable sandboxing
+    /// ignore this flag
+    #[clap(long)]
+    pub minimal_init: bool,
+
+    /// Adds the outcome of every jail (spawns, setup latency, seccomp kills, OOMs) to the host-wide
+    /// metrics in this file. Nothing is recorded if it is empty or its directory does not exist
+    #[clap(long, value_name = "PATH", default_value = "/run/omegajail/metrics")]
+    pub metrics: String,
+
+    /// Caches the results of runs with a read-only homedir in this directory, keyed on the
+    /// contents of the homedir and stdin, the language, the limits, and the runtime (through the
+    /// `fingerprint` that `tools/mkroot` writes to the root, without which nothing is cached).
+    /// This is intended for rejudges, where most submissions are deterministic
+    #[clap(long, value_name = "PATH")]
+    pub result_cache: Option<String>,
+
+    /// How the result cache is used
+    #[clap(long, arg_enum, value_name = "MODE", default_value = "verify")]
+    pub result_cache_mode: ResultCacheMode,
+
+    /// The fraction of cache hits that are run again in verify mode
+    #[clap(long, value_name = "FRACTION", default_value = "0.05")]
+    pub result_cache_verify_rate: f64,
+
+    /// Runs every case in this case list (one `GROUP NAME [EXPECTED]` per line), replacing
+    /// `{case}` in the stdin, stdout, stderr and meta paths with the name of each case
+    #[clap(long, value_name = "PATH", requires = "run")]
+    pub cases: Option<String>,
+
+    /// What happens to the remaining cases after a case fails
+    #[clap(long, arg_enum, value_name = "POLICY", default_value = "all")]
+    pub case_policy: CasePolicy,
+
+    /// Runs this checker after the contestant, with the contestant's stdout as its stdin and the
+    /// input and expected output as data.in and data.out in its homedir. The checker's score is
+    /// added to the meta file
+    #[clap(
+        long,
+        arg_enum,
+        value_name = "LANGUAGE",
+        requires = "run",
+        requires = "checker-homedir",
+        conflicts_with = "cases"
+    )]
+    pub checker: Option<Language>,
+
+    /// The homedir of the checker
+    #[clap(long, value_name = "PATH")]
+    pub checker_homedir: Option<String>,
+
+    /// The target name of the checker
+    #[clap(long, value_name = "PATH", default_value = "Main")]
+    pub checker_target: String,
+
+    /// The expected output of the case, available to the checker as data.out
+    #[clap(long, value_name = "PATH")]
+    pub checker_expected: Option<String>,
+
+    /// Redirects the checker's stderr
+    #[clap(long, value_name = "PATH")]
+    pub checker_stderr: Option<String>,
+
+    /// Sets the time limit of the checker
+    #[clap(long, value_name = "MSEC")]
+    pub checker_time_limit: Option<u64>,
+
+    /// Sets the memory limit of the checker
+    #[clap(long, value_name = "BYTES")]
+    pub checker_memory_limit: Option<u64>,
+
     /// Any additional arguments to the executable
     pub extra_args: Vec<String>,
 }
@@ -0,0 +1,129 @@
+use std::env;
+use std::ffi::CString;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+
+use anyhow::{anyhow, bail, Context, Result};
+use clap::Parser;
+use nix::unistd::execve;
+
+/// The root of the .NET SDK.
+const DOTNET_ROOT: &str = "/usr/share/dotnet";
+/// The root of the NativeAOT compiler package.
+const ILCOMPILER_ROOT: &str = "/usr/share/dotnet/ilcompiler";
+
+#[derive(Parser, Clone, Debug)]
+#[clap(author, version, about, long_about = None)]
+struct Args {
+    /// The name of the executable
+    target: String,
+
+    /// The sources to be compiled
+    #[clap(required = true)]
+    sources: Vec<String>,
+}
+
+fn path_to_string(path: &Path) -> Result<String> {
+    Ok(path
+        .to_str()
+        .ok_or_else(|| anyhow!("could not convert path to string"))?
+        .into())
+}
+
+fn run(args: &[String]) -> Result<()> {
+    let status = Command::new(&args[0])
+        .args(args[1..].iter())
+        .status()
+        .with_context(|| anyhow!("execve({:?})", args))?;
+    if !status.success() {
+        bail!("execve({:?}) failed: {:?}", args, status);
+    }
+    Ok(())
+}
+
+#[doc(hidden)]
+fn main() -> Result<()> {
+    let args = Args::parse();
+    println!("target = {:?} sources = {:?}", args.target, args.sources);
+
+    let output_dir: PathBuf = Path::new(&args.sources[0])
+        .parent()
+        .context("invalid source")?
+        .into();
+    let assembly = path_to_string(&output_dir.join(format!("{}.dll", args.target)))?;
+    let object = path_to_string(&output_dir.join(format!("{}.o", args.target)))?;
+    let executable = path_to_string(&output_dir.join(&args.target))?;
+    let sdk = format!("{}/sdk", ILCOMPILER_ROOT);
+    let framework = format!("{}/framework", ILCOMPILER_ROOT);
+
+    let mut compiler_args: Vec<String> = vec![
+        format!("{}/dotnet", DOTNET_ROOT),
+        format!("{}/sdk/6.0.101/Roslyn/bincore/csc.dll", DOTNET_ROOT),
+        "-noconfig".into(),
+        format!("@{}/Release.rsp", DOTNET_ROOT),
+        format!("-out:{}", assembly),
+        "-target:exe".into(),
+    ];
+    compiler_args.extend_from_slice(&args.sources);
+
+    // The program is compiled against the implementation assemblies that ship with the NativeAOT
+    // compiler, not the ones of the shared framework. Only the features that a contestant's
+    // program can use are kept, so that there is less code to compile and link.
+    let ilc_args: Vec<String> = vec![
+        format!("{}/tools/ilc", ILCOMPILER_ROOT),
+        assembly.clone(),
+        format!("-o:{}", object),
+        format!("-r:{}/*.dll", sdk),
+        format!("-r:{}/*.dll", framework),
+        "--targetos:linux".into(),
+        "--targetarch:x64".into(),
+        "-O".into(),
+        "--initassembly:System.Private.CoreLib".into(),
+        "--initassembly:System.Private.StackTraceMetadata".into(),
+        "--initassembly:System.Private.TypeLoader".into(),
+        "--initassembly:System.Private.Reflection.Execution".into(),
+        "--directpinvoke:libSystem.Native".into(),
+        "--directpinvoke:libSystem.Globalization.Native".into(),
+        "--feature:System.Globalization.Invariant=true".into(),
+        "--feature:System.Diagnostics.Tracing.EventSource.IsSupported=false".into(),
+        "--feature:System.Resources.UseSystemResourceKeys=true".into(),
+        "--stacktracedata".into(),
+    ];
+
+    let linker_args: Vec<String> = vec![
+        "/usr/bin/clang-10".into(),
+        "-o".into(),
+        executable,
+        object,
+        format!("{}/libbootstrapper.o", sdk),
+        format!("{}/libRuntime.WorkstationGC.a", sdk),
+        format!("{}/libeventpipe-disabled.a", sdk),
+        format!("{}/libstdc++compat.a", sdk),
+        format!("{}/libSystem.Native.a", framework),
+        format!("{}/libSystem.Globalization.Native.a", framework),
+        "-Wl,--gc-sections".into(),
+        "-pthread".into(),
+        "-ldl".into(),
+        "-lm".into(),
+        "-lz".into(),
+        "-lrt".into(),
+    ];
+
+    run(&compiler_args)?;
+    run(&ilc_args)?;
+
+    let environ: Vec<CString> = env::vars()
+        .map(|(key, value)| CString::new(format!("{}={}", key, value)).unwrap())
+        .collect();
+    execve(
+        CString::new(linker_args[0].as_str()).unwrap().as_ref(),
+        linker_args
+            .iter()
+            .map(|s| CString::new(s.as_str()).unwrap())
+            .collect::<Vec<CString>>()
+            .as_ref(),
+        environ.as_ref(),
+    )
+    .with_context(|| format!("execve({:?}, {:?})", &linker_args, &environ))?;
+    Ok(())
+}
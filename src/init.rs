@@ -0,0 +1,14 @@
+use anyhow::Result;
+use clap::Parser;
+
+#[doc(hidden)]
+fn main() -> Result<()> {
+    let args = omegajail::jail::minimal_init::Args::parse();
+
+    // stderr was already redirected by the sandboxed init before it exec'd this binary.
+    env_logger::Builder::new()
+        .filter(None, log::LevelFilter::Info)
+        .init();
+
+    omegajail::jail::minimal_init::run(args)
+}
@@ -0,0 +1,462 @@
+//! Validation of the cold syscalls of a seccomp profile.
+//!
+//! Checking syscall arguments in BPF is expensive: every argument comparison is a few more
+//! instructions that every syscall that is sorted after it has to go through. Rules for rare,
+//! argument-heavy syscalls (thread creation, `fcntl` commands, `prctl`, resource limits) are
+//! marked as `# cold` in the policy files, and in the notify filter they are turned into
+//! `user-notify`, so that the in-kernel filter is a short allowlist of the hot syscalls. The
+//! sandboxed init then receives those syscalls as seccomp notifications and the [`Adjudicator`]
+//! decides what happens to them, mirroring the rules in the policy (which are still used as-is by
+//! the sigsys filter).
+//!
+//! Allowed syscalls are answered with `SECCOMP_USER_NOTIF_FLAG_CONTINUE`, which is only safe
+//! because the rules look exclusively at register values (flags, commands, and null-pointer
+//! checks), never at memory that another thread could change after the syscall was validated.
+
+use nix::errno::Errno;
+
+use crate::sys::{SeccompData, SeccompNotifResp, SECCOMP_USER_NOTIF_FLAG_CONTINUE};
+
+/// What happens to a syscall that was sent to the supervisor.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub(crate) enum Verdict {
+    /// The syscall runs as if the filter had allowed it.
+    Continue,
+    /// The syscall does not run, and returns this value.
+    Return(i64),
+    /// The syscall does not run, and fails with this errno.
+    Fail(Errno),
+    /// The syscall is not allowed, and the process is killed.
+    Kill,
+}
+
+impl Verdict {
+    /// The response to the seccomp notification `id`, or `None` if the process must be killed.
+    pub(crate) fn response(self, id: u64) -> Option<SeccompNotifResp> {
+        let (val, error, flags) = match self {
+            Verdict::Continue => (0, 0, SECCOMP_USER_NOTIF_FLAG_CONTINUE),
+            Verdict::Return(val) => (val, 0, 0),
+            Verdict::Fail(errno) => (0, -(errno as i32), 0),
+            Verdict::Kill => return None,
+        };
+        Some(SeccompNotifResp {
+            id: id,
+            val: val,
+            error: error,
+            flags: flags,
+        })
+    }
+}
+
+type Rule = fn(&[u64; 6]) -> Verdict;
+
+#[cfg(target_arch = "x86_64")]
+const SYS_FCNTL: libc::c_long = libc::SYS_fcntl;
+#[cfg(target_arch = "arm")]
+const SYS_FCNTL: libc::c_long = libc::SYS_fcntl64;
+
+/// The flags that glibc's `pthread_create` uses.
+const CLONE_THREAD_FLAGS: u64 = (libc::CLONE_VM
+    | libc::CLONE_FS
+    | libc::CLONE_FILES
+    | libc::CLONE_SIGHAND
+    | libc::CLONE_THREAD
+    | libc::CLONE_SYSVSEM
+    | libc::CLONE_SETTLS
+    | libc::CLONE_PARENT_SETTID
+    | libc::CLONE_CHILD_CLEARTID) as u64;
+/// The flags that glibc's `vfork` / `posix_spawn` use.
+const CLONE_VFORK_FLAGS: u64 = (libc::CLONE_VM | libc::CLONE_VFORK | libc::SIGCHLD) as u64;
+/// The flags that glibc's `fork` uses.
+const CLONE_FORK_FLAGS: u64 =
+    (libc::CLONE_CHILD_CLEARTID | libc::CLONE_CHILD_SETTID | libc::SIGCHLD) as u64;
+
+/// Returns the `index`th argument of a syscall whose parameter is an `int`. The kernel ignores the
+/// upper half of the register, so that is what the rules need to do too.
+fn int_arg(args: &[u64; 6], index: usize) -> i32 {
+    args[index] as u32 as i32
+}
+
+fn allow_if(allowed: bool) -> Verdict {
+    if allowed {
+        Verdict::Continue
+    } else {
+        Verdict::Kill
+    }
+}
+
+fn fcntl_basic(args: &[u64; 6]) -> Verdict {
+    allow_if(matches!(
+        int_arg(args, 1),
+        libc::F_GETFD | libc::F_GETFL | libc::F_SETFD | libc::F_SETFL
+    ))
+}
+
+fn ioctl_terminal(args: &[u64; 6]) -> Verdict {
+    let request = args[1] as u32;
+    allow_if(request == libc::FIONREAD as u32 || request == libc::TCGETS as u32)
+}
+
+fn prlimit64_stack(args: &[u64; 6]) -> Verdict {
+    if args[1] as u32 == libc::RLIMIT_STACK as u32 || args[2] == 0 {
+        Verdict::Continue
+    } else {
+        Verdict::Fail(Errno::EPERM)
+    }
+}
+
+fn prlimit64_stack_nofile(args: &[u64; 6]) -> Verdict {
+    match prlimit64_stack(args) {
+        // Changes to the file descriptor limit are ignored, but reported as successful.
+        Verdict::Fail(_) if args[1] as u32 == libc::RLIMIT_NOFILE as u32 => Verdict::Return(0),
+        verdict => verdict,
+    }
+}
+
+fn clone_thread(args: &[u64; 6]) -> Verdict {
+    allow_if(args[0] == CLONE_THREAD_FLAGS)
+}
+
+fn clone_thread_or_process(args: &[u64; 6]) -> Verdict {
+    allow_if(
+        args[0] == CLONE_THREAD_FLAGS
+            || args[0] == CLONE_VFORK_FLAGS
+            || args[0] == CLONE_FORK_FLAGS,
+    )
+}
+
+fn prctl_set_name(args: &[u64; 6]) -> Verdict {
+    allow_if(int_arg(args, 0) == libc::PR_SET_NAME)
+}
+
+fn rt_sigaction_not_sigsys(args: &[u64; 6]) -> Verdict {
+    allow_if(int_arg(args, 0) != libc::SIGSYS)
+}
+
+fn rt_sigaction_not_sigsys_eperm(args: &[u64; 6]) -> Verdict {
+    if int_arg(args, 0) != libc::SIGSYS {
+        Verdict::Continue
+    } else {
+        Verdict::Fail(Errno::EPERM)
+    }
+}
+
+/// The cold rules of `policies/java.policy`.
+static JAVA_RULES: &[(libc::c_long, Rule)] = &[
+    (SYS_FCNTL, fcntl_basic),
+    (libc::SYS_prlimit64, prlimit64_stack),
+    (libc::SYS_clone, clone_thread),
+    (libc::SYS_prctl, prctl_set_name),
+    (libc::SYS_rt_sigaction, rt_sigaction_not_sigsys),
+];
+
+/// The cold rules of `policies/javac.policy`.
+static JAVAC_RULES: &[(libc::c_long, Rule)] = &[
+    (SYS_FCNTL, fcntl_basic),
+    (libc::SYS_ioctl, ioctl_terminal),
+    (libc::SYS_prlimit64, prlimit64_stack_nofile),
+    (libc::SYS_clone, clone_thread_or_process),
+    (libc::SYS_prctl, prctl_set_name),
+    (libc::SYS_rt_sigaction, rt_sigaction_not_sigsys_eperm),
+];
+
+/// Decides what happens to the syscalls that the notify filter of a seccomp profile sends to the
+/// supervisor.
+pub(crate) struct Adjudicator {
+    rules: &'static [(libc::c_long, Rule)],
+}
+
+impl Adjudicator {
+    /// Creates the adjudicator for the seccomp profile `seccomp_profile_name`. Profiles without
+    /// cold rules get an adjudicator that treats every notification as fatal.
+    pub(crate) fn new(seccomp_profile_name: &str) -> Adjudicator {
+        Adjudicator {
+            rules: match seccomp_profile_name {
+                "java" => JAVA_RULES,
+                "javac" => JAVAC_RULES,
+                _ => &[],
+            },
+        }
+    }
+
+    /// Returns the verdict for a syscall. Syscalls without a rule reached the supervisor through
+    /// the default action of the filter, so they are not allowed.
+    pub(crate) fn adjudicate(&self, data: &SeccompData) -> Verdict {
+        let nr = libc::c_long::from(data.nr);
+        match self.rules.iter().find(|(rule_nr, _)| *rule_nr == nr) {
+            Some((_, rule)) => rule(&data.args),
+            None => Verdict::Kill,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{read_dir, read_to_string};
+    use std::path::Path;
+
+    use nix::errno::Errno;
+
+    use crate::jail::adjudicator::{Adjudicator, Verdict};
+    use crate::sys::SeccompData;
+
+    /// A value that none of the rules mention.
+    const OTHER_VALUE: u64 = 0x1234_5678;
+
+    #[cfg(target_arch = "x86_64")]
+    const ARCH: &str = "x86_64";
+    #[cfg(target_arch = "arm")]
+    const ARCH: &str = "armv7";
+
+    fn syscall_nr(name: &str) -> libc::c_long {
+        match name {
+            "clone" => libc::SYS_clone,
+            #[cfg(target_arch = "x86_64")]
+            "fcntl" => libc::SYS_fcntl,
+            #[cfg(target_arch = "arm")]
+            "fcntl64" => libc::SYS_fcntl64,
+            "ioctl" => libc::SYS_ioctl,
+            "prctl" => libc::SYS_prctl,
+            "prlimit64" => libc::SYS_prlimit64,
+            "rt_sigaction" => libc::SYS_rt_sigaction,
+            _ => panic!("unknown syscall {:?}, add it to the test", name),
+        }
+    }
+
+    fn constant(name: &str) -> u64 {
+        if let Ok(value) = name.parse::<u64>() {
+            return value;
+        }
+        (match name {
+            "CLONE_CHILD_CLEARTID" => libc::CLONE_CHILD_CLEARTID,
+            "CLONE_CHILD_SETTID" => libc::CLONE_CHILD_SETTID,
+            "CLONE_FILES" => libc::CLONE_FILES,
+            "CLONE_FS" => libc::CLONE_FS,
+            "CLONE_PARENT_SETTID" => libc::CLONE_PARENT_SETTID,
+            "CLONE_SETTLS" => libc::CLONE_SETTLS,
+            "CLONE_SIGHAND" => libc::CLONE_SIGHAND,
+            "CLONE_SYSVSEM" => libc::CLONE_SYSVSEM,
+            "CLONE_THREAD" => libc::CLONE_THREAD,
+            "CLONE_VFORK" => libc::CLONE_VFORK,
+            "CLONE_VM" => libc::CLONE_VM,
+            "F_GETFD" => libc::F_GETFD,
+            "F_GETFL" => libc::F_GETFL,
+            "F_SETFD" => libc::F_SETFD,
+            "F_SETFL" => libc::F_SETFL,
+            "FIONREAD" => libc::FIONREAD as i32,
+            "PR_SET_NAME" => libc::PR_SET_NAME,
+            "RLIMIT_NOFILE" => libc::RLIMIT_NOFILE as i32,
+            "RLIMIT_STACK" => libc::RLIMIT_STACK as i32,
+            "SIGCHLD" => libc::SIGCHLD,
+            "SIGSYS" => libc::SIGSYS,
+            "TCGETS" => libc::TCGETS as i32,
+            _ => panic!("unknown constant {:?}, add it to the test", name),
+        }) as u32 as u64
+    }
+
+    /// A comparison of a syscall argument, as (argument index, equal, value).
+    type Atom = (usize, bool, u64);
+
+    /// One of the rules of a cold line: a condition in disjunctive normal form, and the verdict of
+    /// the syscalls that match it.
+    type Rule = (Vec<Vec<Atom>>, Verdict);
+
+    /// A parsed `# cold` policy line: the syscall, its rules in order, and the verdict of the
+    /// syscalls that match none of them.
+    struct ColdLine {
+        line: String,
+        nr: libc::c_long,
+        rules: Vec<Rule>,
+        default: Verdict,
+    }
+
+    fn parse_syscall(syscalls: &str) -> Option<libc::c_long> {
+        let syscalls = syscalls.trim();
+        let syscalls = syscalls
+            .strip_prefix('{')
+            .and_then(|s| s.strip_suffix('}'))
+            .unwrap_or(syscalls);
+        syscalls
+            .split(',')
+            .map(str::trim)
+            .find_map(|syscall| match syscall.split_once('[') {
+                Some((name, arch)) if arch == format!("arch={}]", ARCH) => Some(syscall_nr(name)),
+                Some(_) => None,
+                None => Some(syscall_nr(syscall)),
+            })
+    }
+
+    fn parse_condition(condition: &str) -> Vec<Vec<Atom>> {
+        condition
+            .split("||")
+            .map(|conjunction| {
+                conjunction
+                    .split("&&")
+                    .map(|atom| {
+                        let tokens: Vec<&str> = atom.split_ascii_whitespace().collect();
+                        assert_eq!(tokens.len(), 3, "unexpected comparison {:?}", atom);
+                        let index = tokens[0]
+                            .strip_prefix("arg")
+                            .and_then(|index| index.parse::<usize>().ok())
+                            .unwrap_or_else(|| panic!("unexpected argument {:?}", tokens[0]));
+                        let equal = match tokens[1] {
+                            "==" => true,
+                            "!=" => false,
+                            op => panic!("unexpected operator {:?}", op),
+                        };
+                        let value = tokens[2].split('|').map(constant).fold(0, |a, b| a | b);
+                        (index, equal, value)
+                    })
+                    .collect()
+            })
+            .collect()
+    }
+
+    fn parse_action(action: &str) -> Verdict {
+        match action.trim() {
+            "allow" => Verdict::Continue,
+            "return EPERM" => Verdict::Fail(Errno::EPERM),
+            action => match action
+                .strip_prefix("return ")
+                .and_then(|value| value.parse::<i64>().ok())
+            {
+                Some(value) => Verdict::Return(value),
+                None => panic!("unexpected action {:?}", action),
+            },
+        }
+    }
+
+    fn parse_cold_lines(contents: &str) -> Vec<ColdLine> {
+        contents
+            .lines()
+            .filter_map(|line| {
+                let rule = line.trim().strip_suffix("# cold")?.trim();
+                let (syscalls, body) = rule
+                    .split_once(": ")
+                    .unwrap_or_else(|| panic!("unexpected rule {:?}", line));
+                let nr = parse_syscall(syscalls)?;
+                let (rules, default) = match body
+                    .strip_prefix('{')
+                    .and_then(|body| body.strip_suffix('}'))
+                {
+                    Some(actions) => {
+                        let mut actions: Vec<&str> = actions.split(',').collect();
+                        let default = parse_action(actions.pop().unwrap());
+                        let rules = actions
+                            .into_iter()
+                            .map(|action| {
+                                let (condition, action) = action
+                                    .split_once(';')
+                                    .unwrap_or_else(|| panic!("unexpected action {:?}", action));
+                                (parse_condition(condition), parse_action(action))
+                            })
+                            .collect();
+                        (rules, default)
+                    }
+                    None => (
+                        vec![(parse_condition(body), Verdict::Continue)],
+                        Verdict::Kill,
+                    ),
+                };
+                Some(ColdLine {
+                    line: line.to_string(),
+                    nr: nr,
+                    rules: rules,
+                    default: default,
+                })
+            })
+            .collect()
+    }
+
+    impl ColdLine {
+        fn evaluate(&self, args: &[u64; 6]) -> Verdict {
+            self.rules
+                .iter()
+                .find(|(condition, _)| {
+                    condition.iter().any(|conjunction| {
+                        conjunction
+                            .iter()
+                            .all(|&(index, equal, value)| (args[index] == value) == equal)
+                    })
+                })
+                .map_or(self.default, |(_, verdict)| *verdict)
+        }
+
+        /// Every combination of the values that the rules compare each argument against, plus
+        /// zero and a value that no rule mentions.
+        fn interesting_args(&self) -> Vec<[u64; 6]> {
+            let mut values: [Vec<u64>; 6] = Default::default();
+            for (condition, _) in &self.rules {
+                for &(index, _, value) in condition.iter().flatten() {
+                    if values[index].is_empty() {
+                        values[index].extend([0, OTHER_VALUE]);
+                    }
+                    if !values[index].contains(&value) {
+                        values[index].push(value);
+                    }
+                }
+            }
+            let mut combinations = vec![[0u64; 6]];
+            for (index, values) in values.iter().enumerate() {
+                if values.is_empty() {
+                    continue;
+                }
+                combinations = combinations
+                    .into_iter()
+                    .flat_map(|args| {
+                        values.iter().map(move |&value| {
+                            let mut args = args;
+                            args[index] = value;
+                            args
+                        })
+                    })
+                    .collect();
+            }
+            combinations
+        }
+    }
+
+    #[test]
+    fn adjudicator_matches_cold_policy_lines() {
+        let policies_path = Path::new(env!("CARGO_MANIFEST_DIR")).join("policies");
+        let mut checked = 0;
+        for entry in read_dir(&policies_path).unwrap() {
+            let path = entry.unwrap().path();
+            if path
+                .extension()
+                .map_or(true, |extension| extension != "policy")
+            {
+                continue;
+            }
+            let profile = path.file_stem().unwrap().to_str().unwrap();
+            let cold_lines = parse_cold_lines(&read_to_string(&path).unwrap());
+            let adjudicator = Adjudicator::new(profile);
+            assert_eq!(
+                adjudicator.rules.len(),
+                cold_lines.len(),
+                "{}: the adjudicator and the policy have a different number of cold rules",
+                profile
+            );
+            for cold_line in &cold_lines {
+                for args in cold_line.interesting_args() {
+                    let data = SeccompData {
+                        nr: cold_line.nr as i32,
+                        arch: 0,
+                        instruction_pointer: 0,
+                        args: args,
+                    };
+                    assert_eq!(
+                        adjudicator.adjudicate(&data),
+                        cold_line.evaluate(&args),
+                        "{}: {:?} with args {:x?}",
+                        profile,
+                        cold_line.line,
+                        args
+                    );
+                    checked += 1;
+                }
+            }
+        }
+        assert!(checked > 0, "no cold rules found in {:?}", policies_path);
+    }
+}
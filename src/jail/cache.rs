@@ -0,0 +1,412 @@
+//! A cache of run results.
+//!
+//! Rejudges execute the exact same binaries with the exact same inputs and limits, and most of the
+//! verdicts don't change. This cache stores the result of a run (along with its stdout and stderr)
+//! keyed on everything that could affect it, so that it can be replayed instead of run again.
+//!
+//! The cache directory has two subdirectories: `entries`, which holds one serialized
+//! [`CacheEntry`] per key, and `blobs`, which holds the stdout / stderr contents, addressed by
+//! their SHA-256 digest.
+
+use std::fs::{
+    create_dir_all, metadata, read, read_dir, read_link, rename, symlink_metadata, write, File,
+};
+use std::io::{copy, ErrorKind, Read, Seek, SeekFrom};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+
+use anyhow::{anyhow, Context, Result};
+use flexbuffers::FlexbufferSerializer;
+use nix::mount::MsFlags;
+use rand::{thread_rng, Rng};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+
+use crate::args::ResultCacheMode;
+use crate::jail::options::{JailOptions, Stdio};
+use crate::jail::{Jail, JailResult, WaitStatus};
+
+/// The version of the key and entry format. It must be bumped whenever [`CacheEntry`] (or
+/// [`JailResult`]) changes, so that entries written by older versions are never looked up.
+const CACHE_FORMAT_VERSION: u32 = 2;
+
+/// Runs that get this close to any of their time limits are not cached, since their verdict might
+/// change if they are run again.
+const TIME_LIMIT_MARGIN: f64 = 0.9;
+
+#[derive(Serialize, Deserialize, Debug)]
+pub(crate) struct CacheEntry {
+    result: JailResult,
+    stdout: String,
+    stderr: String,
+}
+
+#[derive(Serialize)]
+struct CacheEntryRef<'a> {
+    result: &'a JailResult,
+    stdout: &'a str,
+    stderr: &'a str,
+}
+
+/// Everything that is needed to look up, replay, or store the result of a single run.
+pub(crate) struct CachedRun {
+    key: String,
+    stdout: PathBuf,
+    stderr: PathBuf,
+    /// The size of the stderr file before the run started. omegajail's own logs are also written
+    /// to that file, so only what comes after this belongs to the run.
+    stderr_offset: u64,
+    meta: Option<PathBuf>,
+    time_limit: Option<Duration>,
+    wall_time_limit: Duration,
+}
+
+pub(crate) struct ResultCache {
+    path: PathBuf,
+    mode: ResultCacheMode,
+    verify_rate: f64,
+}
+
+impl ResultCache {
+    pub(crate) fn new<P: AsRef<Path>>(
+        path: P,
+        mode: ResultCacheMode,
+        verify_rate: f64,
+    ) -> Result<ResultCache> {
+        let path = path.as_ref().to_path_buf();
+        for dir in ["entries", "blobs"] {
+            create_dir_all(path.join(dir))
+                .with_context(|| anyhow!("create_dir_all({:?})", path.join(dir)))?;
+        }
+        Ok(ResultCache {
+            path: path,
+            mode: mode,
+            verify_rate: verify_rate.clamp(0.0, 1.0),
+        })
+    }
+
+    /// Computes the cache key for the run described by `options`.
+    ///
+    /// Returns `None` if the run cannot be cached: when the homedir is writable (so the run can
+    /// have side effects other than its stdout / stderr), when any of the standard streams is
+    /// not a file, when the run is being profiled, or when the omegajail root has no
+    /// `fingerprint`.
+    pub(crate) fn prepare(&self, options: &JailOptions) -> Result<Option<CachedRun>> {
+        if options.profile.is_some() {
+            return Ok(None);
+        }
+        let (stdout, stderr) = match (&options.stdout, &options.stderr) {
+            (Stdio::Mounted(stdout), Stdio::Mounted(stderr)) => (stdout.clone(), stderr.clone()),
+            _ => return Ok(None),
+        };
+        if let Stdio::FileDescriptor(_) = options.stdin {
+            return Ok(None);
+        }
+        let root = options
+            .rootfs
+            .parent()
+            .ok_or_else(|| anyhow!("rootfs {:?} has no parent", &options.rootfs))?;
+        let home = options.rootfs.join("home");
+
+        let mut hasher = Sha256::new();
+        hasher.update(&CACHE_FORMAT_VERSION.to_le_bytes());
+        hash_bytes(&mut hasher, env!("CARGO_PKG_VERSION").as_bytes());
+        hash_bytes(&mut hasher, &[options.disable_sandboxing as u8]);
+        hash_len(&mut hasher, options.args.len());
+        for arg in &options.args {
+            hash_bytes(&mut hasher, arg.as_bytes());
+        }
+        hash_len(&mut hasher, options.env.len());
+        for env in &options.env {
+            hash_bytes(&mut hasher, env.as_bytes());
+        }
+        hash_bytes(&mut hasher, &options.seccomp_bpf_filter_notify_contents);
+        hash_bytes(&mut hasher, &options.seccomp_bpf_filter_sigsys_contents);
+        hash_bytes(
+            &mut hasher,
+            format!(
+                "{:?}",
+                (
+                    options.time_limit,
+                    options.wall_time_limit,
+                    options.output_limit,
+                    options.memory_limit,
+                    options.use_cgroups_for_memory_limit,
+                    options.vm_memory_size_in_bytes,
+                    options.thp,
+                    options.service_core.is_some(),
+                    options.service_core_charge,
+                )
+            )
+            .as_bytes(),
+        );
+
+        // The runtimes are far too big to be hashed on every run. Instead, `tools/mkroot` writes a
+        // `fingerprint` file to the omegajail root, derived from the content hashes of the inputs
+        // of every language root. Without it, a runtime update would replay stale verdicts, so
+        // nothing is cached.
+        let fingerprint_path = root.join("fingerprint");
+        match read(&fingerprint_path) {
+            Ok(contents) => hash_bytes(&mut hasher, &contents),
+            Err(err) if err.kind() == ErrorKind::NotFound => {
+                log::debug!("{:?} not found, not caching", &fingerprint_path);
+                return Ok(None);
+            }
+            Err(err) => return Err(err).with_context(|| anyhow!("read {:?}", &fingerprint_path)),
+        }
+        hash_metadata(&mut hasher, &options.rootfs)?;
+        hash_len(&mut hasher, options.mounts.len());
+        for mount in &options.mounts {
+            if mount.target == home && !mount.flags.contains(MsFlags::MS_RDONLY) {
+                return Ok(None);
+            }
+            hash_bytes(&mut hasher, mount.target.as_os_str().as_bytes());
+            hash_bytes(
+                &mut hasher,
+                mount.fstype.as_deref().unwrap_or("").as_bytes(),
+            );
+            hash_bytes(&mut hasher, &mount.flags.bits().to_le_bytes());
+            hash_bytes(&mut hasher, mount.data.as_deref().unwrap_or("").as_bytes());
+            match &mount.source {
+                Some(source) if source == &stdout || source == &stderr => {}
+                Some(source) if source.starts_with(root) => hash_metadata(&mut hasher, source)?,
+                Some(source) => hash_tree(&mut hasher, source)?,
+                None => {}
+            }
+        }
+
+        Ok(Some(CachedRun {
+            key: format!("{:x}", hasher.finalize()),
+            stdout: stdout,
+            stderr: stderr,
+            stderr_offset: 0,
+            meta: options.meta.clone(),
+            time_limit: options.time_limit,
+            wall_time_limit: options.wall_time_limit,
+        }))
+    }
+
+    /// Returns the cached result of the run, if any.
+    pub(crate) fn lookup(&self, run: &CachedRun) -> Result<Option<CacheEntry>> {
+        if self.mode == ResultCacheMode::Refresh {
+            return Ok(None);
+        }
+        let entry_path = self.path.join("entries").join(&run.key);
+        let buf = match read(&entry_path) {
+            Ok(buf) => buf,
+            Err(err) if err.kind() == ErrorKind::NotFound => return Ok(None),
+            Err(err) => return Err(err).with_context(|| anyhow!("read {:?}", &entry_path)),
+        };
+        Ok(Some(
+            CacheEntry::deserialize(
+                flexbuffers::Reader::get_root(buf.as_slice()).context("get flexbuffers root")?,
+            )
+            .with_context(|| anyhow!("deserialize {:?}", &entry_path))?,
+        ))
+    }
+
+    /// Whether a cache hit should be run again to verify that its result is still the same.
+    pub(crate) fn should_verify(&self) -> bool {
+        self.mode == ResultCacheMode::Verify && thread_rng().gen_bool(self.verify_rate)
+    }
+
+    /// Writes the stdout, stderr and meta file of a cached run as if it had just been run.
+    pub(crate) fn replay(&self, run: &CachedRun, entry: CacheEntry) -> Result<JailResult> {
+        let mut stdout = File::create(&run.stdout)
+            .with_context(|| anyhow!("create stdout {:?}", &run.stdout))?;
+        copy(&mut self.open_blob(&entry.stdout)?, &mut stdout)
+            .with_context(|| anyhow!("replay stdout {:?}", &run.stdout))?;
+        // The stderr file also has omegajail's own logs, so it is only appended to.
+        let mut stderr = File::options()
+            .append(true)
+            .open(&run.stderr)
+            .with_context(|| anyhow!("open stderr {:?}", &run.stderr))?;
+        copy(&mut self.open_blob(&entry.stderr)?, &mut stderr)
+            .with_context(|| anyhow!("replay stderr {:?}", &run.stderr))?;
+
+        if let Some(meta) = &run.meta {
+            Jail::wait_write_meta_file(meta, &entry.result)?;
+        }
+        log::info!("replayed cached result {}", &run.key);
+        Ok(entry.result)
+    }
+
+    /// Records where the output of the run will start in its stderr file. This must be called
+    /// right before the run starts.
+    pub(crate) fn start(&self, run: &mut CachedRun) -> Result<()> {
+        run.stderr_offset = metadata(&run.stderr)
+            .with_context(|| anyhow!("stat stderr {:?}", &run.stderr))?
+            .len();
+        Ok(())
+    }
+
+    /// Stores the result of a run that has just finished.
+    pub(crate) fn store(&self, run: &CachedRun, result: &JailResult) -> Result<()> {
+        let cpu_time = result.user_time + result.system_time;
+        if run.time_limit.map_or(false, |limit| {
+            cpu_time.as_secs_f64() >= limit.as_secs_f64() * TIME_LIMIT_MARGIN
+        }) || result.wall_time.as_secs_f64()
+            >= run.wall_time_limit.as_secs_f64() * TIME_LIMIT_MARGIN
+        {
+            return Ok(());
+        }
+
+        let stdout = self.store_blob(&run.stdout, 0)?;
+        let stderr = self.store_blob(&run.stderr, run.stderr_offset)?;
+        let mut s = FlexbufferSerializer::new();
+        CacheEntryRef {
+            result: result,
+            stdout: &stdout,
+            stderr: &stderr,
+        }
+        .serialize(&mut s)
+        .context("serialize cache entry")?;
+        let entry_path = self.path.join("entries").join(&run.key);
+        let tmp_path = self.tmp_path(&entry_path);
+        write(&tmp_path, s.view()).with_context(|| anyhow!("write {:?}", &tmp_path))?;
+        rename(&tmp_path, &entry_path)
+            .with_context(|| anyhow!("rename({:?}, {:?})", &tmp_path, &entry_path))
+    }
+
+    /// Compares the result of a run that was a cache hit against the cached one, and stores the
+    /// new result.
+    pub(crate) fn verify(
+        &self,
+        run: &CachedRun,
+        entry: &CacheEntry,
+        result: &JailResult,
+    ) -> Result<()> {
+        let stdout = digest_file(&run.stdout, 0)?;
+        let stderr = digest_file(&run.stderr, run.stderr_offset)?;
+        if !same_status(&entry.result.status, &result.status)
+            || stdout != entry.stdout
+            || stderr != entry.stderr
+        {
+            log::warn!(
+                "result cache mismatch for {}: cached {:?} (stdout {}, stderr {}), got {:?} (stdout {}, stderr {})",
+                &run.key,
+                &entry.result.status,
+                &entry.stdout,
+                &entry.stderr,
+                &result.status,
+                &stdout,
+                &stderr,
+            );
+        }
+        self.store(run, result)
+    }
+
+    fn open_blob(&self, digest: &str) -> Result<File> {
+        let blob_path = self.path.join("blobs").join(digest);
+        File::open(&blob_path).with_context(|| anyhow!("open {:?}", &blob_path))
+    }
+
+    /// Stores the contents of `path` from `offset` onwards as a blob, and returns its digest.
+    fn store_blob(&self, path: &Path, offset: u64) -> Result<String> {
+        let digest = digest_file(path, offset)?;
+        let blob_path = self.path.join("blobs").join(&digest);
+        if !blob_path.exists() {
+            let tmp_path = self.tmp_path(&blob_path);
+            copy(
+                &mut open_at(path, offset)?,
+                &mut File::create(&tmp_path).with_context(|| anyhow!("create {:?}", &tmp_path))?,
+            )
+            .with_context(|| anyhow!("copy({:?}, {:?})", path, &tmp_path))?;
+            rename(&tmp_path, &blob_path)
+                .with_context(|| anyhow!("rename({:?}, {:?})", &tmp_path, &blob_path))?;
+        }
+        Ok(digest)
+    }
+
+    fn tmp_path(&self, path: &Path) -> PathBuf {
+        path.with_extension(format!("tmp{:016x}", thread_rng().gen::<u64>()))
+    }
+}
+
+fn same_status(a: &WaitStatus, b: &WaitStatus) -> bool {
+    // The pids are not compared, since they are not guaranteed to be stable across runs.
+    match (a, b) {
+        (WaitStatus::Exited(_, a), WaitStatus::Exited(_, b)) => a == b,
+        (WaitStatus::Syscalled(_, a), WaitStatus::Syscalled(_, b)) => a == b,
+        (WaitStatus::Signaled(_, a), WaitStatus::Signaled(_, b)) => a == b,
+        _ => false,
+    }
+}
+
+fn hash_len(hasher: &mut Sha256, len: usize) {
+    hasher.update(&(len as u64).to_le_bytes());
+}
+
+fn hash_bytes(hasher: &mut Sha256, bytes: &[u8]) {
+    hash_len(hasher, bytes.len());
+    hasher.update(bytes);
+}
+
+fn hash_metadata(hasher: &mut Sha256, path: &Path) -> Result<()> {
+    let metadata = symlink_metadata(path).with_context(|| anyhow!("stat {:?}", path))?;
+    hash_bytes(hasher, path.as_os_str().as_bytes());
+    hasher.update(&metadata.ino().to_le_bytes());
+    hasher.update(&metadata.size().to_le_bytes());
+    hasher.update(&metadata.mtime().to_le_bytes());
+    hasher.update(&metadata.mtime_nsec().to_le_bytes());
+    Ok(())
+}
+
+/// Hashes the names, types, permissions and contents of everything under `path`.
+fn hash_tree(hasher: &mut Sha256, path: &Path) -> Result<()> {
+    let metadata = symlink_metadata(path).with_context(|| anyhow!("stat {:?}", path))?;
+    hasher.update(&metadata.mode().to_le_bytes());
+    if metadata.is_dir() {
+        let mut entries = read_dir(path)
+            .with_context(|| anyhow!("read_dir({:?})", path))?
+            .map(|entry| entry.map(|entry| entry.file_name()))
+            .collect::<std::io::Result<Vec<_>>>()
+            .with_context(|| anyhow!("read_dir({:?})", path))?;
+        entries.sort();
+        hash_len(hasher, entries.len());
+        for name in entries {
+            hash_bytes(hasher, name.as_bytes());
+            hash_tree(hasher, &path.join(name))?;
+        }
+    } else if metadata.file_type().is_symlink() {
+        let target = read_link(path).with_context(|| anyhow!("readlink({:?})", path))?;
+        hash_bytes(hasher, target.as_os_str().as_bytes());
+    } else if metadata.is_file() {
+        hash_len(hasher, metadata.len() as usize);
+        hash_reader(
+            hasher,
+            &mut File::open(path).with_context(|| anyhow!("open {:?}", path))?,
+        )
+        .with_context(|| anyhow!("read {:?}", path))?;
+    }
+    Ok(())
+}
+
+fn hash_reader<R: Read>(hasher: &mut Sha256, reader: &mut R) -> std::io::Result<()> {
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        let n = reader.read(&mut buf)?;
+        if n == 0 {
+            return Ok(());
+        }
+        hasher.update(&buf[..n]);
+    }
+}
+
+/// Opens `path` for reading, starting at `offset`.
+fn open_at(path: &Path, offset: u64) -> Result<File> {
+    let mut f = File::open(path).with_context(|| anyhow!("open {:?}", path))?;
+    f.seek(SeekFrom::Start(offset))
+        .with_context(|| anyhow!("seek {:?} to {}", path, offset))?;
+    Ok(f)
+}
+
+/// Returns the digest of the contents of `path` from `offset` onwards.
+fn digest_file(path: &Path, offset: u64) -> Result<String> {
+    let mut hasher = Sha256::new();
+    hash_reader(&mut hasher, &mut open_at(path, offset)?)
+        .with_context(|| anyhow!("read {:?}", path))?;
+    Ok(format!("{:x}", hasher.finalize()))
+}
@@ -0,0 +1,358 @@
+//! Running all the cases of a problem in a single invocation.
+//!
+//! Problems are scored per group of cases (subtask): once a case in a group fails, the rest of the
+//! group cannot change the score. The case list is a text file with one case per line:
+//!
+//! ```text
+//! GROUP NAME [EXPECTED]
+//! ```
+//!
+//! Blank lines and lines that start with `#` are ignored. Every `{case}` in the `--stdin`,
+//! `--stdin-pack`, `--stdout`, `--stderr`, and `--meta` paths is replaced by the name of the
+//! case. A case fails if the program does not exit cleanly or, when `EXPECTED` is provided, if the
+//! whitespace-separated tokens of its stdout differ from the ones in `EXPECTED`. Only provide
+//! expected outputs for problems whose validator is an exact token comparison, since a case that
+//! a more lenient validator would have accepted would otherwise cause the rest of its group to be
+//! skipped.
+//!
+//! Depending on the [`CasePolicy`], a failure causes the rest of the cases in the group (or all
+//! the remaining cases) to be skipped. Skipped cases are not run, and their meta file only
+//! contains `skipped:1`.
+//!
+//! A case that cannot be run or checked (e.g. because its input is missing) does not abort the
+//! rest of the cases: it counts as failed, and its meta file only contains `error:` followed by
+//! the reason.
+
+use std::collections::HashSet;
+use std::fs::{read, read_to_string, write};
+
+use anyhow::{anyhow, bail, Context, Result};
+
+use crate::args::{self, CasePolicy};
+use crate::jail::{Command, JailResult, WaitStatus};
+
+/// The placeholder for the case name in the stdio and meta paths.
+const CASE_PLACEHOLDER: &str = "{case}";
+
+/// One entry of the case list.
+#[derive(Debug, Clone)]
+pub struct Case {
+    /// The group (subtask) of the case.
+    pub group: String,
+    /// The name of the case.
+    pub name: String,
+    /// The file with the expected output of the case, if any.
+    pub expected: Option<String>,
+}
+
+/// The outcome of a case.
+#[derive(Debug)]
+pub struct CaseResult {
+    /// The case.
+    pub case: Case,
+    /// The result of the run, or `None` if the case was skipped or could not be run.
+    pub result: Option<JailResult>,
+    /// Whether the case failed.
+    pub failed: bool,
+    /// Why the case could not be run or checked, if it could not.
+    pub error: Option<String>,
+}
+
+fn parse_cases(path: &str) -> Result<Vec<Case>> {
+    let contents = read_to_string(path).with_context(|| anyhow!("read {:?}", path))?;
+    let mut cases = Vec::new();
+    for (lineno, line) in contents.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let fields: Vec<&str> = line.split_ascii_whitespace().collect();
+        if fields.len() != 2 && fields.len() != 3 {
+            bail!(
+                "{}:{}: invalid case description: {:?}",
+                path,
+                lineno + 1,
+                line
+            );
+        }
+        cases.push(Case {
+            group: fields[0].to_string(),
+            name: fields[1].to_string(),
+            expected: fields.get(2).map(|s| s.to_string()),
+        });
+    }
+    Ok(cases)
+}
+
+fn case_path(template: &Option<String>, case: &Case) -> Option<String> {
+    template
+        .as_ref()
+        .map(|template| template.replace(CASE_PLACEHOLDER, &case.name))
+}
+
+/// Whether the run of `case` failed.
+fn case_failed(case: &Case, stdout: &Option<String>, result: &JailResult) -> Result<bool> {
+    match result.status {
+        WaitStatus::Exited(_, 0) => {}
+        _ => return Ok(true),
+    }
+    let expected = match &case.expected {
+        Some(expected) => expected,
+        None => return Ok(false),
+    };
+    let stdout = stdout
+        .as_ref()
+        .ok_or_else(|| anyhow!("expected outputs require --stdout"))?;
+    let actual = read(stdout).with_context(|| anyhow!("read {:?}", stdout))?;
+    let expected = read(expected).with_context(|| anyhow!("read {:?}", expected))?;
+    Ok(!actual
+        .split(u8::is_ascii_whitespace)
+        .filter(|token| !token.is_empty())
+        .eq(expected
+            .split(u8::is_ascii_whitespace)
+            .filter(|token| !token.is_empty())))
+}
+
+/// Writes the meta file of a case that could not be run or checked.
+fn write_error_meta(meta: &str, err: &anyhow::Error) -> Result<()> {
+    write(
+        meta,
+        format!("error:{}\n", format!("{:#}", err).replace('\n', " ")),
+    )
+    .with_context(|| anyhow!("write {:?}", meta))
+}
+
+/// Runs a single case and returns its result and whether it failed.
+fn run_case(args: &args::Args, case: &Case, meta: Option<String>) -> Result<(JailResult, bool)> {
+    let stdout = case_path(&args.stdout, case);
+    let stderr = case_path(&args.stderr, case);
+    if let Some(stderr) = &stderr {
+        // The stderr file is opened for appending, so make sure nothing from a previous run is
+        // left over.
+        write(stderr, b"").with_context(|| anyhow!("truncate {:?}", stderr))?;
+    }
+    let mut case_args = args.clone();
+    case_args.cases = None;
+    case_args.stdin = case_path(&args.stdin, case);
+    case_args.stdin_pack = case_path(&args.stdin_pack, case);
+    case_args.stdout = stdout.clone();
+    case_args.stderr = stderr;
+    case_args.meta = meta;
+    let result = Command::new(case_args)
+        .status()
+        .with_context(|| anyhow!("run case {:?}", &case.name))?;
+    let failed = case_failed(case, &stdout, &result)
+        .with_context(|| anyhow!("check case {:?}", &case.name))?;
+    Ok((result, failed))
+}
+
+/// Runs all the cases in the case list of `args`, following its case policy.
+pub(crate) fn run(args: args::Args) -> Result<Vec<CaseResult>> {
+    let cases_path = args
+        .cases
+        .clone()
+        .ok_or_else(|| anyhow!("--cases missing"))?;
+    if args.run.is_none() {
+        bail!("--cases can only be used with --run");
+    }
+    let cases = parse_cases(&cases_path)?;
+
+    let mut failed_groups = HashSet::<String>::new();
+    let mut results = Vec::with_capacity(cases.len());
+    for case in cases {
+        let meta = case_path(&args.meta, &case);
+        let skip = match args.case_policy {
+            CasePolicy::All => false,
+            CasePolicy::StopGroup => failed_groups.contains(&case.group),
+            CasePolicy::StopAll => !failed_groups.is_empty(),
+        };
+        if skip {
+            if let Some(meta) = &meta {
+                write(meta, b"skipped:1\n").with_context(|| anyhow!("write {:?}", meta))?;
+            }
+            results.push(CaseResult {
+                case: case,
+                result: None,
+                failed: false,
+                error: None,
+            });
+            continue;
+        }
+
+        let (result, failed, error) = match run_case(&args, &case, meta.clone()) {
+            Ok((result, failed)) => (Some(result), failed, None),
+            Err(err) => {
+                log::error!("{:#}", err);
+                if let Some(meta) = &meta {
+                    write_error_meta(meta, &err)?;
+                }
+                (None, true, Some(format!("{:#}", err)))
+            }
+        };
+        if failed {
+            failed_groups.insert(case.group.clone());
+        }
+        results.push(CaseResult {
+            case: case,
+            result: result,
+            failed: failed,
+            error: error,
+        });
+    }
+
+    Ok(results)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{read_to_string, write};
+    use std::time::Duration;
+
+    use anyhow::{anyhow, Context, Result};
+    use nix::sys::signal::Signal;
+    use nix::unistd::Pid;
+    use tempdir::TempDir;
+
+    use crate::jail::cases::{case_failed, parse_cases, write_error_meta, Case};
+    use crate::jail::{JailResult, WaitStatus};
+
+    fn result(status: WaitStatus) -> JailResult {
+        JailResult {
+            status: status,
+            user_time: Duration::ZERO,
+            system_time: Duration::ZERO,
+            wall_time: Duration::ZERO,
+            max_rss: 0,
+            max_anon_huge_pages: None,
+            main_thread_time: None,
+            runtime_threads_time: None,
+            sigsys_fallback: false,
+        }
+    }
+
+    #[test]
+    fn parse_cases_skips_blank_lines_and_comments() -> Result<()> {
+        let tmp_dir = TempDir::new("cases")?;
+        let path = tmp_dir.path().join("cases");
+        write(
+            &path,
+            "# group name expected\n\n1 1.a\n  1\t1.b  1.b.out \n# 2 2.a\n2 2.a\n",
+        )?;
+
+        let cases = parse_cases(path.to_str().unwrap())?;
+        let cases: Vec<_> = cases
+            .iter()
+            .map(|case| {
+                (
+                    case.group.as_str(),
+                    case.name.as_str(),
+                    case.expected.as_deref(),
+                )
+            })
+            .collect();
+        assert_eq!(
+            cases,
+            vec![
+                ("1", "1.a", None),
+                ("1", "1.b", Some("1.b.out")),
+                ("2", "2.a", None),
+            ]
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn parse_cases_rejects_invalid_lines() -> Result<()> {
+        let tmp_dir = TempDir::new("cases")?;
+        for (contents, lineno) in [("1 1.a\n1\n", 2), ("1 1.a 1.a.out extra\n", 1)] {
+            let path = tmp_dir.path().join("cases");
+            write(&path, contents)?;
+            let err = parse_cases(path.to_str().unwrap()).unwrap_err();
+            assert!(
+                err.to_string()
+                    .contains(&format!("{}:{}:", path.display(), lineno)),
+                "unexpected error for {:?}: {:#}",
+                contents,
+                err
+            );
+        }
+        assert!(parse_cases(tmp_dir.path().join("missing").to_str().unwrap()).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn case_failed_checks_the_exit_status() -> Result<()> {
+        let case = Case {
+            group: String::from("1"),
+            name: String::from("1.a"),
+            expected: None,
+        };
+        let pid = Pid::from_raw(2);
+        assert!(!case_failed(
+            &case,
+            &None,
+            &result(WaitStatus::Exited(pid, 0))
+        )?);
+        assert!(case_failed(
+            &case,
+            &None,
+            &result(WaitStatus::Exited(pid, 1))
+        )?);
+        assert!(case_failed(
+            &case,
+            &None,
+            &result(WaitStatus::Signaled(pid, Signal::SIGKILL))
+        )?);
+        Ok(())
+    }
+
+    #[test]
+    fn case_failed_compares_tokens() -> Result<()> {
+        let tmp_dir = TempDir::new("cases")?;
+        let expected = tmp_dir.path().join("1.a.out");
+        write(&expected, "1 2\n3\n")?;
+        let case = Case {
+            group: String::from("1"),
+            name: String::from("1.a"),
+            expected: Some(expected.to_str().unwrap().to_string()),
+        };
+        let stdout = tmp_dir.path().join("1.a.stdout");
+        let stdout_path = Some(stdout.to_str().unwrap().to_string());
+        let exited = result(WaitStatus::Exited(Pid::from_raw(2), 0));
+
+        for (contents, failed) in [
+            ("1 2\n3\n", false),
+            ("  1\t2 3", false),
+            ("1 2\n", true),
+            ("1 2 3 4\n", true),
+            ("1 23\n", true),
+        ] {
+            write(&stdout, contents)?;
+            assert_eq!(
+                case_failed(&case, &stdout_path, &exited)?,
+                failed,
+                "stdout {:?}",
+                contents
+            );
+        }
+
+        // Expected outputs cannot be checked without a stdout file.
+        assert!(case_failed(&case, &None, &exited).is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn write_error_meta_writes_a_single_line() -> Result<()> {
+        let tmp_dir = TempDir::new("cases")?;
+        let meta = tmp_dir.path().join("1.a.meta");
+        let err = Err::<(), _>(anyhow!("open \"1.a.in\"\nNo such file or directory"))
+            .context("run case \"1.a\"")
+            .unwrap_err();
+        write_error_meta(meta.to_str().unwrap(), &err)?;
+        assert_eq!(
+            read_to_string(&meta)?,
+            "error:run case \"1.a\": open \"1.a.in\" No such file or directory\n"
+        );
+        Ok(())
+    }
+}
@@ -1,5 +1,5 @@
 use std::fmt::Debug;
-use std::fs::{create_dir, remove_dir, write};
+use std::fs::{create_dir, read_to_string, remove_dir, write, File};
 use std::io::ErrorKind;
 use std::ops::Drop;
 use std::path::{Path, PathBuf};
@@ -70,6 +70,33 @@ impl CGroup {
             .with_context(|| anyhow!("write {} to {:?}", limit, &memory_max_path))
     }
 
+    /// Returns the number of processes in the cgroup that were killed by the OOM killer.
+    pub(crate) fn oom_kills(&self) -> Result<u64> {
+        let events_path = self.path.join(if self.v2 {
+            "memory.events"
+        } else {
+            "memory.oom_control"
+        });
+        let events =
+            read_to_string(&events_path).with_context(|| anyhow!("read {:?}", &events_path))?;
+        for line in events.lines() {
+            if let Some(count) = line.strip_prefix("oom_kill ") {
+                return count
+                    .trim()
+                    .parse()
+                    .with_context(|| anyhow!("parse {:?} in {:?}", line, &events_path));
+            }
+        }
+        Ok(0)
+    }
+
+    /// Opens the memory statistics of the cgroup, so that they can be read from a process that
+    /// does not have the cgroup filesystem mounted.
+    pub(crate) fn open_memory_stat(&self) -> Result<File> {
+        let stat_path = self.path.join("memory.stat");
+        File::open(&stat_path).with_context(|| anyhow!("open {:?}", &stat_path))
+    }
+
     pub(crate) fn is_cgroup_v2() -> bool {
         return Path::new("/sys/fs/cgroup/cgroup.controllers").exists();
     }
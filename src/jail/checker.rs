@@ -0,0 +1,308 @@
+//! Running the contestant and a custom checker back to back.
+//!
+//! Problems with custom checkers would otherwise need the contestant's stdout to be written to
+//! disk, and a second omegajail invocation for the checker to read it back. Instead, the
+//! contestant's stdout is captured in a memfd, which is sealed once the contestant exits and is
+//! then given to the checker as its stdin. The input and the expected output of the case are
+//! bind-mounted read-only in the checker's homedir as `data.in` and `data.out` (or symlinked, when
+//! sandboxing is disabled). They are not passed as extra file descriptors, since the sandboxed
+//! init closes everything but stdio. The checker's homedir is shared by all the runs of a
+//! problem, so the checker actually runs in a private, per-run copy of it (see
+//! [`CheckerHomedir`]) and the shared one is never modified.
+//!
+//! The checker is expected to print the score of the case (a number between 0 and 1) as the
+//! first token of its stdout. The meta file of the contestant is extended with the result of the
+//! checker (`checker-time`, `checker-status` / `checker-signal`) and, if it exited cleanly, the
+//! `score`.
+
+use std::ffi::CString;
+use std::fs::{canonicalize, create_dir, metadata, read_dir, remove_dir_all, File};
+use std::io::{copy, ErrorKind, Read, Seek, SeekFrom, Write};
+use std::ops::Drop;
+use std::os::unix::fs::symlink;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, bail, Context, Result};
+use nix::fcntl::{fcntl, FcntlArg, SealFlag};
+use nix::sys::memfd::{memfd_create, MemFdCreateFlag};
+use rand::{thread_rng, Rng};
+
+use crate::args;
+use crate::jail::options::JailOptions;
+use crate::jail::{Jail, JailResult, WaitStatus};
+
+/// The time limit of the checker, if none was provided.
+const DEFAULT_CHECKER_TIME_LIMIT_MSEC: u64 = 10_000;
+/// The memory limit of the checker, if none was provided.
+const DEFAULT_CHECKER_MEMORY_LIMIT: u64 = 1024 * 1024 * 1024;
+/// The largest checker output that will be read.
+const MAX_CHECKER_OUTPUT_SIZE: u64 = 4096;
+
+/// The outcome of a contestant run and its checker.
+#[derive(Debug)]
+pub struct CheckedResult {
+    /// The result of the contestant's run.
+    pub result: JailResult,
+    /// The result of the checker's run, or `None` if the contestant did not exit cleanly.
+    pub checker_result: Option<JailResult>,
+    /// The score reported by the checker, if it exited cleanly and printed one.
+    pub score: Option<f64>,
+}
+
+pub(crate) fn create_memfd(name: &str) -> Result<File> {
+    let fd = memfd_create(
+        &CString::new(name)?,
+        MemFdCreateFlag::MFD_CLOEXEC | MemFdCreateFlag::MFD_ALLOW_SEALING,
+    )
+    .with_context(|| anyhow!("memfd_create({:?})", name))?;
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+/// Prevents any further modification of `file`, and returns a new read-only file description for
+/// it, so that its offset is not shared with the process that wrote it.
+pub(crate) fn seal(file: &File) -> Result<File> {
+    fcntl(
+        file.as_raw_fd(),
+        FcntlArg::F_ADD_SEALS(
+            SealFlag::F_SEAL_SEAL
+                | SealFlag::F_SEAL_SHRINK
+                | SealFlag::F_SEAL_GROW
+                | SealFlag::F_SEAL_WRITE,
+        ),
+    )
+    .context("fcntl(F_ADD_SEALS)")?;
+    let path = format!("/proc/self/fd/{}", file.as_raw_fd());
+    File::open(&path).with_context(|| anyhow!("open {:?}", &path))
+}
+
+/// A private, per-run homedir for the checker. It has an entry for every entry of the checker's
+/// shared homedir, plus `data.in` and `data.out`. With sandboxing, the entries are empty targets
+/// that are bind-mounted over in the checker's mount namespace; without it, they are symlinks.
+/// Either way, nothing is written to the shared homedir, and concurrent runs do not interfere with
+/// each other. The directory is removed when this is dropped.
+struct CheckerHomedir {
+    path: PathBuf,
+}
+
+impl CheckerHomedir {
+    fn new() -> Result<CheckerHomedir> {
+        let tmp_dir = std::env::temp_dir();
+        let mut rng = thread_rng();
+        for _ in 0..16 {
+            let path = tmp_dir.join(format!("omegajail_checker_{:016x}", rng.gen::<u64>()));
+            if let Err(err) = create_dir(&path) {
+                if err.kind() == ErrorKind::AlreadyExists {
+                    continue;
+                }
+                bail!("create_dir({:?}): {:#}", &path, err);
+            }
+            return Ok(CheckerHomedir { path: path });
+        }
+
+        bail!(
+            "could not create a checker homedir in {:?} after 16 rounds",
+            tmp_dir
+        );
+    }
+
+    fn path(&self) -> Result<&str> {
+        self.path
+            .to_str()
+            .ok_or_else(|| anyhow!("could not convert path to string"))
+    }
+
+    /// Makes `source` available as `name` in the homedir, and returns the description of the
+    /// bind-mount for it. The bind-mount is also needed without sandboxing, since Landlock allows
+    /// the sources of the bind-mounts.
+    fn add(&self, source: &Path, name: &str, disable_sandboxing: bool) -> Result<String> {
+        let source = canonicalize(source).with_context(|| anyhow!("canonicalize({:?})", source))?;
+        let target = self.path.join(name);
+        if disable_sandboxing {
+            // There are no bind-mounts without sandboxing, so the file is symlinked instead.
+            symlink(&source, &target).with_context(|| anyhow!("symlink {:?}", &target))?;
+        } else if metadata(&source)
+            .with_context(|| anyhow!("stat {:?}", &source))?
+            .is_dir()
+        {
+            // The homedir is mounted read-only, so the bind target needs to exist beforehand.
+            create_dir(&target).with_context(|| anyhow!("create {:?}", &target))?;
+        } else {
+            File::create(&target).with_context(|| anyhow!("create {:?}", &target))?;
+        }
+        Ok(format!(
+            "{}:/home/{}",
+            source
+                .to_str()
+                .ok_or_else(|| anyhow!("could not convert path to string"))?,
+            name
+        ))
+    }
+}
+
+impl Drop for CheckerHomedir {
+    fn drop(&mut self) {
+        if let Err(err) = remove_dir_all(&self.path) {
+            log::error!("remove_dir_all({:?}): {:#}", &self.path, err);
+        }
+    }
+}
+
+/// The arguments for the checker's jail, derived from the contestant's, and the private homedir
+/// they refer to, which must be kept alive until the checker exits.
+fn checker_args(args: &args::Args) -> Result<(args::Args, CheckerHomedir)> {
+    let shared_homedir = args
+        .checker_homedir
+        .as_ref()
+        .ok_or_else(|| anyhow!("--checker requires --checker-homedir"))?;
+    let homedir = CheckerHomedir::new()?;
+    let mut checker_args = args.clone();
+    checker_args.run = args.checker;
+    checker_args.run_target = args.checker_target.clone();
+    checker_args.homedir = homedir.path()?.to_string();
+    checker_args.cases = None;
+    checker_args.thp = None;
+    checker_args.homedir_writable = false;
+    checker_args.stdin = None;
+    checker_args.stdout = None;
+    checker_args.stderr = args.checker_stderr.clone();
+    checker_args.meta = None;
+    checker_args.profile = None;
+    checker_args.result_cache = None;
+    checker_args.time_limit = Some(
+        args.checker_time_limit
+            .unwrap_or(DEFAULT_CHECKER_TIME_LIMIT_MSEC),
+    );
+    checker_args.memory_limit = Some(
+        args.checker_memory_limit
+            .unwrap_or(DEFAULT_CHECKER_MEMORY_LIMIT),
+    );
+    checker_args.output_limit = Some(MAX_CHECKER_OUTPUT_SIZE);
+    checker_args.extra_args = vec![];
+    checker_args.bind = vec![];
+    let data: Vec<(&String, &str)> = [
+        (&args.stdin, "data.in"),
+        (&args.checker_expected, "data.out"),
+    ]
+    .into_iter()
+    .filter_map(|(source, name)| source.as_ref().map(|source| (source, name)))
+    .collect();
+    for entry in
+        read_dir(shared_homedir).with_context(|| anyhow!("read_dir({:?})", shared_homedir))?
+    {
+        let entry = entry.with_context(|| anyhow!("read_dir({:?})", shared_homedir))?;
+        let name = entry.file_name();
+        let name = name
+            .to_str()
+            .ok_or_else(|| anyhow!("could not convert {:?} to string", name))?;
+        // Any leftover data files in the shared homedir are shadowed by the ones of this run.
+        if data.iter().any(|(_, data_name)| *data_name == name) {
+            continue;
+        }
+        checker_args
+            .bind
+            .push(homedir.add(&entry.path(), name, args.disable_sandboxing)?);
+    }
+    for (source, name) in data {
+        checker_args
+            .bind
+            .push(homedir.add(Path::new(source), name, args.disable_sandboxing)?);
+    }
+    Ok((checker_args, homedir))
+}
+
+fn append_checker_meta(meta: &str, checker_result: &JailResult, score: Option<f64>) -> Result<()> {
+    let mut meta_file = File::options()
+        .append(true)
+        .open(meta)
+        .with_context(|| anyhow!("open {:?}", meta))?;
+    let mut contents = format!("checker-time:{}\n", checker_result.user_time.as_micros());
+    match checker_result.status {
+        WaitStatus::Exited(_, status) => contents.push_str(&format!("checker-status:{}\n", status)),
+        WaitStatus::Signaled(_, signal) => {
+            contents.push_str(&format!("checker-signal:{}\n", signal.as_str()))
+        }
+        WaitStatus::Syscalled(_, _) => contents.push_str("checker-signal:SIGSYS\n"),
+    }
+    if let Some(score) = score {
+        contents.push_str(&format!("score:{}\n", score));
+    }
+    meta_file
+        .write_all(contents.as_bytes())
+        .with_context(|| anyhow!("write {:?}", meta))
+}
+
+/// Runs the contestant described by `args`, followed by its checker.
+pub(crate) fn run(args: args::Args) -> Result<CheckedResult> {
+    if args.run.is_none() {
+        bail!("--checker can only be used with --run");
+    }
+    let (checker_args, _checker_homedir) = checker_args(&args)?;
+
+    let contestant_stdout = create_memfd("contestant-stdout")?;
+    let mut contestant_options =
+        JailOptions::new(args.clone()).context("create contestant jail options")?;
+    contestant_options.redirect_stdout(contestant_stdout.as_raw_fd());
+    let result = Jail::new(contestant_options)?.wait()?;
+    let mut contestant_stdout = seal(&contestant_stdout)?;
+
+    if let Some(stdout) = &args.stdout {
+        // The runner might still want to keep the contestant's output around.
+        copy(
+            &mut contestant_stdout,
+            &mut File::create(stdout).with_context(|| anyhow!("create {:?}", stdout))?,
+        )
+        .with_context(|| anyhow!("copy contestant stdout to {:?}", stdout))?;
+        contestant_stdout
+            .seek(SeekFrom::Start(0))
+            .context("rewind contestant stdout")?;
+    }
+
+    match result.status {
+        WaitStatus::Exited(_, 0) => {}
+        _ => {
+            return Ok(CheckedResult {
+                result: result,
+                checker_result: None,
+                score: None,
+            })
+        }
+    }
+
+    let mut checker_stdout = create_memfd("checker-stdout")?;
+    let mut checker_options =
+        JailOptions::new(checker_args).context("create checker jail options")?;
+    checker_options.redirect_stdin(contestant_stdout.as_raw_fd());
+    checker_options.redirect_stdout(checker_stdout.as_raw_fd());
+    let checker_result = Jail::new(checker_options)?.wait()?;
+
+    let score = match checker_result.status {
+        WaitStatus::Exited(_, 0) => {
+            let mut output = String::new();
+            checker_stdout
+                .seek(SeekFrom::Start(0))
+                .context("rewind checker stdout")?;
+            (&mut checker_stdout)
+                .take(MAX_CHECKER_OUTPUT_SIZE)
+                .read_to_string(&mut output)
+                .context("read checker stdout")?;
+            output
+                .split_ascii_whitespace()
+                .next()
+                .and_then(|token| token.parse::<f64>().ok())
+                .filter(|score| score.is_finite())
+                .map(|score| score.clamp(0.0, 1.0))
+        }
+        _ => None,
+    };
+
+    if let Some(meta) = &args.meta {
+        append_checker_meta(meta, &checker_result, score)?;
+    }
+
+    Ok(CheckedResult {
+        result: result,
+        checker_result: Some(checker_result),
+        score: score,
+    })
+}
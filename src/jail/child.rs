@@ -8,9 +8,13 @@ use nix::sys::resource::{setrlimit, Resource};
 use nix::sys::signal::{sigprocmask, SigSet, SigmaskHow};
 use nix::unistd::execve;
 
+use crate::args::{ServiceCoreCharge, ThpMode};
 use crate::jail::options::JailOptions;
 use crate::jail::{write_message, SendSeccompFDEvent};
-use crate::sys::{seccomp_set_mode_filter, seccomp_set_mode_filter_with_listener, SendFile};
+use crate::sys::{
+    seccomp_set_mode_filter, seccomp_set_mode_filter_with_listener, set_no_new_privs,
+    set_thp_disable, SendFile,
+};
 
 pub(crate) fn run(
     mut child_sock: UnixStream,
@@ -20,8 +24,31 @@ pub(crate) fn run(
     setup_process_limits(&opts).context("setup net namespace")?;
     setup_signal_handlers().context("setup signal handlers")?;
 
+    if let Some(landlock) = &opts.landlock {
+        set_no_new_privs().context("set_no_new_privs")?;
+        landlock.restrict_self().context("landlock")?;
+    }
     if !opts.disable_sandboxing {
         setup_seccomp_bpf(&mut child_sock, &opts).context("setup_seccomp_bpf")?;
+    } else if let Some(landlock) = &opts.landlock {
+        // Containers may not allow installing seccomp-bpf filters, or at least not with a user
+        // notification listener, so without namespaces this is only done when possible. Without a
+        // pid or network namespace, seccomp-bpf is what keeps the jailed process away from the
+        // syscalls that Landlock does not cover (like ptrace or UDP sockets), so it is mandatory
+        // with --landlock=required.
+        if let Err(err) = setup_seccomp_bpf(&mut child_sock, &opts) {
+            if landlock.required() {
+                return Err(err.context("setup_seccomp_bpf"));
+            }
+            log::warn!("setup_seccomp_bpf: {:#}", err);
+            write_message(
+                &mut child_sock,
+                SendSeccompFDEvent {
+                    fd_available: false,
+                },
+            )
+            .context("write parent setup done event")?;
+        }
     }
     std::mem::drop(child_sock);
 
@@ -51,7 +78,11 @@ fn setup_process_limits(opts: &JailOptions) -> Result<()> {
     setrlimit(Resource::RLIMIT_STACK, None, None)
         .context("setrlimit(RLIMIT_STACK, RLIM_INFINITY, RLIM_INFINITY)")?;
     setrlimit(Resource::RLIMIT_CORE, Some(0), Some(0)).context("setrlimit(RLIMIT_CORE, 0, 0)")?;
-    if let Some(time_limit) = opts.time_limit {
+    if let Some(mut time_limit) = opts.time_limit {
+        if opts.service_core.is_some() && opts.service_core_charge == ServiceCoreCharge::Main {
+            // Only the main thread is charged, but the whole process can use two CPUs.
+            time_limit *= 2;
+        }
         let soft_limit = time_limit.as_secs()
             + match time_limit.subsec_millis() {
                 0 => 0,
@@ -79,6 +110,11 @@ fn setup_process_limits(opts: &JailOptions) -> Result<()> {
             )?;
         }
     }
+    match opts.thp {
+        Some(ThpMode::Never) => set_thp_disable(false)?,
+        Some(ThpMode::Advised) => set_thp_disable(true)?,
+        Some(ThpMode::Host) | None => {}
+    }
     Ok(())
 }
 
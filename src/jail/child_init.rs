@@ -1,8 +1,13 @@
-use std::fs::{create_dir_all, metadata, File};
+use std::collections::HashMap;
+use std::fs::{
+    create_dir_all, metadata, read_dir, read_to_string, remove_dir_all, DirBuilder, File,
+};
+use std::io::ErrorKind;
 use std::ops::Add;
-use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::fs::{DirBuilderExt, FileExt, OpenOptionsExt};
 use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
 use std::os::unix::net::UnixStream;
+use std::path::Path;
 use std::time::{Duration, Instant};
 
 use anyhow::{anyhow, bail, Context, Result};
@@ -20,22 +25,27 @@ use nix::unistd::{
     setresgid, setresuid, ForkResult, Pid,
 };
 
+use crate::args::ServiceCoreCharge;
+use crate::jail::adjudicator::Adjudicator;
+use crate::jail::landlock::LandlockRules;
+use crate::jail::minimal_init;
 use crate::jail::options::{JailOptions, Stdio};
+use crate::jail::profile::Profiler;
 use crate::jail::{
-    read_message, write_message, ParentSetupDoneEvent, SendSeccompFDEvent, SetupCgroupRequest,
-    SetupCgroupResponse,
+    read_message, write_message, ParentSetupDoneEvent, ProfileEvent, SendSeccompFDEvent,
+    SetupCgroupRequest, SetupCgroupResponse,
 };
 use crate::sys::{
     capset, close_range, pidfd_open, seccomp_get_notification_size, seccomp_read_notification,
-    set_all_securebits, set_no_new_privs, waitid, Capabilities, RecvFile, SendFile, WaitStatus,
-    WaitidStatus, WaitidWhich,
+    seccomp_send_notification_response, set_all_securebits, set_no_new_privs, waitid, Capabilities,
+    RecvFile, SendFile, WaitStatus, WaitidStatus, WaitidWhich,
 };
 
 // Used to pass None to nix::mount::mount
 const NONE: Option<&'static [u8]> = None;
 
 pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result<()> {
-    set_cpu_affinity().context("set cpu affinity")?;
+    set_cpu_affinity(opts.service_core).context("set cpu affinity")?;
 
     read_message::<ParentSetupDoneEvent>(&mut parent_jail_sock)
         .context("wait for parent setup done")?;
@@ -47,6 +57,25 @@ pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result
     let gid = getgid();
     setresgid(gid, gid, gid).context("setresgid")?;
 
+    // The minimal init is opened before the mount namespace is set up, since it lives outside of
+    // the root of the jail.
+    let init_file = match &opts.minimal_init {
+        Some(path) if minimal_init_supported(&opts) => {
+            match File::options()
+                .read(true)
+                .custom_flags(libc::O_PATH | libc::O_CLOEXEC)
+                .open(path)
+            {
+                Ok(f) => Some(f),
+                Err(err) => {
+                    log::warn!("open minimal init {:?}: {:#}", path, err);
+                    None
+                }
+            }
+        }
+        _ => None,
+    };
+
     if !opts.disable_sandboxing {
         setup_net_namespace().context("setup net namespace")?;
         setup_mount_namespace(&opts).context("setup mount namespace")?;
@@ -56,22 +85,12 @@ pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result
         setup_unsandboxed_filesystem(&opts).context("setup filesystem")?;
     }
 
-    let parent_jail_sock_fd = parent_jail_sock.as_raw_fd();
-    let first_range_fd = unsafe {
-        (
-            RawFd::from_raw_fd(3),
-            RawFd::from_raw_fd(parent_jail_sock_fd - 1),
-        )
-    };
-    let second_range_fd = unsafe { RawFd::from_raw_fd(parent_jail_sock_fd + 1) };
     if !opts.disable_sandboxing {
-        if first_range_fd.0 < first_range_fd.1 {
-            close_range(first_range_fd.0, Some(first_range_fd.1), 0).with_context(|| {
-                anyhow!("close_range({}, {})", first_range_fd.0, first_range_fd.1)
-            })?;
+        let mut keep_fds = vec![parent_jail_sock.as_raw_fd()];
+        if let Some(init_file) = &init_file {
+            keep_fds.push(init_file.as_raw_fd());
         }
-        close_range(second_range_fd, None, 0)
-            .with_context(|| anyhow!("close_range({}, ~0U)", second_range_fd))?;
+        close_fds_except(&mut keep_fds).context("close file descriptors")?;
     }
 
     let (jail_sock, child_sock) = UnixStream::pair().context("create socket pair")?;
@@ -85,9 +104,13 @@ pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result
         ForkResult::Parent { child, .. } => {
             std::mem::drop(child_sock);
             std::mem::drop(read_pipe);
+            if let Some(service_core) = opts.service_core {
+                move_to_service_core(service_core).context("move to service core")?;
+            }
             let _ = close(libc::STDIN_FILENO);
             let _ = close(libc::STDOUT_FILENO);
 
+            let mut memory_stat = None;
             {
                 write_message(&mut parent_jail_sock, SetupCgroupRequest {})
                     .context("write setup cgroup request")?;
@@ -98,15 +121,71 @@ pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result
                         .send_file(child_pidfd)
                         .context("send child pidfd")?;
                 }
-                read_message::<SetupCgroupResponse>(&mut parent_jail_sock)
+                let response = read_message::<SetupCgroupResponse>(&mut parent_jail_sock)
                     .context("read setup cgroup response")?;
+                if response.memory_stat_available {
+                    memory_stat = Some(
+                        parent_jail_sock
+                            .recv_file()
+                            .context("receive cgroup memory stats")?,
+                    );
+                }
+            }
+            // The child is still blocked on the read pipe, so this will not miss its execve.
+            let mut profiler = match &opts.profile {
+                Some(_) => match Profiler::new(child) {
+                    Ok(profiler) => Some(profiler),
+                    Err(err) => {
+                        log::warn!("start profiler: {:#}", err);
+                        None
+                    }
+                },
+                None => None,
+            };
+            if let Some(init_file) = &init_file {
+                // The jailed process is released by the minimal init, so that its wall time
+                // does not include the time it takes to exec it.
+                let args = minimal_init::Args {
+                    child: child.as_raw(),
+                    wall_time_limit: opts.wall_time_limit.as_micros().try_into()?,
+                    vm_memory_size: opts.vm_memory_size_in_bytes,
+                    seccomp_profile: opts.seccomp_profile_name.clone(),
+                    parent_fd: parent_jail_sock.as_raw_fd(),
+                    jail_fd: jail_sock.as_raw_fd(),
+                    release_fd: write_pipe.as_raw_fd(),
+                };
+                if let Err(err) = minimal_init::exec(init_file, &args) {
+                    log::warn!("exec minimal init: {:#}", err);
+                }
             }
             let child_start = Instant::now();
             let deadline = child_start.add(opts.wall_time_limit);
             std::mem::drop(write_pipe);
 
-            let status = wait_child(child, jail_sock, child_start, deadline, &opts);
+            let status = wait_child(
+                child,
+                jail_sock,
+                child_start,
+                deadline,
+                &opts,
+                memory_stat,
+                &mut profiler,
+            );
+            if let Some(tmpdir) = opts.landlock.as_ref().and_then(LandlockRules::tmpdir) {
+                if let Err(err) = remove_tmpdir(tmpdir) {
+                    log::warn!("{:#}", err);
+                }
+            }
             write_message(&mut parent_jail_sock, status).context("write status")?;
+            if opts.profile.is_some() {
+                write_message(
+                    &mut parent_jail_sock,
+                    ProfileEvent {
+                        collapsed_stacks: profiler.map_or_else(String::new, Profiler::collapse),
+                    },
+                )
+                .context("write profile")?;
+            }
         }
         ForkResult::Child => {
             std::mem::drop(parent_jail_sock);
@@ -124,7 +203,32 @@ pub(crate) fn run(mut parent_jail_sock: UnixStream, opts: JailOptions) -> Result
     Ok(())
 }
 
-fn set_cpu_affinity() -> Result<()> {
+/// Returns whether the jail can be supervised by the minimal init, which does not sample or profile
+/// the child.
+fn minimal_init_supported(opts: &JailOptions) -> bool {
+    !opts.disable_sandboxing
+        && opts.profile.is_none()
+        && opts.thp.is_none()
+        && opts.service_core.is_none()
+}
+
+/// Closes all the file descriptors after stderr, except for the ones in `keep_fds`.
+fn close_fds_except(keep_fds: &mut Vec<RawFd>) -> Result<()> {
+    keep_fds.sort_unstable();
+    let mut first = libc::STDERR_FILENO + 1;
+    for &fd in keep_fds.iter() {
+        if first < fd {
+            close_range(first, Some(fd - 1), 0)
+                .with_context(|| anyhow!("close_range({}, {})", first, fd - 1))?;
+        }
+        first = std::cmp::max(first, fd + 1);
+    }
+    close_range(first, None, 0).with_context(|| anyhow!("close_range({}, ~0U)", first))?;
+
+    Ok(())
+}
+
+fn set_cpu_affinity(service_core: Option<usize>) -> Result<()> {
     // Set the processor affinity mask to a single core. If this process already
     // has an affinity mask set with more than one core set, limit it to the
     // first one in the set.
@@ -140,11 +244,19 @@ fn set_cpu_affinity() -> Result<()> {
         {
             continue;
         }
+        if Some(i) == service_core {
+            continue;
+        }
         new_cpu_set
             .set(i)
             .with_context(|| anyhow!("cpu_set.set({})", i))?;
         break;
     }
+    // The jailed process starts on the main core alone. Its service threads are moved to the
+    // service core by the ThreadSampler once they are told apart from the main thread.
+    if service_core.is_some() && new_cpu_set == CpuSet::new() {
+        bail!("no CPU left for the main thread besides the service core");
+    }
     if cpu_set != new_cpu_set {
         sched_setaffinity(Pid::this(), &new_cpu_set).context("sched_setaffinity")?;
     }
@@ -152,6 +264,18 @@ fn set_cpu_affinity() -> Result<()> {
     Ok(())
 }
 
+/// Moves this process to the service core, so that supervising the child does not take any time
+/// away from its main thread.
+fn move_to_service_core(service_core: usize) -> Result<()> {
+    let mut cpu_set = CpuSet::new();
+    cpu_set
+        .set(service_core)
+        .with_context(|| anyhow!("cpu_set.set({})", service_core))?;
+    sched_setaffinity(Pid::this(), &cpu_set).context("sched_setaffinity")?;
+
+    Ok(())
+}
+
 fn setup_net_namespace() -> Result<()> {
     unshare(CloneFlags::CLONE_NEWNET).context("unshare(CLONE_NEWNET)")?;
     sethostname("omegajail").context("sethostname(omegajail)")?;
@@ -290,6 +414,15 @@ fn setup_mount_namespace(opts: &JailOptions) -> Result<()> {
 fn setup_unsandboxed_filesystem(opts: &JailOptions) -> Result<()> {
     chdir(&opts.homedir).with_context(|| anyhow!("chdir({:?})", opts.homedir))?;
 
+    // Anything left over from a previous run that did not get to clean up is discarded.
+    if let Some(tmpdir) = opts.landlock.as_ref().and_then(LandlockRules::tmpdir) {
+        remove_tmpdir(tmpdir)?;
+        DirBuilder::new()
+            .mode(0o700)
+            .create(tmpdir)
+            .with_context(|| anyhow!("mkdir {:?}", tmpdir))?;
+    }
+
     // Redirect stdio.
     match &opts.stdin {
         Stdio::Mounted(path) => {
@@ -352,6 +485,15 @@ fn setup_unsandboxed_filesystem(opts: &JailOptions) -> Result<()> {
     Ok(())
 }
 
+/// Removes the private temporary directory of an unsandboxed jail, if it exists.
+fn remove_tmpdir(tmpdir: &Path) -> Result<()> {
+    match remove_dir_all(tmpdir) {
+        Ok(()) => Ok(()),
+        Err(err) if err.kind() == ErrorKind::NotFound => Ok(()),
+        Err(err) => Err(anyhow!(err).context(format!("remove {:?}", tmpdir))),
+    }
+}
+
 fn drop_privileges() -> Result<()> {
     set_all_securebits().context("set_all_securebits")?;
     capset(Capabilities {
@@ -372,20 +514,60 @@ fn wait_child(
     child_start: Instant,
     deadline: Instant,
     opts: &JailOptions,
+    memory_stat: Option<File>,
+    profiler: &mut Option<Profiler>,
 ) -> WaitidStatus {
-    let override_status = if !opts.disable_sandboxing {
+    let mut samplers = Samplers {
+        thp: opts.thp.map(|_| ThpSampler::new(child, memory_stat)),
+        threads: opts
+            .service_core
+            .map(|service_core| ThreadSampler::new(child, service_core)),
+    };
+    let monitoring = !samplers.is_empty() || profiler.is_some();
+    let adjudicator = Adjudicator::new(&opts.seccomp_profile_name);
+    let mut sigsys_fallback = false;
+    let override_status = if !opts.disable_sandboxing || opts.landlock.is_some() {
         let seccomp_fd = match wait_receive_seccomp_fd(&mut jail_sock) {
             Err(err) => {
                 log::error!("receive seccomp fd: {:#}", err);
                 let _ = kill(child, Signal::SIGKILL);
                 None
             }
-            Ok(seccomp_fd) => seccomp_fd,
+            Ok(seccomp_fd) => {
+                sigsys_fallback = !opts.disable_sandboxing && seccomp_fd.is_none();
+                seccomp_fd
+            }
         };
-        match wait_read_seccomp_notification(child, deadline, seccomp_fd) {
+        if !opts.disable_sandboxing || seccomp_fd.is_some() || monitoring {
+            match wait_read_seccomp_notification(
+                child,
+                deadline,
+                seccomp_fd,
+                &adjudicator,
+                &mut samplers,
+                profiler,
+            ) {
+                Err(err) => {
+                    log::error!("read seccomp notification: {:#}", err);
+                    let _ = kill(child, Signal::SIGKILL);
+                    None
+                }
+                Ok(result) => result,
+            }
+        } else {
+            None
+        }
+    } else if monitoring {
+        match wait_read_seccomp_notification(
+            child,
+            deadline,
+            None,
+            &adjudicator,
+            &mut samplers,
+            profiler,
+        ) {
             Err(err) => {
-                log::error!("read seccomp notification: {:#}", err);
-                let _ = kill(child, Signal::SIGKILL);
+                log::error!("sample child: {:#}", err);
                 None
             }
             Ok(result) => result,
@@ -394,6 +576,34 @@ fn wait_child(
         None
     };
 
+    let mut status = wait_reap_child(child, child_start, opts.vm_memory_size_in_bytes);
+    status.max_anon_huge_pages = samplers.thp.map(|sampler| sampler.max_anon_huge_pages);
+    if let Some(thread_sampler) = samplers.threads {
+        let cpu_time = status.user_time + status.system_time;
+        let (main_thread_time, runtime_threads_time) = thread_sampler.split(cpu_time);
+        if opts.service_core_charge == ServiceCoreCharge::Main && !cpu_time.is_zero() {
+            let main_thread_share = main_thread_time.as_secs_f64() / cpu_time.as_secs_f64();
+            status.user_time = status.user_time.mul_f64(main_thread_share);
+            status.system_time = status.system_time.mul_f64(main_thread_share);
+        }
+        status.main_thread_time = Some(main_thread_time);
+        status.runtime_threads_time = Some(runtime_threads_time);
+    }
+    if let Some(s) = override_status {
+        status.status = s;
+    }
+    status.sigsys_fallback = sigsys_fallback;
+
+    status
+}
+
+/// Reaps the child, and returns its status with the wall time measured from `child_start`. The
+/// memory reserved for the runtime (`vm_memory_size_in_bytes`) is not counted towards its RSS.
+pub(crate) fn wait_reap_child(
+    child: Pid,
+    child_start: Instant,
+    vm_memory_size_in_bytes: u64,
+) -> WaitidStatus {
     let mut status = match waitid(
         WaitidWhich::Pid(child),
         WaitPidFlag::WEXITED | WaitPidFlag::WSTOPPED,
@@ -407,20 +617,20 @@ fn wait_child(
                 system_time: Duration::ZERO,
                 wall_time: Instant::now().duration_since(child_start),
                 max_rss: 0,
+                max_anon_huge_pages: None,
+                main_thread_time: None,
+                runtime_threads_time: None,
+                sigsys_fallback: false,
             }
         }
         Ok(status) => status,
     };
     status.wall_time = Instant::now().duration_since(child_start);
-    status.max_rss = status.max_rss.saturating_sub(opts.vm_memory_size_in_bytes);
-    if let Some(s) = override_status {
-        status.status = s;
-    }
-
+    status.max_rss = status.max_rss.saturating_sub(vm_memory_size_in_bytes);
     status
 }
 
-fn wait_receive_seccomp_fd(jail_sock: &mut UnixStream) -> Result<Option<File>> {
+pub(crate) fn wait_receive_seccomp_fd(jail_sock: &mut UnixStream) -> Result<Option<File>> {
     let event =
         read_message::<SendSeccompFDEvent>(jail_sock).context("wait for seccomp fd message")?;
     if event.fd_available {
@@ -430,10 +640,290 @@ fn wait_receive_seccomp_fd(jail_sock: &mut UnixStream) -> Result<Option<File>> {
     }
 }
 
-fn wait_read_seccomp_notification(
+/// Where the amount of the child's anonymous memory that is backed by huge pages is read from.
+enum ThpSource {
+    /// The `memory.stat` file of the child's cgroup, which reports it as `anon_thp` (or `rss_huge`
+    /// in cgroup v1), in bytes. Reading it does not touch the child's address space.
+    MemoryStat(File),
+    /// The child's `smaps_rollup`, which reports it as `AnonHugePages`, in kB. Reading it walks
+    /// the child's page tables while holding its mmap lock, so it is only used when the child has
+    /// no cgroup.
+    SmapsRollup(String),
+}
+
+/// Periodically samples how much of the child's anonymous memory is backed by Transparent Huge
+/// Pages. The samples are taken more frequently at the start, so that short-lived processes are
+/// still observed.
+///
+/// The peak cannot be read once after the child exits: its address space is torn down before it
+/// can be reaped, and cgroups only keep the current value.
+struct ThpSampler {
+    source: ThpSource,
+    interval: Duration,
+    next_sample: Instant,
+    max_anon_huge_pages: u64,
+}
+
+impl ThpSampler {
+    const MIN_INTERVAL: Duration = Duration::from_millis(1);
+    const MAX_INTERVAL: Duration = Duration::from_millis(64);
+
+    fn new(child: Pid, memory_stat: Option<File>) -> ThpSampler {
+        ThpSampler {
+            source: match memory_stat {
+                Some(memory_stat) => ThpSource::MemoryStat(memory_stat),
+                None => ThpSource::SmapsRollup(format!("/proc/{}/smaps_rollup", child)),
+            },
+            interval: ThpSampler::MIN_INTERVAL,
+            next_sample: Instant::now().add(ThpSampler::MIN_INTERVAL),
+            max_anon_huge_pages: 0,
+        }
+    }
+
+    /// Takes a sample if it's due, and returns when the next one is.
+    fn sample(&mut self) -> Instant {
+        let now = Instant::now();
+        if now < self.next_sample {
+            return self.next_sample;
+        }
+        // The child might have exited in the meantime, in which case there is nothing to sample.
+        if let Some(anon_huge_pages) = self.read_anon_huge_pages() {
+            self.max_anon_huge_pages = std::cmp::max(self.max_anon_huge_pages, anon_huge_pages);
+        }
+        self.interval = std::cmp::min(self.interval * 2, ThpSampler::MAX_INTERVAL);
+        self.next_sample = now.add(self.interval);
+        self.next_sample
+    }
+
+    /// Returns the amount of the child's anonymous memory that is currently backed by huge pages,
+    /// in bytes.
+    fn read_anon_huge_pages(&self) -> Option<u64> {
+        match &self.source {
+            ThpSource::MemoryStat(memory_stat) => {
+                let contents = read_at_start(memory_stat).ok()?;
+                contents.lines().find_map(|line| {
+                    line.strip_prefix("anon_thp ")
+                        .or_else(|| line.strip_prefix("rss_huge "))
+                        .and_then(|value| value.trim().parse::<u64>().ok())
+                })
+            }
+            ThpSource::SmapsRollup(smaps_rollup_path) => {
+                let contents = read_to_string(smaps_rollup_path).ok()?;
+                contents
+                    .lines()
+                    .find_map(|line| line.strip_prefix("AnonHugePages:"))
+                    .and_then(|value| {
+                        value
+                            .trim()
+                            .trim_end_matches("kB")
+                            .trim()
+                            .parse::<u64>()
+                            .ok()
+                    })
+                    .map(|anon_huge_pages| anon_huge_pages * 1024)
+            }
+        }
+    }
+}
+
+/// Reads the whole contents of `file` from its start, regardless of its current offset.
+fn read_at_start(file: &File) -> std::io::Result<String> {
+    let mut contents = Vec::new();
+    let mut buf = [0u8; 4096];
+    loop {
+        let read = file.read_at(&mut buf, contents.len() as u64)?;
+        if read == 0 {
+            break;
+        }
+        contents.extend_from_slice(&buf[..read]);
+    }
+    Ok(String::from_utf8_lossy(&contents).into_owned())
+}
+
+/// Periodically samples the CPU time of each of the child's threads, so that the time of the main
+/// thread can be told apart from the time of the runtime's service threads. The thread with the
+/// most CPU time is considered to be the main thread.
+///
+/// The samples are taken more frequently at the start, like the ones of [`ThpSampler`]. Whatever
+/// the threads ran after their last sample is only known as part of the total CPU time of the
+/// child, and is charged to the main thread.
+///
+/// After every sample, the main thread is pinned to the main core and the rest of the threads to
+/// the service core, so that the service core (which is shared with other jails) is never used by
+/// the main thread. New threads inherit the core of the thread that created them until the next
+/// sample.
+struct ThreadSampler {
+    task_path: String,
+    interval: Duration,
+    next_sample: Instant,
+    thread_times: HashMap<u32, Duration>,
+    /// The CPUs of the main thread and of the rest of the threads, or `None` if the threads cannot
+    /// be pinned.
+    cpu_sets: Option<(CpuSet, CpuSet)>,
+    /// Whether each thread was last pinned to the service core.
+    pinned_to_service_core: HashMap<u32, bool>,
+}
+
+impl ThreadSampler {
+    const MIN_INTERVAL: Duration = Duration::from_millis(1);
+    const MAX_INTERVAL: Duration = Duration::from_millis(64);
+
+    fn new(child: Pid, service_core: usize) -> ThreadSampler {
+        // The child was forked before this process moved to the service core, so it is still on
+        // the main core.
+        let cpu_sets = match ThreadSampler::cpu_sets(child, service_core) {
+            Ok(cpu_sets) => Some(cpu_sets),
+            Err(err) => {
+                log::warn!("not pinning the service threads: {:#}", err);
+                None
+            }
+        };
+        ThreadSampler {
+            task_path: format!("/proc/{}/task", child),
+            interval: ThreadSampler::MIN_INTERVAL,
+            next_sample: Instant::now().add(ThreadSampler::MIN_INTERVAL),
+            thread_times: HashMap::new(),
+            cpu_sets: cpu_sets,
+            pinned_to_service_core: HashMap::new(),
+        }
+    }
+
+    fn cpu_sets(child: Pid, service_core: usize) -> Result<(CpuSet, CpuSet)> {
+        let main_cpu_set =
+            sched_getaffinity(child).with_context(|| anyhow!("sched_getaffinity({})", child))?;
+        let mut service_cpu_set = CpuSet::new();
+        service_cpu_set
+            .set(service_core)
+            .with_context(|| anyhow!("cpu_set.set({})", service_core))?;
+        Ok((main_cpu_set, service_cpu_set))
+    }
+
+    /// Returns the thread that has spent the most time on the CPU so far.
+    fn main_tid(&self) -> Option<u32> {
+        self.thread_times
+            .iter()
+            .max_by_key(|(_, thread_time)| **thread_time)
+            .map(|(tid, _)| *tid)
+    }
+
+    /// Pins the main thread to the main core, and the rest of the threads to the service core.
+    /// Only the threads whose role changed since the last sample are moved.
+    fn pin_threads(&mut self) {
+        let (main_cpu_set, service_cpu_set) = match &self.cpu_sets {
+            Some(cpu_sets) => cpu_sets,
+            None => return,
+        };
+        let main_tid = self.main_tid();
+        for &tid in self.thread_times.keys() {
+            let service_thread = Some(tid) != main_tid;
+            if self.pinned_to_service_core.get(&tid) == Some(&service_thread) {
+                continue;
+            }
+            let cpu_set = if service_thread {
+                service_cpu_set
+            } else {
+                main_cpu_set
+            };
+            // The thread might have exited in the meantime, in which case it is not retried.
+            if let Err(err) = sched_setaffinity(Pid::from_raw(tid as i32), cpu_set) {
+                log::debug!("sched_setaffinity({}): {:#}", tid, err);
+            }
+            self.pinned_to_service_core.insert(tid, service_thread);
+        }
+    }
+
+    /// Takes a sample if it's due, and returns when the next one is.
+    fn sample(&mut self) -> Instant {
+        let now = Instant::now();
+        if now < self.next_sample {
+            return self.next_sample;
+        }
+        // The child might have exited in the meantime, in which case there is nothing to sample.
+        if let Ok(entries) = read_dir(&self.task_path) {
+            for entry in entries.flatten() {
+                let tid = match entry
+                    .file_name()
+                    .to_str()
+                    .and_then(|s| s.parse::<u32>().ok())
+                {
+                    Some(tid) => tid,
+                    None => continue,
+                };
+                // The first field of schedstat is the time spent on the CPU, in nanoseconds.
+                if let Some(cpu_time) = read_to_string(entry.path().join("schedstat"))
+                    .ok()
+                    .and_then(|contents| {
+                        contents
+                            .split_ascii_whitespace()
+                            .next()
+                            .and_then(|value| value.parse::<u64>().ok())
+                    })
+                {
+                    self.thread_times
+                        .insert(tid, Duration::from_nanos(cpu_time));
+                }
+            }
+            self.pin_threads();
+        }
+        self.interval = std::cmp::min(self.interval * 2, ThreadSampler::MAX_INTERVAL);
+        self.next_sample = now.add(self.interval);
+        self.next_sample
+    }
+
+    /// Splits the total CPU time of the child into the time of the main thread and the time of
+    /// the rest of the threads.
+    fn split(&self, cpu_time: Duration) -> (Duration, Duration) {
+        let main_tid = self.main_tid();
+        let runtime_threads_time = std::cmp::min(
+            cpu_time,
+            self.thread_times
+                .iter()
+                .filter(|(tid, _)| Some(**tid) != main_tid)
+                .map(|(_, thread_time)| *thread_time)
+                .sum(),
+        );
+        (cpu_time - runtime_threads_time, runtime_threads_time)
+    }
+}
+
+/// The periodic samplers of the child.
+pub(crate) struct Samplers {
+    thp: Option<ThpSampler>,
+    threads: Option<ThreadSampler>,
+}
+
+impl Samplers {
+    /// Returns a set of samplers that takes no samples.
+    pub(crate) fn none() -> Samplers {
+        Samplers {
+            thp: None,
+            threads: None,
+        }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.thp.is_none() && self.threads.is_none()
+    }
+
+    /// Takes the samples that are due, and returns when the next one is.
+    fn sample(&mut self) -> Option<Instant> {
+        [
+            self.thp.as_mut().map(ThpSampler::sample),
+            self.threads.as_mut().map(ThreadSampler::sample),
+        ]
+        .into_iter()
+        .flatten()
+        .min()
+    }
+}
+
+pub(crate) fn wait_read_seccomp_notification(
     child: Pid,
     deadline: Instant,
     seccomp_file: Option<File>,
+    adjudicator: &Adjudicator,
+    samplers: &mut Samplers,
+    profiler: &mut Option<Profiler>,
 ) -> Result<Option<WaitStatus>> {
     let epoll_file = unsafe {
         File::from_raw_fd(epoll_create1(EpollCreateFlags::EPOLL_CLOEXEC).context("epoll_create1")?)
@@ -463,17 +953,44 @@ fn wait_read_seccomp_notification(
         )),
     )
     .context("epoll_ctl(EPOLL_CTL_ADD, child_pidfd")?;
+    let profiler_fds = profiler
+        .as_ref()
+        .map_or_else(Vec::new, |profiler| profiler.fds());
+    for &profiler_fd in &profiler_fds {
+        epoll_ctl(
+            epoll_file.as_raw_fd(),
+            EpollOp::EpollCtlAdd,
+            profiler_fd,
+            Some(&mut EpollEvent::new(
+                EpollFlags::EPOLLIN,
+                profiler_fd.try_into()?,
+            )),
+        )
+        .context("epoll_ctl(EPOLL_CTL_ADD, profiler_fd")?;
+    }
 
-    let mut notification_contents =
-        vec![0u8; seccomp_get_notification_size().context("seccomp_get_notification_size")?];
+    let mut notification_contents = if seccomp_fd != -1 {
+        vec![0u8; seccomp_get_notification_size().context("seccomp_get_notification_size")?]
+    } else {
+        vec![]
+    };
 
-    let mut events = vec![EpollEvent::empty(); 2];
+    let mut events = vec![EpollEvent::empty(); 2 + profiler_fds.len()];
     loop {
-        let timeout = deadline.saturating_duration_since(Instant::now());
+        let mut timeout = deadline.saturating_duration_since(Instant::now());
         if timeout == Duration::ZERO {
             kill(child, Signal::SIGKILL).context("kill child")?;
             return Ok(Some(WaitStatus::Signaled(child, Signal::SIGXCPU)));
         }
+        if let Some(next_sample) = samplers.sample() {
+            timeout = std::cmp::min(
+                timeout,
+                next_sample
+                    .saturating_duration_since(Instant::now())
+                    // Round up so that epoll_wait does not spin for sub-millisecond waits.
+                    .add(Duration::from_micros(999)),
+            );
+        }
         let nfds = match epoll_wait(
             epoll_file.as_raw_fd(),
             &mut events,
@@ -490,12 +1007,42 @@ fn wait_read_seccomp_notification(
         for i in 0..nfds {
             if events[i].data() == child_pidfd.as_raw_fd().try_into()? {
                 return Ok(None);
+            } else if events[i].data() != seccomp_fd.try_into().unwrap_or(u64::MAX) {
+                if let Some(profiler) = profiler.as_mut() {
+                    profiler.drain();
+                }
+                if events[i].events().contains(EpollFlags::EPOLLHUP) {
+                    // The event is gone, but the child might still not have been reaped.
+                    epoll_ctl(
+                        epoll_file.as_raw_fd(),
+                        EpollOp::EpollCtlDel,
+                        events[i].data().try_into()?,
+                        None,
+                    )
+                    .context("epoll_ctl(EPOLL_CTL_DEL, profiler_fd")?;
+                }
             } else {
                 let notification =
-                    seccomp_read_notification(seccomp_fd, &mut notification_contents)
-                        .context("seccomp_read_notification")?;
-                kill(child, Signal::SIGKILL).context("kill child")?;
-                return Ok(Some(WaitStatus::Syscalled(child, notification.data.nr)));
+                    match seccomp_read_notification(seccomp_fd, &mut notification_contents)
+                        .context("seccomp_read_notification")?
+                    {
+                        // The process that made the syscall is already gone.
+                        None => continue,
+                        Some(notification) => notification,
+                    };
+                match adjudicator
+                    .adjudicate(&notification.data)
+                    .response(notification.id)
+                {
+                    Some(mut response) => {
+                        seccomp_send_notification_response(seccomp_fd, &mut response)
+                            .context("seccomp_send_notification_response")?;
+                    }
+                    None => {
+                        kill(child, Signal::SIGKILL).context("kill child")?;
+                        return Ok(Some(WaitStatus::Syscalled(child, notification.data.nr)));
+                    }
+                }
             }
         }
     }
@@ -0,0 +1,199 @@
+//! Resource hints for language runtimes.
+//!
+//! Most runtimes size their heaps and thread pools from what they see of the host: Go uses every
+//! host CPU for `GOMAXPROCS`, and neither the CLR, Node nor the GHC RTS know that there is a memory
+//! limit until an allocation fails. These hints tell each runtime about the limits of the jail, so
+//! that the garbage collector works harder as the heap approaches the memory limit, and thread
+//! pools are not sized for CPUs that the jail cannot use.
+//!
+//! A runtime that runs out of heap reports its own out-of-memory error, instead of being killed by
+//! the memory limit of the jail, so the heap limits are set to the memory limit of the problem.
+
+use crate::args;
+
+/// The smallest GHC allocation area (the RTS default).
+const GHC_MIN_ALLOCATION_AREA_IN_BYTES: u64 = 1024 * 1024;
+/// The largest GHC allocation area. Larger areas make minor collections less frequent, but all of
+/// it counts against the memory limit.
+const GHC_MAX_ALLOCATION_AREA_IN_BYTES: u64 = 16 * 1024 * 1024;
+
+/// Environment variables and flags that size a language runtime to the limits of the jail.
+#[derive(Debug, Default)]
+pub(crate) struct RuntimeHints {
+    /// Environment variables, as `NAME=value`.
+    pub env: Vec<String>,
+    /// Flags for the runtime, which go right after the path of its executable.
+    pub runtime_args: Vec<String>,
+}
+
+/// Returns the hints for running a program written in `lang`.
+///
+/// `memory_limit` is the memory limit of the problem (without the extra memory that the jail
+/// allows for the runtime itself), and `cpus` is the number of CPUs the jail can use.
+pub(crate) fn run_hints(
+    lang: args::Language,
+    memory_limit: Option<u64>,
+    cpus: usize,
+) -> RuntimeHints {
+    let mut hints = RuntimeHints::default();
+    match lang {
+        args::Language::Go => {
+            hints.env.push(format!("GOMAXPROCS={}", cpus));
+            if let Some(memory_limit) = memory_limit {
+                // This is a soft limit: the GC runs more often as the heap gets close to it.
+                hints.env.push(format!("GOMEMLIMIT={}", memory_limit));
+            }
+        }
+        args::Language::CSharp | args::Language::CSharpAot => {
+            // NativeAOT programs read the same GC settings as the CLR.
+            hints.env.push(format!("DOTNET_PROCESSOR_COUNT={}", cpus));
+            if let Some(memory_limit) = memory_limit {
+                // The CLR parses its GC settings as hexadecimal numbers.
+                hints
+                    .env
+                    .push(format!("DOTNET_GCHeapHardLimit=0x{:x}", memory_limit));
+            }
+        }
+        args::Language::JavaScript => {
+            hints.env.push(format!("UV_THREADPOOL_SIZE={}", cpus));
+            if let Some(memory_limit) = memory_limit {
+                hints.runtime_args.push(format!(
+                    "--max-old-space-size={}",
+                    std::cmp::max(1, memory_limit / 1024 / 1024)
+                ));
+            }
+        }
+        args::Language::Java | args::Language::Kotlin => {
+            // The heap size is already set with -Xmx, but the JVM sizes its compiler and GC thread
+            // pools from the number of CPUs.
+            hints
+                .runtime_args
+                .push(format!("-XX:ActiveProcessorCount={}", cpus));
+        }
+        args::Language::Haskell => {
+            // These are only honored by programs compiled with -rtsopts (see `compile_hints`).
+            // Otherwise, the RTS prints a warning and ignores them.
+            if let Some(memory_limit) = memory_limit {
+                let allocation_area = (memory_limit / 64).clamp(
+                    GHC_MIN_ALLOCATION_AREA_IN_BYTES,
+                    GHC_MAX_ALLOCATION_AREA_IN_BYTES,
+                );
+                hints
+                    .env
+                    .push(format!("GHCRTS=-M{} -A{}", memory_limit, allocation_area));
+            }
+        }
+        _ => {}
+    }
+    hints
+}
+
+/// Returns the hints for compiling a program written in `lang`, so that the resulting program can
+/// honor the hints of [`run_hints`].
+pub(crate) fn compile_hints(lang: args::Language) -> RuntimeHints {
+    let mut hints = RuntimeHints::default();
+    if lang == args::Language::Haskell {
+        hints.runtime_args.push(String::from("-rtsopts"));
+    }
+    hints
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::args::Language;
+    use crate::jail::hints::{compile_hints, run_hints};
+
+    const MIB: u64 = 1024 * 1024;
+
+    #[test]
+    fn run_hints_size_the_runtimes() {
+        for (lang, env, runtime_args) in [
+            (
+                Language::Go,
+                vec!["GOMAXPROCS=2", "GOMEMLIMIT=268435456"],
+                vec![],
+            ),
+            (
+                Language::CSharp,
+                vec![
+                    "DOTNET_PROCESSOR_COUNT=2",
+                    "DOTNET_GCHeapHardLimit=0x10000000",
+                ],
+                vec![],
+            ),
+            (
+                Language::CSharpAot,
+                vec![
+                    "DOTNET_PROCESSOR_COUNT=2",
+                    "DOTNET_GCHeapHardLimit=0x10000000",
+                ],
+                vec![],
+            ),
+            (
+                Language::JavaScript,
+                vec!["UV_THREADPOOL_SIZE=2"],
+                vec!["--max-old-space-size=256"],
+            ),
+            (Language::Java, vec![], vec!["-XX:ActiveProcessorCount=2"]),
+            (Language::Kotlin, vec![], vec!["-XX:ActiveProcessorCount=2"]),
+            (
+                Language::Haskell,
+                vec!["GHCRTS=-M268435456 -A4194304"],
+                vec![],
+            ),
+            (Language::Cpp17GCC, vec![], vec![]),
+            (Language::Python3, vec![], vec![]),
+        ] {
+            let hints = run_hints(lang, Some(256 * MIB), 2);
+            assert_eq!(hints.env, env, "{:?}", lang);
+            assert_eq!(hints.runtime_args, runtime_args, "{:?}", lang);
+        }
+    }
+
+    #[test]
+    fn run_hints_without_a_memory_limit() {
+        for (lang, env, runtime_args) in [
+            (Language::Go, vec!["GOMAXPROCS=1"], vec![]),
+            (Language::CSharp, vec!["DOTNET_PROCESSOR_COUNT=1"], vec![]),
+            (Language::JavaScript, vec!["UV_THREADPOOL_SIZE=1"], vec![]),
+            (Language::Java, vec![], vec!["-XX:ActiveProcessorCount=1"]),
+            (Language::Haskell, vec![], vec![]),
+        ] {
+            let hints = run_hints(lang, None, 1);
+            assert_eq!(hints.env, env, "{:?}", lang);
+            assert_eq!(hints.runtime_args, runtime_args, "{:?}", lang);
+        }
+    }
+
+    #[test]
+    fn run_hints_clamp_small_and_large_limits() {
+        // Node's heap limit is in MiB, and it must be at least one.
+        assert_eq!(
+            run_hints(Language::JavaScript, Some(MIB / 2), 1).runtime_args,
+            vec!["--max-old-space-size=1"]
+        );
+        // The GHC allocation area is 1/64th of the limit, between 1MiB and 16MiB.
+        assert_eq!(
+            run_hints(Language::Haskell, Some(32 * MIB), 1).env,
+            vec![format!("GHCRTS=-M{} -A{}", 32 * MIB, MIB)]
+        );
+        assert_eq!(
+            run_hints(Language::Haskell, Some(4096 * MIB), 1).env,
+            vec![format!("GHCRTS=-M{} -A{}", 4096 * MIB, 16 * MIB)]
+        );
+    }
+
+    #[test]
+    fn compile_hints_enable_rts_options_for_haskell() {
+        assert_eq!(
+            compile_hints(Language::Haskell).runtime_args,
+            vec!["-rtsopts"]
+        );
+        assert!(compile_hints(Language::Haskell).env.is_empty());
+        for lang in [Language::Go, Language::Java, Language::Cpp17GCC] {
+            let hints = compile_hints(lang);
+            assert!(hints.env.is_empty(), "{:?}", lang);
+            assert!(hints.runtime_args.is_empty(), "{:?}", lang);
+        }
+    }
+}
@@ -0,0 +1,254 @@
+//! Filesystem isolation for when omegajail runs without namespaces.
+//!
+//! When sandboxing is disabled (e.g. in a Docker container, where user namespaces are not
+//! available), there is no mount namespace that hides the rest of the filesystem from the jailed
+//! process. Instead, a [Landlock](https://docs.kernel.org/userspace-api/landlock.html) ruleset
+//! restricts it to the paths that the sandbox would have bind-mounted: the language runtimes, the
+//! homedir, and a handful of devices. stdin/stdout/stderr are already open by the time the
+//! ruleset is enforced, so they do not need any rules.
+//!
+//! There is no pid or network namespace either, so when the kernel supports it the ruleset also
+//! stops the jailed process from signaling processes outside of it (ABI 6), connecting to abstract
+//! unix sockets outside of it (ABI 6), and binding or connecting TCP sockets (ABI 4).
+
+use std::fs::{File, OpenOptions};
+use std::io::ErrorKind;
+use std::os::unix::fs::OpenOptionsExt;
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Context, Result};
+use nix::errno::Errno;
+
+use crate::jail::options::MountArgs;
+use crate::sys::{
+    landlock_abi_version, landlock_add_path_beneath_rule, landlock_create_ruleset,
+    landlock_restrict_self, LandlockRulesetAttr, LANDLOCK_ACCESS_FS_EXECUTE,
+    LANDLOCK_ACCESS_FS_FILE, LANDLOCK_ACCESS_FS_MAKE_BLOCK, LANDLOCK_ACCESS_FS_MAKE_CHAR,
+    LANDLOCK_ACCESS_FS_MAKE_DIR, LANDLOCK_ACCESS_FS_MAKE_FIFO, LANDLOCK_ACCESS_FS_MAKE_REG,
+    LANDLOCK_ACCESS_FS_MAKE_SOCK, LANDLOCK_ACCESS_FS_MAKE_SYM, LANDLOCK_ACCESS_FS_READ_DIR,
+    LANDLOCK_ACCESS_FS_READ_FILE, LANDLOCK_ACCESS_FS_REFER, LANDLOCK_ACCESS_FS_REMOVE_DIR,
+    LANDLOCK_ACCESS_FS_REMOVE_FILE, LANDLOCK_ACCESS_FS_TRUNCATE, LANDLOCK_ACCESS_FS_WRITE_FILE,
+    LANDLOCK_ACCESS_NET_BIND_TCP, LANDLOCK_ACCESS_NET_CONNECT_TCP,
+    LANDLOCK_SCOPE_ABSTRACT_UNIX_SOCKET, LANDLOCK_SCOPE_SIGNAL,
+};
+
+/// The paths that are part of the runtime root of every language.
+const SYSTEM_PATHS: &[&str] = &[
+    "/bin",
+    "/etc",
+    "/lib",
+    "/lib32",
+    "/lib64",
+    "/opt",
+    "/rust-toolchain.toml",
+    "/sbin",
+    "/usr",
+    "/var/lib/omegajail/bin",
+];
+
+/// The paths that runtimes read to learn about the machine.
+///
+/// Only a handful of files in /proc are allowed, since the rest of it exposes the other processes
+/// of the host. `/proc/self` is resolved when the ruleset is created, so it grants the jailed
+/// process access to its own `/proc/<pid>` (and `/proc/thread-self`), but not to that of any
+/// subprocess it spawns.
+const INFORMATION_PATHS: &[&str] = &[
+    "/proc/cpuinfo",
+    "/proc/filesystems",
+    "/proc/loadavg",
+    "/proc/meminfo",
+    "/proc/self",
+    "/proc/stat",
+    "/proc/sys/kernel/osrelease",
+    "/proc/sys/kernel/pid_max",
+    "/proc/sys/vm/overcommit_memory",
+    "/proc/uptime",
+    "/proc/version",
+    "/sys/devices/system/cpu",
+    "/sys/fs/cgroup",
+];
+
+const DEVICE_PATHS: &[&str] = &["/dev/null", "/dev/random", "/dev/urandom", "/dev/zero"];
+
+/// The name of the private temporary directory that is created in writable homedirs.
+const TMPDIR_NAME: &str = ".omegajail-tmp";
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Access {
+    ReadOnly,
+    ReadExecute,
+    ReadWrite,
+    Device,
+}
+
+impl Access {
+    fn rights(self) -> u64 {
+        match self {
+            Access::ReadOnly => LANDLOCK_ACCESS_FS_READ_FILE | LANDLOCK_ACCESS_FS_READ_DIR,
+            Access::ReadExecute => {
+                LANDLOCK_ACCESS_FS_READ_FILE
+                    | LANDLOCK_ACCESS_FS_READ_DIR
+                    | LANDLOCK_ACCESS_FS_EXECUTE
+            }
+            Access::ReadWrite => u64::MAX,
+            Access::Device => {
+                LANDLOCK_ACCESS_FS_READ_FILE
+                    | LANDLOCK_ACCESS_FS_WRITE_FILE
+                    | LANDLOCK_ACCESS_FS_TRUNCATE
+            }
+        }
+    }
+}
+
+/// The set of paths the jailed process is allowed to access.
+pub(crate) struct LandlockRules {
+    rules: Vec<(PathBuf, Access)>,
+    required: bool,
+    tmpdir: Option<PathBuf>,
+}
+
+impl LandlockRules {
+    /// Creates the rules that mirror what a sandboxed run would have mounted.
+    ///
+    /// `mounts` are the bind-mounts of the sandbox, whose sources are allowed read-only, both in
+    /// their original location and where they would have been mounted. If `required` is false,
+    /// kernels without Landlock will run the jailed process without it.
+    ///
+    /// The host's `/tmp` is shared by all the jails, so jails with a writable homedir get a
+    /// private temporary directory inside of it instead (see [`LandlockRules::tmpdir`]).
+    pub(crate) fn new(
+        homedir: &Path,
+        homedir_writable: bool,
+        rootfs: &Path,
+        mounts: &[MountArgs],
+        required: bool,
+    ) -> LandlockRules {
+        let mut rules = Vec::new();
+        for path in SYSTEM_PATHS {
+            rules.push((PathBuf::from(path), Access::ReadExecute));
+        }
+        for path in INFORMATION_PATHS {
+            rules.push((PathBuf::from(path), Access::ReadOnly));
+        }
+        for path in DEVICE_PATHS {
+            rules.push((PathBuf::from(path), Access::Device));
+        }
+        let stdio_path = rootfs.join("mnt/stdio");
+        for mount in mounts {
+            let source = match (&mount.source, &mount.fstype) {
+                (Some(source), None) => source,
+                _ => continue,
+            };
+            if source == homedir || mount.target.starts_with(&stdio_path) {
+                continue;
+            }
+            rules.push((source.clone(), Access::ReadExecute));
+            if let Ok(target) = mount.target.strip_prefix(rootfs) {
+                rules.push((Path::new("/").join(target), Access::ReadExecute));
+            }
+        }
+        let tmpdir = if homedir_writable {
+            rules.push((homedir.to_path_buf(), Access::ReadWrite));
+            Some(homedir.join(TMPDIR_NAME))
+        } else {
+            rules.push((homedir.to_path_buf(), Access::ReadExecute));
+            None
+        };
+
+        LandlockRules {
+            rules,
+            required,
+            tmpdir,
+        }
+    }
+
+    /// Whether the run must fail if any of the restrictions cannot be enforced.
+    pub(crate) fn required(&self) -> bool {
+        self.required
+    }
+
+    /// The private temporary directory of the jail, where the compilers write their intermediate
+    /// files. It is passed to the jailed process as `TMPDIR`, and is created right before the
+    /// jailed process starts and removed once it exits.
+    pub(crate) fn tmpdir(&self) -> Option<&Path> {
+        self.tmpdir.as_deref()
+    }
+
+    /// Enforces the rules on the calling process and all its future children.
+    ///
+    /// The caller must have set `PR_SET_NO_NEW_PRIVS`.
+    pub(crate) fn restrict_self(&self) -> Result<()> {
+        let abi_version = match landlock_abi_version() {
+            Ok(abi_version) => abi_version,
+            Err(err) => {
+                let unsupported = matches!(
+                    err.downcast_ref::<Errno>(),
+                    Some(&Errno::ENOSYS) | Some(&Errno::EOPNOTSUPP)
+                );
+                if unsupported && !self.required {
+                    log::warn!("Landlock is not supported, not restricting filesystem access");
+                    return Ok(());
+                }
+                return Err(err);
+            }
+        };
+
+        let mut handled_access = LANDLOCK_ACCESS_FS_EXECUTE
+            | LANDLOCK_ACCESS_FS_WRITE_FILE
+            | LANDLOCK_ACCESS_FS_READ_FILE
+            | LANDLOCK_ACCESS_FS_READ_DIR
+            | LANDLOCK_ACCESS_FS_REMOVE_DIR
+            | LANDLOCK_ACCESS_FS_REMOVE_FILE
+            | LANDLOCK_ACCESS_FS_MAKE_CHAR
+            | LANDLOCK_ACCESS_FS_MAKE_DIR
+            | LANDLOCK_ACCESS_FS_MAKE_REG
+            | LANDLOCK_ACCESS_FS_MAKE_SOCK
+            | LANDLOCK_ACCESS_FS_MAKE_FIFO
+            | LANDLOCK_ACCESS_FS_MAKE_BLOCK
+            | LANDLOCK_ACCESS_FS_MAKE_SYM;
+        if abi_version >= 2 {
+            handled_access |= LANDLOCK_ACCESS_FS_REFER;
+        }
+        if abi_version >= 3 {
+            handled_access |= LANDLOCK_ACCESS_FS_TRUNCATE;
+        }
+        let mut attr = LandlockRulesetAttr {
+            handled_access_fs: handled_access,
+            handled_access_net: 0,
+            scoped: 0,
+        };
+        // No network rules are added, so handling them denies all TCP binds and connections.
+        if abi_version >= 4 {
+            attr.handled_access_net =
+                LANDLOCK_ACCESS_NET_BIND_TCP | LANDLOCK_ACCESS_NET_CONNECT_TCP;
+        }
+        if abi_version >= 6 {
+            attr.scoped = LANDLOCK_SCOPE_ABSTRACT_UNIX_SOCKET | LANDLOCK_SCOPE_SIGNAL;
+        }
+
+        let ruleset = landlock_create_ruleset(&attr, abi_version)?;
+        for (path, access) in &self.rules {
+            let parent = match OpenOptions::new()
+                .read(true)
+                .custom_flags(libc::O_PATH | libc::O_CLOEXEC)
+                .open(path)
+            {
+                Ok(parent) => parent,
+                Err(err) if err.kind() == ErrorKind::NotFound => continue,
+                Err(err) => return Err(anyhow!(err).context(format!("open {:?}", path))),
+            };
+            let mut allowed_access = access.rights() & handled_access;
+            if !File::metadata(&parent)
+                .with_context(|| anyhow!("stat {:?}", path))?
+                .is_dir()
+            {
+                allowed_access &= LANDLOCK_ACCESS_FS_FILE;
+            }
+            landlock_add_path_beneath_rule(&ruleset, &parent, allowed_access)
+                .with_context(|| anyhow!("allow {:?} for {:?}", access, path))?;
+        }
+        landlock_restrict_self(&ruleset)?;
+
+        Ok(())
+    }
+}
@@ -0,0 +1,170 @@
+//! The minimal sandboxed init.
+//!
+//! The sandboxed init starts as a copy of the whole omegajail process, so while it waits for the
+//! jailed process it would keep the parsed options (including both seccomp-bpf programs), the
+//! heap, and the logger. With `--minimal-init`, once the namespaces are set up and the jailed
+//! process has been forked, the sandboxed init instead execs the small, statically linked
+//! `omegajail-init` binary, which keeps its pid and only receives what it needs to supervise the
+//! jailed process: its pid, the wall time limit, and a few file descriptors.
+
+use std::convert::Infallible;
+use std::ffi::{CStr, CString};
+use std::fs::File;
+use std::ops::Add;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Context, Result};
+use clap::Parser;
+use nix::fcntl::{fcntl, AtFlags, FcntlArg, FdFlag};
+use nix::sys::signal::{kill, Signal};
+use nix::unistd::{close, execveat, Pid};
+
+use crate::jail::adjudicator::Adjudicator;
+use crate::jail::child_init::{
+    wait_read_seccomp_notification, wait_reap_child, wait_receive_seccomp_fd, Samplers,
+};
+use crate::jail::write_message;
+use crate::sys::WaitidStatus;
+
+/// The arguments of the minimal init.
+#[derive(Parser, Clone, Debug)]
+#[clap(author, version, about = "The minimal sandboxed init of omegajail", long_about = None)]
+pub struct Args {
+    /// The pid of the jailed process
+    #[clap(long)]
+    pub child: libc::pid_t,
+
+    /// The wall time limit of the jailed process, in microseconds
+    #[clap(long)]
+    pub wall_time_limit: u64,
+
+    /// The memory reserved for the runtime, which is not counted towards the RSS, in bytes
+    #[clap(long)]
+    pub vm_memory_size: u64,
+
+    /// The name of the seccomp-bpf profile, which selects the rules of the adjudicator
+    #[clap(long)]
+    pub seccomp_profile: String,
+
+    /// The socket to the parent process, where the result is written
+    #[clap(long)]
+    pub parent_fd: RawFd,
+
+    /// The socket to the jailed process, where the seccomp notification fd is received
+    #[clap(long)]
+    pub jail_fd: RawFd,
+
+    /// The pipe that the jailed process waits on before calling execve
+    #[clap(long)]
+    pub release_fd: RawFd,
+}
+
+/// Replaces the current process with the minimal init in `init_file`. This only returns if the
+/// exec failed, in which case the current process can keep supervising the jailed process.
+pub(crate) fn exec(init_file: &File, args: &Args) -> Result<Infallible> {
+    for fd in [args.parent_fd, args.jail_fd, args.release_fd] {
+        fcntl(fd, FcntlArg::F_SETFD(FdFlag::empty()))
+            .with_context(|| anyhow!("fcntl({}, F_SETFD, 0)", fd))?;
+    }
+    let argv: Vec<CString> = [
+        String::from("omegajail-init"),
+        format!("--child={}", args.child),
+        format!("--wall-time-limit={}", args.wall_time_limit),
+        format!("--vm-memory-size={}", args.vm_memory_size),
+        format!("--seccomp-profile={}", args.seccomp_profile),
+        format!("--parent-fd={}", args.parent_fd),
+        format!("--jail-fd={}", args.jail_fd),
+        format!("--release-fd={}", args.release_fd),
+    ]
+    .into_iter()
+    .map(CString::new)
+    .collect::<std::result::Result<_, _>>()
+    .context("build argv")?;
+    let env: [&CStr; 0] = [];
+    let result = execveat(
+        init_file.as_raw_fd(),
+        &CString::default(),
+        &argv,
+        &env,
+        AtFlags::AT_EMPTY_PATH,
+    )
+    .with_context(|| anyhow!("execveat({:?})", argv));
+    // Leave the file descriptors as they were, so that they are not inherited by any other
+    // process.
+    for fd in [args.parent_fd, args.jail_fd, args.release_fd] {
+        let _ = fcntl(fd, FcntlArg::F_SETFD(FdFlag::FD_CLOEXEC));
+    }
+    result
+}
+
+/// Releases the jailed process, supervises it, and writes its result to the parent process.
+pub fn run(args: Args) -> Result<()> {
+    let mut parent_jail_sock = unsafe { UnixStream::from_raw_fd(args.parent_fd) };
+    let jail_sock = unsafe { UnixStream::from_raw_fd(args.jail_fd) };
+    let child = Pid::from_raw(args.child);
+
+    let child_start = Instant::now();
+    let deadline = child_start.add(Duration::from_micros(args.wall_time_limit));
+    close(args.release_fd).context("release child")?;
+
+    let status = wait_child(
+        child,
+        jail_sock,
+        child_start,
+        deadline,
+        &args.seccomp_profile,
+        args.vm_memory_size,
+    );
+    write_message(&mut parent_jail_sock, status).context("write status")?;
+
+    Ok(())
+}
+
+/// Supervises the jailed process like [`super::child_init`] does for a sandboxed jail without any
+/// samplers or profiler.
+fn wait_child(
+    child: Pid,
+    mut jail_sock: UnixStream,
+    child_start: Instant,
+    deadline: Instant,
+    seccomp_profile_name: &str,
+    vm_memory_size_in_bytes: u64,
+) -> WaitidStatus {
+    let adjudicator = Adjudicator::new(seccomp_profile_name);
+    let mut sigsys_fallback = false;
+    let override_status = match wait_receive_seccomp_fd(&mut jail_sock) {
+        Err(err) => {
+            log::error!("receive seccomp fd: {:#}", err);
+            let _ = kill(child, Signal::SIGKILL);
+            None
+        }
+        Ok(seccomp_fd) => {
+            sigsys_fallback = seccomp_fd.is_none();
+            match wait_read_seccomp_notification(
+                child,
+                deadline,
+                seccomp_fd,
+                &adjudicator,
+                &mut Samplers::none(),
+                &mut None,
+            ) {
+                Err(err) => {
+                    log::error!("read seccomp notification: {:#}", err);
+                    let _ = kill(child, Signal::SIGKILL);
+                    None
+                }
+                Ok(result) => result,
+            }
+        }
+    };
+
+    let mut status = wait_reap_child(child, child_start, vm_memory_size_in_bytes);
+    if let Some(s) = override_status {
+        status.status = s;
+    }
+    status.sigsys_fallback = sigsys_fallback;
+
+    status
+}
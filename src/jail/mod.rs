@@ -25,21 +25,35 @@
 //!   elapse, whichever happens first. Once that is done, it will send the parent process the
 //!   result of the execution and exit, terminating the container and any stray processes that may
 //!   be lingering.
+//!
+//!   With `--minimal-init`, once the jailed process has been forked, the sandboxed init execs the
+//!   much smaller `omegajail-init` binary to do the waiting (see [`minimal_init`]).
 //! * Jailed process: This is the untrusted code that will be run inside the sandbox. This process
 //!   finishes sandboxing itself (setting process limits, signal handlers, and the seccomp-bpf
 //!   syscall filter) and finally calls
 //!   [`execve(2)`](https://man7.org/linux/man-pages/man2/execve.2.html) to start executing the
 //!   untrusted code.
 
+mod adjudicator;
+mod cache;
+pub mod cases;
 mod cgroups;
+pub mod checker;
 pub(crate) mod child;
 pub(crate) mod child_init;
+mod hints;
+mod landlock;
+#[doc(hidden)]
+pub mod minimal_init;
 mod options;
+mod pack;
 pub(crate) mod parent;
+mod profile;
 
 use std::fmt::Debug;
 use std::fs::File;
 use std::io::{Read, Write};
+use std::os::unix::io::AsRawFd;
 use std::os::unix::net::UnixStream;
 use std::path::{Path, PathBuf};
 use std::time::{Duration, Instant};
@@ -56,6 +70,7 @@ use serde::{Deserialize, Serialize};
 
 use crate::args;
 use crate::jail::cgroups::CGroup;
+use crate::metrics::{JailEvent, Metrics, SpawnKind};
 use crate::sys::{clone3, CloneArgs};
 
 pub use crate::sys::WaitStatus;
@@ -70,11 +85,19 @@ struct SendSeccompFDEvent {
     fd_available: bool,
 }
 
+#[derive(Serialize, Deserialize, Debug)]
+struct ProfileEvent {
+    collapsed_stacks: String,
+}
+
 #[derive(Serialize, Deserialize, Debug)]
 struct SetupCgroupRequest {}
 
 #[derive(Serialize, Deserialize, Debug)]
-struct SetupCgroupResponse {}
+struct SetupCgroupResponse {
+    /// Whether the `memory.stat` file of the jailed process' cgroup is sent after this message.
+    memory_stat_available: bool,
+}
 
 fn write_message<T: Serialize>(writer: &mut UnixStream, message: T) -> Result<()> {
     let mut s = FlexbufferSerializer::new();
@@ -111,9 +134,108 @@ impl Command {
 
     /// Executes the [`Jail`] as a child, sandboxed process, returning a handle to it.
     pub fn spawn(self) -> Result<Jail> {
-        let jail_options = options::JailOptions::new(self.args).context("create jail options")?;
+        let (jail_options, _stdin) = jail_options(self.args)?;
         Jail::new(jail_options)
     }
+
+    /// Executes one [`Jail`] for each case in the `--cases` list, skipping cases according to the
+    /// case policy, and returns the outcome of each case. See [`cases`] for details.
+    pub fn status_cases(self) -> Result<Vec<cases::CaseResult>> {
+        cases::run(self.args)
+    }
+
+    /// Executes the [`Jail`] for the contestant, followed by one for its checker, which reads the
+    /// contestant's output from memory. See [`checker`] for details.
+    pub fn status_with_checker(self) -> Result<checker::CheckedResult> {
+        checker::run(self.args)
+    }
+
+    /// Executes the [`Jail`] as a child, sandboxed process, waits for it to exit, and returns
+    /// information about resource usage and exit status of the process.
+    ///
+    /// If a result cache was requested, the result of a previous identical run might be replayed
+    /// instead.
+    pub fn status(self) -> Result<JailResult> {
+        let result_cache = match &self.args.result_cache {
+            Some(path) => match cache::ResultCache::new(
+                path,
+                self.args.result_cache_mode,
+                self.args.result_cache_verify_rate,
+            ) {
+                Ok(result_cache) => Some(result_cache),
+                Err(err) => {
+                    log::warn!("open result cache: {:#}", err);
+                    None
+                }
+            },
+            None => None,
+        };
+        let (jail_options, _stdin) = jail_options(self.args)?;
+
+        let mut cached_run = match &result_cache {
+            Some(result_cache) => match result_cache.prepare(&jail_options) {
+                Ok(run) => run.map(|run| (result_cache, run)),
+                Err(err) => {
+                    log::warn!("compute result cache key: {:#}", err);
+                    None
+                }
+            },
+            None => None,
+        };
+        let mut cached_entry = None;
+        if let Some((result_cache, run)) = &cached_run {
+            match result_cache.lookup(run) {
+                Ok(Some(entry)) => {
+                    if !result_cache.should_verify() {
+                        match result_cache.replay(run, entry) {
+                            Ok(result) => return Ok(result),
+                            Err(err) => log::warn!("replay cached result: {:#}", err),
+                        }
+                    } else {
+                        cached_entry = Some(entry);
+                    }
+                }
+                Ok(None) => {}
+                Err(err) => log::warn!("look up cached result: {:#}", err),
+            }
+        }
+
+        let started = match &mut cached_run {
+            Some((result_cache, run)) => result_cache.start(run),
+            None => Ok(()),
+        };
+        if let Err(err) = started {
+            log::warn!("start cached run: {:#}", err);
+            cached_run = None;
+        }
+        let result = Jail::new(jail_options)?.wait()?;
+
+        if let Some((result_cache, run)) = &cached_run {
+            let stored = match &cached_entry {
+                Some(entry) => result_cache.verify(run, entry, &result),
+                None => result_cache.store(run, &result),
+            };
+            if let Err(err) = stored {
+                log::warn!("store result in cache: {:#}", err);
+            }
+        }
+
+        Ok(result)
+    }
+}
+
+/// Creates the options of a [`Jail`], along with the memfd for its `--stdin-pack`, which needs to be
+/// kept open until the jail has been spawned.
+fn jail_options(args: args::Args) -> Result<(options::JailOptions, Option<File>)> {
+    let stdin = match &args.stdin_pack {
+        Some(spec) => Some(pack::open_stdin(spec).context("open stdin pack")?),
+        None => None,
+    };
+    let mut jail_options = options::JailOptions::new(args).context("create jail options")?;
+    if let Some(stdin) = &stdin {
+        jail_options.redirect_stdin(stdin.as_raw_fd());
+    }
+    Ok((jail_options, stdin))
 }
 
 /// Representation of a running or exited sandboxed process.
@@ -141,8 +263,14 @@ pub struct Jail {
     child: Pid,
     child_start: Instant,
     meta: Option<PathBuf>,
+    profile: Option<PathBuf>,
     parent_sock: UnixStream,
     cgroups: Vec<CGroup>,
+    metrics: Option<PathBuf>,
+    spawn_kind: Option<SpawnKind>,
+    memory_limit: Option<u64>,
+    setup_latency: Option<Duration>,
+    cgroup_failed: bool,
 }
 
 impl Jail {
@@ -196,8 +324,14 @@ impl Jail {
                     child: child,
                     child_start: child_start,
                     meta: jail_options.meta,
+                    profile: jail_options.profile,
                     parent_sock: parent_sock,
                     cgroups: vec![],
+                    metrics: jail_options.metrics,
+                    spawn_kind: jail_options.spawn_kind,
+                    memory_limit: jail_options.memory_limit,
+                    setup_latency: None,
+                    cgroup_failed: err.downcast_ref::<parent::CGroupSetupError>().is_some(),
                 });
             }
         };
@@ -206,8 +340,14 @@ impl Jail {
             child: child,
             child_start: child_start,
             meta: jail_options.meta,
+            profile: jail_options.profile,
             parent_sock: parent_sock,
             cgroups: cgroups,
+            metrics: jail_options.metrics,
+            spawn_kind: jail_options.spawn_kind,
+            memory_limit: jail_options.memory_limit,
+            setup_latency: Some(child_start.elapsed()),
+            cgroup_failed: false,
         })
     }
 
@@ -228,10 +368,19 @@ impl Jail {
                     system_time: Duration::ZERO,
                     wall_time: Instant::now().duration_since(self.child_start),
                     max_rss: 0,
+                    max_anon_huge_pages: None,
+                    main_thread_time: None,
+                    runtime_threads_time: None,
+                    sigsys_fallback: false,
                 }
             }
             Ok(status) => status,
         };
+        if let Some(profile) = &self.profile {
+            if let Err(err) = Jail::wait_write_profile_file(&mut self.parent_sock, &profile) {
+                log::error!("write profile file: {:#}", err);
+            }
+        }
 
         loop {
             match waitpid(self.child, None) {
@@ -247,10 +396,42 @@ impl Jail {
             }
         }
 
+        let oom_kills: u64 = self
+            .cgroups
+            .iter()
+            .map(|cgroup| {
+                cgroup.oom_kills().unwrap_or_else(|err| {
+                    log::warn!("read oom kills: {:#}", err);
+                    0
+                })
+            })
+            .sum();
+
         // This is here just to make the dead code detector to avoid complaining about the cgroups.
         // This way the directories will be deleted here once the child has exited.
         std::mem::drop(self.cgroups);
 
+        if let Some(metrics) = &self.metrics {
+            Jail::wait_record_metrics(
+                metrics,
+                &JailEvent {
+                    spawn_kind: self.spawn_kind,
+                    setup_latency: self.setup_latency,
+                    overhead: self.child_start.elapsed().saturating_sub(status.wall_time),
+                    seccomp_killed: matches!(
+                        status.status,
+                        WaitStatus::Syscalled(_, _) | WaitStatus::Signaled(_, Signal::SIGSYS)
+                    ),
+                    oom: oom_kills > 0
+                        || self
+                            .memory_limit
+                            .map_or(false, |memory_limit| status.max_rss >= memory_limit),
+                    sigsys_fallback: status.sigsys_fallback,
+                    cgroup_failed: self.cgroup_failed,
+                },
+            );
+        }
+
         if let Some(meta) = &self.meta {
             if let Err(err) = Jail::wait_write_meta_file(&meta, &status) {
                 log::error!("write meta file: {:#}", err);
@@ -260,6 +441,30 @@ impl Jail {
         Ok(status)
     }
 
+    /// Adds `event` to the host-wide metrics. Failures are not fatal, since the metrics are only
+    /// recorded on hosts where their directory was set up.
+    fn wait_record_metrics(metrics: &Path, event: &JailEvent) {
+        if !metrics.parent().map_or(false, |dir| dir.is_dir()) {
+            return;
+        }
+        match Metrics::open(metrics) {
+            Ok(metrics) => metrics.record(event),
+            Err(err) => log::warn!("open metrics: {:#}", err),
+        }
+    }
+
+    fn wait_write_profile_file<P>(parent_sock: &mut UnixStream, profile: P) -> Result<()>
+    where
+        P: Debug + AsRef<Path>,
+    {
+        let event = read_message::<ProfileEvent>(parent_sock).context("read profile message")?;
+        File::create(&profile)
+            .with_context(|| anyhow!("create {:?}", &profile))?
+            .write_all(event.collapsed_stacks.as_bytes())
+            .with_context(|| anyhow!("write {:?}", &profile))?;
+        Ok(())
+    }
+
     fn wait_write_meta_file<P>(meta: P, status: &JailResult) -> Result<()>
     where
         P: Debug + AsRef<Path>,
@@ -281,6 +486,22 @@ impl Jail {
         meta_file
             .write_fmt(format_args!("mem:{}\n", status.max_rss))
             .with_context(|| anyhow!("write {:?}", meta))?;
+        if let Some(max_anon_huge_pages) = status.max_anon_huge_pages {
+            meta_file
+                .write_fmt(format_args!("mem-thp:{}\n", max_anon_huge_pages))
+                .with_context(|| anyhow!("write {:?}", meta))?;
+        }
+        if let (Some(main_thread_time), Some(runtime_threads_time)) =
+            (status.main_thread_time, status.runtime_threads_time)
+        {
+            meta_file
+                .write_fmt(format_args!(
+                    "time-main:{}\ntime-runtime:{}\n",
+                    main_thread_time.as_micros(),
+                    runtime_threads_time.as_micros()
+                ))
+                .with_context(|| anyhow!("write {:?}", meta))?;
+        }
         match status.status {
             WaitStatus::Exited(_, status) => meta_file
                 .write_fmt(format_args!("status:{}\n", status))
@@ -315,6 +536,7 @@ mod tests {
     use once_cell::sync::Lazy;
     use tempdir::TempDir;
 
+    use crate::args::ServiceCoreCharge;
     use crate::jail::options::{JailOptions, MountArgs, Stdio};
     use crate::jail::{Jail, JailResult, WaitStatus};
 
@@ -427,6 +649,14 @@ mod tests {
             use_cgroups_for_memory_limit: false,
             vm_memory_size_in_bytes: 0u64,
             allow_sigsys_fallback: false,
+            thp: None,
+            service_core: None,
+            service_core_charge: ServiceCoreCharge::All,
+            profile: None,
+            landlock: None,
+            metrics: None,
+            spawn_kind: None,
+            minimal_init: None,
         };
 
         let jail = Jail::new(options)?;
@@ -10,6 +10,10 @@ use itertools::Itertools;
 use nix::mount::MsFlags;
 
 use crate::args;
+use crate::jail::hints::{self, RuntimeHints};
+use crate::jail::landlock::LandlockRules;
+use crate::metrics::SpawnKind;
+use crate::sys::thp_disable_except_advised_supported;
 
 const DEFAULT_EXTRA_MEMORY_SIZE_IN_BYTES: u64 = 16 * 1024 * 1024;
 const RUBY_EXTRA_MEMORY_SIZE_IN_BYTES: u64 = 56 * 1024 * 1024;
@@ -63,6 +67,7 @@ pub(crate) struct JailOptions {
     pub seccomp_bpf_filter_sigsys_contents: Vec<u8>,
     pub seccomp_profile_name: String,
     pub meta: Option<PathBuf>,
+    pub profile: Option<PathBuf>,
 
     pub stdin: Stdio,
     pub stdout: Stdio,
@@ -75,13 +80,38 @@ pub(crate) struct JailOptions {
     pub use_cgroups_for_memory_limit: bool,
     pub vm_memory_size_in_bytes: u64,
     pub allow_sigsys_fallback: bool,
+    pub thp: Option<args::ThpMode>,
+    pub service_core: Option<usize>,
+    pub service_core_charge: args::ServiceCoreCharge,
+    pub landlock: Option<LandlockRules>,
+    pub metrics: Option<PathBuf>,
+    pub spawn_kind: Option<SpawnKind>,
+    pub minimal_init: Option<PathBuf>,
 }
 
 impl JailOptions {
+    /// Makes the child use `fd` as its stdin instead of whatever was requested in the arguments.
+    pub(crate) fn redirect_stdin(&mut self, fd: RawFd) {
+        let target = self.rootfs.join("mnt/stdio/stdin");
+        self.mounts.retain(|mount| mount.target != target);
+        self.stdin = Stdio::FileDescriptor(fd);
+    }
+
+    /// Makes the child use `fd` as its stdout instead of whatever was requested in the arguments.
+    pub(crate) fn redirect_stdout(&mut self, fd: RawFd) {
+        let target = self.rootfs.join("mnt/stdio/stdout");
+        self.mounts.retain(|mount| mount.target != target);
+        self.stdout = Stdio::FileDescriptor(fd);
+    }
+
     pub(crate) fn new(args: args::Args) -> Result<JailOptions> {
         let root = PathBuf::from(
             canonicalize(&args.root).with_context(|| format!("canonicalize({})", &args.root))?,
         );
+        let homedir = PathBuf::from(
+            canonicalize(&args.homedir)
+                .with_context(|| format!("canonicalize({})", &args.homedir))?,
+        );
         let mut mounts = Vec::<MountArgs>::new();
         let rootfs = if args.compile.is_some() {
             root.join("root-compilers")
@@ -89,10 +119,7 @@ impl JailOptions {
             root.join("root")
         };
         mounts.push(MountArgs {
-            source: Some(PathBuf::from(
-                canonicalize(&args.homedir)
-                    .with_context(|| format!("canonicalize({})", &args.homedir))?,
-            )),
+            source: Some(homedir.clone()),
             target: rootfs.join("home"),
             fstype: None,
             flags: if args.homedir_writable {
@@ -206,6 +233,14 @@ impl JailOptions {
             Stdio::FileDescriptor(libc::STDERR_FILENO)
         };
 
+        let cpus = if args.service_core.is_some() { 2 } else { 1 };
+        let runtime_hints = match (args.runtime_hints, args.compile, args.run) {
+            (false, _, _) => RuntimeHints::default(),
+            (true, Some(lang), _) => hints::compile_hints(lang),
+            (true, None, Some(lang)) => hints::run_hints(lang, args.memory_limit, cpus),
+            (true, None, None) => RuntimeHints::default(),
+        };
+
         let mut execve_args = Vec::<String>::new();
         let mut env: Vec<&str> = vec!["HOME=/home", "LANG=en_US.UTF-8", "PATH=/usr/bin"];
         let mut seccomp_profile_name = String::new();
@@ -557,6 +592,28 @@ impl JailOptions {
                     ]);
                     execve_args.extend(compile_sources.iter().map(|s| s.clone()));
                 }
+                args::Language::CSharpAot => {
+                    seccomp_profile_name = String::from("csc-aot");
+                    mounts.push(MountArgs {
+                        source: Some(root.join("root-dotnet")),
+                        target: rootfs.join("usr/share/dotnet"),
+                        fstype: None,
+                        flags: MsFlags::MS_BIND | MsFlags::MS_RDONLY,
+                        data: None,
+                    });
+                    mounts.push(MountArgs {
+                        source: Some(root.join("bin")),
+                        target: rootfs.join("var/lib/omegajail/bin"),
+                        fstype: None,
+                        flags: MsFlags::MS_BIND | MsFlags::MS_RDONLY,
+                        data: None,
+                    });
+                    execve_args.extend([
+                        String::from("/var/lib/omegajail/bin/cs-compile"),
+                        args.compile_target.clone(),
+                    ]);
+                    execve_args.extend(compile_sources.iter().map(|s| s.clone()));
+                }
             }
         } else if let Some(lang) = args.run {
             match lang {
@@ -741,9 +798,23 @@ impl JailOptions {
                     ]);
                     env.push("DOTNET_CLI_TELEMETRY_OPTOUT=1");
                 }
+                args::Language::CSharpAot => {
+                    // The GC reserves a large range of address space upfront, so the memory limit
+                    // cannot be enforced with RLIMIT_AS. There is no VM to account for, though.
+                    use_cgroups_for_memory_limit = true;
+                    seccomp_profile_name = String::from("cs-aot");
+                    execve_args.extend([format!("./{}", args.run_target)]);
+                }
             }
         }
 
+        if !execve_args.is_empty() {
+            // The runtime flags go right after the path of the runtime's executable, so that they
+            // are not confused with the arguments of the program.
+            execve_args.splice(1..1, runtime_hints.runtime_args.iter().cloned());
+        }
+        env.extend(runtime_hints.env.iter().map(String::as_str));
+
         for bind in args.bind {
             let parts: Vec<&str> = bind.split(":").collect();
 
@@ -776,6 +847,31 @@ impl JailOptions {
             .read_to_end(&mut seccomp_bpf_filter_sigsys_contents)
             .with_context(|| format!("read {:?}", &bpf_filter_path))?;
 
+        if args.thp == Some(args::ThpMode::Advised)
+            && !thp_disable_except_advised_supported().context("check --thp=advised support")?
+        {
+            bail!("--thp=advised requires Linux 6.18 or newer");
+        }
+
+        let landlock = match args.landlock {
+            args::LandlockMode::Off => None,
+            _ if !args.disable_sandboxing => {
+                bail!("--landlock can only be used with --disable-sandboxing")
+            }
+            mode => Some(LandlockRules::new(
+                &homedir,
+                args.homedir_writable,
+                &rootfs,
+                &mounts,
+                mode == args::LandlockMode::Required,
+            )),
+        };
+        let tmpdir_env = landlock
+            .as_ref()
+            .and_then(LandlockRules::tmpdir)
+            .map(|tmpdir| format!("TMPDIR={}", tmpdir.display()));
+        env.extend(tmpdir_env.as_deref());
+
         let (time_limit, wall_time_limit) = match args.time_limit {
             Some(time_limit) => (
                 Some(Duration::from_millis(time_limit)),
@@ -799,6 +895,7 @@ impl JailOptions {
             seccomp_bpf_filter_sigsys_contents: seccomp_bpf_filter_sigsys_contents,
             seccomp_profile_name: seccomp_profile_name,
             meta: args.meta.map(|s| PathBuf::from(s)),
+            profile: args.profile.map(|s| PathBuf::from(s)),
 
             stdin: stdin,
             stdout: stdout,
@@ -818,6 +915,25 @@ impl JailOptions {
                 None => None,
             },
             allow_sigsys_fallback: args.allow_sigsys_fallback,
+            thp: args.thp,
+            service_core: args.service_core,
+            service_core_charge: args.service_core_charge,
+            landlock: landlock,
+            metrics: if args.metrics.is_empty() {
+                None
+            } else {
+                Some(PathBuf::from(args.metrics))
+            },
+            spawn_kind: match (args.compile, args.run) {
+                (Some(lang), _) => Some(SpawnKind::Compile(lang)),
+                (None, Some(lang)) => Some(SpawnKind::Run(lang)),
+                (None, None) => None,
+            },
+            minimal_init: if args.minimal_init {
+                Some(root.join("bin/omegajail-init"))
+            } else {
+                None
+            },
         })
     }
 }
@@ -0,0 +1,358 @@
+//! Packed test-case archives.
+//!
+//! Problems with thousands of tiny cases would otherwise need thousands of `.in` / `.out` files to
+//! be extracted, canonicalized, and bind-mounted. A pack (built with `tools/omegajail-pack`) holds
+//! all the files of a problem version in a single file, with an index at the end:
+//!
+//! ```text
+//! header:  magic "OMJPACK\0" | version: u32 | entries: u32 | index offset: u64 | index size: u64
+//! data:    the contents of every file, back to back
+//! index:   the offset of every record, relative to the start of the index: u64
+//!          for every entry, sorted by name, a record:
+//!          name size: u32 | name (UTF-8) | offset: u64 | size: u64
+//! ```
+//!
+//! All integers are little-endian. The records have variable sizes, so the fixed-width table of
+//! record offsets lets a lookup binary-search the index, reading only a handful of records instead
+//! of all of them. With `--stdin-pack=PACK:CASE`, the `CASE.in` entry is copied into a sealed memfd (in the kernel,
+//! through [`std::io::copy`]), which becomes the stdin of the jailed process.
+
+use std::cmp::Ordering;
+use std::fs::File;
+use std::io::{copy, Read, Seek, SeekFrom};
+use std::os::unix::fs::FileExt;
+
+use anyhow::{anyhow, bail, Context, Result};
+
+use crate::jail::checker::{create_memfd, seal};
+
+/// Identifies a pack.
+const MAGIC: &[u8; 8] = b"OMJPACK\0";
+/// The version of the pack format.
+const VERSION: u32 = 1;
+/// The size of the header of a pack.
+const HEADER_SIZE: u64 = 32;
+/// The size of each of the record offsets at the start of the index.
+const RECORD_OFFSET_SIZE: u64 = 8;
+/// The size of a record, excluding its name.
+const RECORD_SIZE: u64 = 4 + 8 + 8;
+
+/// The location of a file within a pack.
+#[derive(Debug, PartialEq)]
+struct Entry {
+    offset: u64,
+    size: u64,
+}
+
+/// The header of a pack.
+#[derive(Debug, PartialEq)]
+struct Header {
+    entries: u32,
+    index_offset: u64,
+    index_size: u64,
+}
+
+impl Header {
+    /// Reads and validates the header of `pack`.
+    fn read(pack: &File) -> Result<Header> {
+        let pack_size = pack.metadata().context("stat")?.len();
+        let mut header = [0u8; HEADER_SIZE as usize];
+        pack.read_exact_at(&mut header, 0).context("read header")?;
+        let mut header = &header[..];
+        if read_bytes::<8>(&mut header)? != MAGIC {
+            bail!("not a pack");
+        }
+        let version = u32::from_le_bytes(*read_bytes(&mut header)?);
+        if version != VERSION {
+            bail!("unsupported pack version {}", version);
+        }
+        let entries = u32::from_le_bytes(*read_bytes(&mut header)?);
+        let index_offset = u64::from_le_bytes(*read_bytes(&mut header)?);
+        let index_size = u64::from_le_bytes(*read_bytes(&mut header)?);
+        if index_offset < HEADER_SIZE || index_offset.saturating_add(index_size) > pack_size {
+            bail!("invalid index at {} (size {})", index_offset, index_size);
+        }
+        Ok(Header {
+            entries: entries,
+            index_offset: index_offset,
+            index_size: index_size,
+        })
+    }
+
+    /// Reads `size` bytes at `offset` within the index of `pack`.
+    fn read_index(&self, pack: &File, offset: u64, size: u64) -> Result<Vec<u8>> {
+        if offset.saturating_add(size) > self.index_size {
+            bail!("truncated index");
+        }
+        let mut buf = vec![0u8; size as usize];
+        pack.read_exact_at(&mut buf, self.index_offset + offset)
+            .context("read index")?;
+        Ok(buf)
+    }
+
+    /// Checks that `entry` lies within the data of the pack.
+    fn check_entry(&self, name: &str, entry: Entry) -> Result<Entry> {
+        if entry.offset < HEADER_SIZE || entry.offset.saturating_add(entry.size) > self.index_offset
+        {
+            bail!("invalid entry {:?}: {:?}", name, entry);
+        }
+        Ok(entry)
+    }
+}
+
+/// Reads `N` bytes from the front of `buf`, and advances it.
+fn read_bytes<'a, const N: usize>(buf: &mut &'a [u8]) -> Result<&'a [u8; N]> {
+    if buf.len() < N {
+        bail!("truncated index");
+    }
+    let (head, tail) = buf.split_at(N);
+    *buf = tail;
+    Ok(head.try_into()?)
+}
+
+/// Parses the record at the front of `buf`, and advances it.
+fn parse_record<'a>(buf: &mut &'a [u8]) -> Result<(&'a [u8], Entry)> {
+    let name_size = u32::from_le_bytes(*read_bytes(buf)?) as usize;
+    if buf.len() < name_size {
+        bail!("truncated index");
+    }
+    let (name, rest) = buf.split_at(name_size);
+    *buf = rest;
+    let entry = Entry {
+        offset: u64::from_le_bytes(*read_bytes(buf)?),
+        size: u64::from_le_bytes(*read_bytes(buf)?),
+    };
+    Ok((name, entry))
+}
+
+/// Looks up the entry called `name` in `pack`.
+fn find_entry(pack: &File, name: &str) -> Result<Option<Entry>> {
+    let header = Header::read(pack)?;
+    let table_size = u64::from(header.entries) * RECORD_OFFSET_SIZE;
+    let (mut low, mut high) = (0u64, u64::from(header.entries));
+    while low < high {
+        let mid = low + (high - low) / 2;
+        let slot = header.read_index(pack, mid * RECORD_OFFSET_SIZE, RECORD_OFFSET_SIZE)?;
+        let record_offset = u64::from_le_bytes(*read_bytes(&mut &slot[..])?);
+        if record_offset < table_size {
+            bail!("invalid record offset {} for entry {}", record_offset, mid);
+        }
+        let name_size = header.read_index(pack, record_offset, 4)?;
+        let name_size = u32::from_le_bytes(*read_bytes(&mut &name_size[..])?);
+        let record = header.read_index(pack, record_offset, RECORD_SIZE + u64::from(name_size))?;
+        let (entry_name, entry) = parse_record(&mut &record[..])?;
+        match entry_name.cmp(name.as_bytes()) {
+            Ordering::Less => low = mid + 1,
+            Ordering::Greater => high = mid,
+            Ordering::Equal => return header.check_entry(name, entry).map(Some),
+        }
+    }
+    Ok(None)
+}
+
+/// Returns a sealed, read-only memfd with the input of a case, given as `PACK:CASE`.
+pub(crate) fn open_stdin(spec: &str) -> Result<File> {
+    let (pack_path, case) = spec
+        .rsplit_once(':')
+        .ok_or_else(|| anyhow!("invalid stdin pack {:?}, expected PACK:CASE", spec))?;
+    let name = format!("{}.in", case);
+    let mut pack = File::open(pack_path).with_context(|| anyhow!("open {:?}", pack_path))?;
+    let entry = find_entry(&pack, &name)
+        .with_context(|| anyhow!("read index of {:?}", pack_path))?
+        .ok_or_else(|| anyhow!("{:?} not found in {:?}", name, pack_path))?;
+
+    let mut memfd = create_memfd("stdin")?;
+    pack.seek(SeekFrom::Start(entry.offset))
+        .with_context(|| anyhow!("seek to {:?} in {:?}", name, pack_path))?;
+    let copied = copy(&mut (&mut pack).take(entry.size), &mut memfd)
+        .with_context(|| anyhow!("copy {:?} from {:?}", name, pack_path))?;
+    if copied != entry.size {
+        bail!(
+            "{:?} in {:?} is truncated: {} of {} bytes",
+            name,
+            pack_path,
+            copied,
+            entry.size
+        );
+    }
+    seal(&memfd)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::{write, File};
+
+    use anyhow::Result;
+    use tempdir::TempDir;
+
+    use crate::jail::pack::{find_entry, Entry, Header, HEADER_SIZE, MAGIC, VERSION};
+
+    /// Builds a pack with `files` (which must be sorted by name), like `tools/omegajail-pack`.
+    fn build_pack(files: &[(&str, &[u8])]) -> Vec<u8> {
+        let mut data = Vec::new();
+        let mut records = Vec::new();
+        for (name, contents) in files {
+            let offset = HEADER_SIZE + data.len() as u64;
+            data.extend_from_slice(contents);
+            let mut record = Vec::new();
+            record.extend_from_slice(&(name.len() as u32).to_le_bytes());
+            record.extend_from_slice(name.as_bytes());
+            record.extend_from_slice(&offset.to_le_bytes());
+            record.extend_from_slice(&(contents.len() as u64).to_le_bytes());
+            records.push(record);
+        }
+        let mut index = Vec::new();
+        let mut record_offset = (records.len() * 8) as u64;
+        for record in &records {
+            index.extend_from_slice(&record_offset.to_le_bytes());
+            record_offset += record.len() as u64;
+        }
+        for record in &records {
+            index.extend_from_slice(record);
+        }
+
+        let mut pack = Vec::new();
+        pack.extend_from_slice(MAGIC);
+        pack.extend_from_slice(&VERSION.to_le_bytes());
+        pack.extend_from_slice(&(files.len() as u32).to_le_bytes());
+        pack.extend_from_slice(&(HEADER_SIZE + data.len() as u64).to_le_bytes());
+        pack.extend_from_slice(&(index.len() as u64).to_le_bytes());
+        pack.extend_from_slice(&data);
+        pack.extend_from_slice(&index);
+        pack
+    }
+
+    fn open_pack(tmp_dir: &TempDir, pack: &[u8]) -> Result<File> {
+        let path = tmp_dir.path().join("pack");
+        write(&path, pack)?;
+        Ok(File::open(&path)?)
+    }
+
+    /// Overwrites the little-endian `value` at `offset` in `pack`.
+    fn patch(pack: &mut [u8], offset: usize, value: &[u8]) {
+        pack[offset..offset + value.len()].copy_from_slice(value);
+    }
+
+    #[test]
+    fn find_entry_finds_every_entry() -> Result<()> {
+        let tmp_dir = TempDir::new("pack")?;
+        let names: Vec<String> = (0..100).map(|i| format!("{:03}.in", i)).collect();
+        let contents: Vec<Vec<u8>> = (0..100).map(|i| vec![b'a'; i]).collect();
+        let files: Vec<(&str, &[u8])> = names
+            .iter()
+            .zip(&contents)
+            .map(|(name, contents)| (name.as_str(), contents.as_slice()))
+            .collect();
+
+        let pack = open_pack(&tmp_dir, &build_pack(&files))?;
+        let mut offset = HEADER_SIZE;
+        for (name, contents) in &files {
+            let size = contents.len() as u64;
+            assert_eq!(
+                find_entry(&pack, name)?,
+                Some(Entry {
+                    offset: offset,
+                    size: size,
+                }),
+                "{:?}",
+                name
+            );
+            offset += size;
+        }
+        for name in ["", "000", "050.in.out", "099.inz", "100.in", "\u{ff}"] {
+            assert_eq!(find_entry(&pack, name)?, None, "{:?}", name);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn find_entry_handles_empty_packs() -> Result<()> {
+        let tmp_dir = TempDir::new("pack")?;
+        let pack = open_pack(&tmp_dir, &build_pack(&[]))?;
+        assert_eq!(
+            Header::read(&pack)?,
+            Header {
+                entries: 0,
+                index_offset: HEADER_SIZE,
+                index_size: 0,
+            }
+        );
+        assert_eq!(find_entry(&pack, "1.in")?, None);
+        Ok(())
+    }
+
+    #[test]
+    fn find_entry_rejects_invalid_headers() -> Result<()> {
+        let tmp_dir = TempDir::new("pack")?;
+        let valid = build_pack(&[("1.in", b"1 2\n")]);
+        let cases: &[(usize, &[u8], &str)] = &[
+            (0, b"OMJPACK1", "not a pack"),
+            (8, &2u32.to_le_bytes(), "unsupported pack version 2"),
+            (16, &8u64.to_le_bytes(), "invalid index at 8"),
+            (16, &u64::MAX.to_le_bytes(), "invalid index at"),
+            (24, &u64::MAX.to_le_bytes(), "invalid index at"),
+        ];
+        for (offset, value, message) in cases {
+            let mut pack = valid.clone();
+            patch(&mut pack, *offset, value);
+            let err = find_entry(&open_pack(&tmp_dir, &pack)?, "1.in").unwrap_err();
+            assert!(
+                err.to_string().starts_with(message),
+                "{:?}: {:#}",
+                message,
+                err
+            );
+        }
+
+        let err = find_entry(&open_pack(&tmp_dir, &valid[..20])?, "1.in").unwrap_err();
+        assert_eq!(err.to_string(), "read header");
+        assert_eq!(
+            find_entry(&open_pack(&tmp_dir, &valid)?, "1.in")?,
+            Some(Entry {
+                offset: HEADER_SIZE,
+                size: 4,
+            })
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn find_entry_rejects_out_of_bounds_records() -> Result<()> {
+        let tmp_dir = TempDir::new("pack")?;
+        let valid = build_pack(&[("1.in", b"1 2\n"), ("2.in", b"3 4\n")]);
+        let index_offset = HEADER_SIZE as usize + 8;
+        let first_record = index_offset + 16;
+        let cases: &[(usize, &[u8], &str)] = &[
+            // The record offsets point into the offset table, and past the index.
+            (index_offset, &0u64.to_le_bytes(), "invalid record offset 0"),
+            (index_offset, &1000u64.to_le_bytes(), "truncated index"),
+            // The name of the record runs past the index.
+            (first_record, &1000u32.to_le_bytes(), "truncated index"),
+            // There are more entries than record offsets.
+            (12, &3u32.to_le_bytes(), "invalid record offset 16"),
+            // The entry points into the header, and into the index.
+            (
+                first_record + 8,
+                &0u64.to_le_bytes(),
+                "invalid entry \"1.in\"",
+            ),
+            (
+                first_record + 16,
+                &100u64.to_le_bytes(),
+                "invalid entry \"1.in\"",
+            ),
+        ];
+        for (offset, value, message) in cases {
+            let mut pack = valid.clone();
+            patch(&mut pack, *offset, value);
+            let err = find_entry(&open_pack(&tmp_dir, &pack)?, "1.in").unwrap_err();
+            assert!(
+                err.to_string().starts_with(message),
+                "{:?}: {:#}",
+                message,
+                err
+            );
+        }
+        Ok(())
+    }
+}
@@ -1,8 +1,9 @@
+use std::fmt;
 use std::fs::{read_to_string, File};
 use std::io::Write;
 use std::os::unix::io::AsRawFd;
 use std::os::unix::net::UnixStream;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 
 use anyhow::{anyhow, bail, Context, Result};
 use nix::unistd::{getgid, getuid, Pid};
@@ -12,7 +13,7 @@ use crate::jail::options::JailOptions;
 use crate::jail::{
     read_message, write_message, ParentSetupDoneEvent, SetupCgroupRequest, SetupCgroupResponse,
 };
-use crate::sys::RecvFile;
+use crate::sys::{RecvFile, SendFile};
 
 pub(crate) fn setup_child(
     parent_sock: &mut UnixStream,
@@ -30,23 +31,7 @@ pub(crate) fn setup_child(
         match &jail_options.cgroup_path {
             Some(cgroup_path_root) => {
                 let pid = get_pid_from_pidfd(&pidfd).context("get jailed pid")?;
-                let cgroup_path = cgroup_path_root.join(&jail_options.seccomp_profile_name);
-                let cgroup = CGroup::new(
-                    if CGroup::is_cgroup_v2() { "" } else { "memory" },
-                    &cgroup_path,
-                )
-                .with_context(|| anyhow!("create cgroup {:?}", &cgroup_path))?;
-                cgroup
-                    .add_pid(pid)
-                    .with_context(|| anyhow!("add {} to cgroup", pid))?;
-                if jail_options.use_cgroups_for_memory_limit {
-                    if let Some(memory_limit) = jail_options.memory_limit {
-                        cgroup.set_memory_limit(memory_limit).with_context(|| {
-                            anyhow!("set pid {}'s memory limit to {}", pid, memory_limit)
-                        })?;
-                    }
-                }
-                vec![cgroup]
+                vec![setup_cgroup(pid, cgroup_path_root, jail_options).context(CGroupSetupError)?]
             }
             None => {
                 vec![]
@@ -56,11 +41,64 @@ pub(crate) fn setup_child(
         vec![]
     };
 
-    write_message(parent_sock, SetupCgroupResponse {}).context("write setup cgroup response")?;
+    // The sandboxed init samples the huge pages of the jailed process from its cgroup.
+    let memory_stat = match (&jail_options.thp, cgroups.first()) {
+        (Some(_), Some(cgroup)) => match cgroup.open_memory_stat() {
+            Ok(memory_stat) => Some(memory_stat),
+            Err(err) => {
+                log::warn!("open cgroup memory stats: {:#}", err);
+                None
+            }
+        },
+        _ => None,
+    };
+    write_message(
+        parent_sock,
+        SetupCgroupResponse {
+            memory_stat_available: memory_stat.is_some(),
+        },
+    )
+    .context("write setup cgroup response")?;
+    if let Some(memory_stat) = memory_stat {
+        parent_sock
+            .send_file(memory_stat)
+            .context("send cgroup memory stats")?;
+    }
 
     Ok(cgroups)
 }
 
+/// The cgroup of the jailed process could not be set up. This is attached as context to the error
+/// of [`setup_child`], so that cgroup failures can be told apart from the rest.
+#[derive(Debug)]
+pub(crate) struct CGroupSetupError;
+
+impl fmt::Display for CGroupSetupError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "setup cgroup")
+    }
+}
+
+fn setup_cgroup(pid: Pid, cgroup_path_root: &Path, jail_options: &JailOptions) -> Result<CGroup> {
+    let cgroup_path = cgroup_path_root.join(&jail_options.seccomp_profile_name);
+    let cgroup = CGroup::new(
+        if CGroup::is_cgroup_v2() { "" } else { "memory" },
+        &cgroup_path,
+    )
+    .with_context(|| anyhow!("create cgroup {:?}", &cgroup_path))?;
+    cgroup
+        .add_pid(pid)
+        .with_context(|| anyhow!("add {} to cgroup", pid))?;
+    if jail_options.use_cgroups_for_memory_limit {
+        if let Some(memory_limit) = jail_options.memory_limit {
+            cgroup
+                .set_memory_limit(memory_limit)
+                .with_context(|| anyhow!("set pid {}'s memory limit to {}", pid, memory_limit))?;
+        }
+    }
+    Ok(cgroup)
+}
+
 fn get_pid_from_pidfd(pidfd: &File) -> Result<Pid> {
     let fdinfo = read_to_string(format!("/proc/self/fdinfo/{}", pidfd.as_raw_fd()))
         .context("contents of the pidfd")?;
@@ -0,0 +1,522 @@
+//! A sampling profiler for the jailed process.
+//!
+//! Before the child calls [`execve(2)`](https://man7.org/linux/man-pages/man2/execve.2.html), the
+//! init process opens a perf event that samples the user-mode callchains of the child (and any
+//! threads or processes it creates) every millisecond of CPU time. The event is only enabled once
+//! the child execs, and the child does not make any syscalls for it, so the seccomp-bpf policies
+//! are unaffected. After the child exits, the samples are symbolized against the ELF symbol tables
+//! of the files that were mapped in the child, and converted to the "collapsed stacks" format that
+//! flamegraph tools consume.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::path::Path;
+use std::sync::atomic::{fence, Ordering};
+
+use anyhow::{anyhow, bail, Context, Result};
+use nix::sched::{sched_getaffinity, CpuSet};
+use nix::sys::mman::{mmap, munmap, MapFlags, ProtFlags};
+use nix::unistd::{sysconf, Pid, SysconfVar};
+
+use crate::sys::{
+    perf_event_open, PerfEventAttr, PERF_ATTR_FLAG_DISABLED, PERF_ATTR_FLAG_ENABLE_ON_EXEC,
+    PERF_ATTR_FLAG_EXCLUDE_CALLCHAIN_KERNEL, PERF_ATTR_FLAG_EXCLUDE_HV,
+    PERF_ATTR_FLAG_EXCLUDE_KERNEL, PERF_ATTR_FLAG_INHERIT, PERF_ATTR_FLAG_MMAP,
+    PERF_ATTR_FLAG_WATERMARK, PERF_COUNT_SW_TASK_CLOCK, PERF_SAMPLE_CALLCHAIN, PERF_SAMPLE_IP,
+    PERF_SAMPLE_TID, PERF_TYPE_SOFTWARE,
+};
+
+/// How much CPU time elapses between samples. At 1kHz the overhead stays well under 1%.
+const SAMPLE_PERIOD_NS: u64 = 1_000_000;
+/// The deepest callchain that will be recorded. Deep recursion is truncated at the leaves.
+const MAX_STACK_DEPTH: u16 = 64;
+/// The number of data pages of each ring buffer (512 KiB with 4 KiB pages).
+const DATA_PAGES: usize = 128;
+
+/// Offsets of `data_head` and `data_tail` in `struct perf_event_mmap_page`.
+const DATA_HEAD_OFFSET: usize = 1024;
+const DATA_TAIL_OFFSET: usize = 1032;
+
+const PERF_RECORD_MMAP: u32 = 1;
+const PERF_RECORD_LOST: u32 = 2;
+const PERF_RECORD_SAMPLE: u32 = 9;
+/// Callchain entries at or above this value are `PERF_CONTEXT_*` markers, not addresses.
+const PERF_CONTEXT_MAX: u64 = -4095i64 as u64;
+
+/// The most bytes that will be read from a single binary to symbolize it. The contestant controls
+/// the binaries, so this and the following limits bound how much work symbolizing can take.
+/// Binaries that go over them are skipped, and their frames are reported as `[filename]`.
+const MAX_BINARY_BYTES_READ: u64 = 64 * 1024 * 1024;
+/// The most function symbols that will be kept from a single binary.
+const MAX_BINARY_SYMBOLS_KEPT: usize = 1024 * 1024;
+/// The most bytes that will be read from all the binaries of a run.
+const MAX_RUN_BYTES_READ: u64 = 256 * 1024 * 1024;
+/// The most function symbols that will be kept from all the binaries of a run.
+const MAX_RUN_SYMBOLS_KEPT: usize = 4 * 1024 * 1024;
+
+/// A mapping of an executable file in the child's address space.
+struct Mapping {
+    start: u64,
+    end: u64,
+    pgoff: u64,
+    filename: String,
+}
+
+/// The ring buffer of the perf event for one CPU.
+struct RingBuffer {
+    file: File,
+    base: *mut u8,
+    len: usize,
+}
+
+impl Drop for RingBuffer {
+    fn drop(&mut self) {
+        if let Err(err) = unsafe { munmap(self.base as *mut libc::c_void, self.len) } {
+            log::error!("munmap perf ring buffer: {:#}", err);
+        }
+    }
+}
+
+pub(crate) struct Profiler {
+    page_size: usize,
+    ring_buffers: Vec<RingBuffer>,
+    mappings: Vec<Mapping>,
+    stacks: HashMap<Vec<u64>, u64>,
+    lost: u64,
+}
+
+impl Profiler {
+    /// Starts profiling `child`, which must not have called `execve(2)` yet.
+    ///
+    /// Per-task events that are inherited by the child's threads cannot share a ring buffer, so
+    /// there is one event per CPU the child can run on. That is normally just one, since init
+    /// pins itself (and thus the child) to a single CPU.
+    pub(crate) fn new(child: Pid) -> Result<Profiler> {
+        let page_size: usize = sysconf(SysconfVar::PAGE_SIZE)
+            .context("sysconf(PAGE_SIZE)")?
+            .ok_or_else(|| anyhow!("unknown page size"))?
+            .try_into()?;
+        let data_size = DATA_PAGES * page_size;
+
+        let cpu_set = sched_getaffinity(child).context("sched_getaffinity")?;
+        let mut ring_buffers = Vec::new();
+        for cpu in 0..CpuSet::count() {
+            if !cpu_set
+                .is_set(cpu)
+                .with_context(|| anyhow!("cpu_set.is_set({})", cpu))?
+            {
+                continue;
+            }
+            let mut attr = PerfEventAttr {
+                type_: PERF_TYPE_SOFTWARE,
+                config: PERF_COUNT_SW_TASK_CLOCK,
+                sample_period: SAMPLE_PERIOD_NS,
+                sample_type: PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN,
+                flags: PERF_ATTR_FLAG_DISABLED
+                    | PERF_ATTR_FLAG_INHERIT
+                    | PERF_ATTR_FLAG_EXCLUDE_KERNEL
+                    | PERF_ATTR_FLAG_EXCLUDE_HV
+                    | PERF_ATTR_FLAG_MMAP
+                    | PERF_ATTR_FLAG_ENABLE_ON_EXEC
+                    | PERF_ATTR_FLAG_WATERMARK
+                    | PERF_ATTR_FLAG_EXCLUDE_CALLCHAIN_KERNEL,
+                wakeup_watermark: (data_size / 2).try_into()?,
+                sample_max_stack: MAX_STACK_DEPTH,
+                ..Default::default()
+            };
+            let file = perf_event_open(&mut attr, child, cpu.try_into()?)?;
+            let len = page_size + data_size;
+            let base = unsafe {
+                mmap(
+                    std::ptr::null_mut(),
+                    len,
+                    ProtFlags::PROT_READ | ProtFlags::PROT_WRITE,
+                    MapFlags::MAP_SHARED,
+                    file.as_raw_fd(),
+                    0,
+                )
+            }
+            .with_context(|| anyhow!("mmap perf ring buffer for CPU {}", cpu))?
+                as *mut u8;
+            ring_buffers.push(RingBuffer { file, base, len });
+        }
+        if ring_buffers.is_empty() {
+            bail!("empty CPU affinity set");
+        }
+
+        Ok(Profiler {
+            page_size: page_size,
+            ring_buffers: ring_buffers,
+            mappings: Vec::new(),
+            stacks: HashMap::new(),
+            lost: 0,
+        })
+    }
+
+    /// The file descriptors that become readable once a ring buffer is half full.
+    pub(crate) fn fds(&self) -> Vec<RawFd> {
+        self.ring_buffers
+            .iter()
+            .map(|ring_buffer| ring_buffer.file.as_raw_fd())
+            .collect()
+    }
+
+    /// Consumes all the records that are currently in the ring buffers.
+    pub(crate) fn drain(&mut self) {
+        for i in 0..self.ring_buffers.len() {
+            let (base, len) = (self.ring_buffers[i].base, self.ring_buffers[i].len);
+            let data = unsafe { base.add(self.page_size) };
+            let data_size = len - self.page_size;
+            let data_head = unsafe { base.add(DATA_HEAD_OFFSET) as *const u64 };
+            let data_tail = unsafe { base.add(DATA_TAIL_OFFSET) as *mut u64 };
+
+            let head = unsafe { std::ptr::read_volatile(data_head) };
+            fence(Ordering::Acquire);
+            let mut tail = unsafe { std::ptr::read_volatile(data_tail) };
+            while tail < head {
+                let offset = (tail % data_size as u64) as usize;
+                let header = read_ring(data, data_size, offset, 8);
+                let record_type = u32::from_ne_bytes(header[0..4].try_into().unwrap());
+                let record_size = u16::from_ne_bytes(header[6..8].try_into().unwrap()) as usize;
+                if record_size < header.len() {
+                    log::error!("malformed perf record of size {}", record_size);
+                    tail = head;
+                    break;
+                }
+                let record = read_ring(data, data_size, offset, record_size);
+                if let Err(err) = self.parse_record(record_type, &record[header.len()..]) {
+                    log::error!("parse perf record: {:#}", err);
+                }
+                tail += record_size as u64;
+            }
+            fence(Ordering::Release);
+            unsafe { std::ptr::write_volatile(data_tail, tail) };
+        }
+    }
+
+    fn parse_record(&mut self, record_type: u32, body: &[u8]) -> Result<()> {
+        match record_type {
+            PERF_RECORD_MMAP => {
+                let start = read_u64(body, 8)?;
+                let len = read_u64(body, 16)?;
+                let filename = body
+                    .get(32..)
+                    .ok_or_else(|| anyhow!("truncated mmap record"))?;
+                let filename = &filename[..filename
+                    .iter()
+                    .position(|&c| c == 0)
+                    .unwrap_or(filename.len())];
+                self.mappings.push(Mapping {
+                    start: start,
+                    end: start.saturating_add(len),
+                    pgoff: read_u64(body, 24)?,
+                    filename: String::from_utf8_lossy(filename).into_owned(),
+                });
+            }
+            PERF_RECORD_LOST => {
+                self.lost += read_u64(body, 8)?;
+            }
+            PERF_RECORD_SAMPLE => {
+                let ip = read_u64(body, 0)?;
+                let nr = read_u64(body, 16)?;
+                let mut stack = Vec::new();
+                for i in 0..std::cmp::min(nr, MAX_STACK_DEPTH as u64 + 8) as usize {
+                    let address = read_u64(body, 24 + 8 * i)?;
+                    if address < PERF_CONTEXT_MAX {
+                        stack.push(address);
+                    }
+                }
+                if stack.is_empty() {
+                    stack.push(ip);
+                }
+                *self.stacks.entry(stack).or_insert(0) += 1;
+            }
+            _ => {}
+        }
+        Ok(())
+    }
+
+    /// Finishes profiling and returns the symbolized samples, one line per distinct stack, in the
+    /// `outermost;...;innermost count` format.
+    pub(crate) fn collapse(mut self) -> String {
+        self.drain();
+
+        let mut symbolizer = Symbolizer {
+            mappings: &self.mappings,
+            binaries: HashMap::new(),
+            budget: SymbolBudget::new(MAX_RUN_BYTES_READ, MAX_RUN_SYMBOLS_KEPT),
+        };
+        let mut collapsed = HashMap::<String, u64>::new();
+        for (stack, count) in &self.stacks {
+            let frames: Vec<String> = stack
+                .iter()
+                .enumerate()
+                .rev()
+                // Everything but the innermost frame is a return address, which points to the
+                // instruction after the call.
+                .map(|(i, &address)| {
+                    symbolizer.symbolize(if i == 0 {
+                        address
+                    } else {
+                        address.saturating_sub(1)
+                    })
+                })
+                .collect();
+            *collapsed.entry(frames.join(";")).or_insert(0) += count;
+        }
+        if self.lost != 0 {
+            *collapsed.entry(String::from("[lost]")).or_insert(0) += self.lost;
+        }
+
+        let mut lines: Vec<String> = collapsed
+            .into_iter()
+            .map(|(stack, count)| format!("{} {}\n", stack, count))
+            .collect();
+        lines.sort();
+        lines.concat()
+    }
+}
+
+/// Copies `len` bytes that start at `offset` in a ring buffer of `data_size` bytes.
+fn read_ring(data: *const u8, data_size: usize, offset: usize, len: usize) -> Vec<u8> {
+    let mut buf = vec![0u8; len];
+    let first = std::cmp::min(len, data_size - offset);
+    unsafe {
+        std::ptr::copy_nonoverlapping(data.add(offset), buf.as_mut_ptr(), first);
+        std::ptr::copy_nonoverlapping(data, buf.as_mut_ptr().add(first), len - first);
+    }
+    buf
+}
+
+fn read_u16(buf: &[u8], offset: usize) -> Result<u16> {
+    Ok(u16::from_le_bytes(
+        buf.get(offset..offset + 2)
+            .ok_or_else(|| anyhow!("read past the end at {}", offset))?
+            .try_into()?,
+    ))
+}
+
+fn read_u32(buf: &[u8], offset: usize) -> Result<u32> {
+    Ok(u32::from_le_bytes(
+        buf.get(offset..offset + 4)
+            .ok_or_else(|| anyhow!("read past the end at {}", offset))?
+            .try_into()?,
+    ))
+}
+
+fn read_u64(buf: &[u8], offset: usize) -> Result<u64> {
+    Ok(u64::from_le_bytes(
+        buf.get(offset..offset + 8)
+            .ok_or_else(|| anyhow!("read past the end at {}", offset))?
+            .try_into()?,
+    ))
+}
+
+struct Symbolizer<'a> {
+    mappings: &'a [Mapping],
+    binaries: HashMap<&'a str, Option<ElfSymbols>>,
+    /// What is left of the budget of the whole run.
+    budget: SymbolBudget,
+}
+
+impl<'a> Symbolizer<'a> {
+    fn symbolize(&mut self, address: u64) -> String {
+        // Later mappings replace earlier ones.
+        let mappings = self.mappings;
+        let mapping = match mappings
+            .iter()
+            .rev()
+            .find(|mapping| mapping.start <= address && address < mapping.end)
+        {
+            Some(mapping) => mapping,
+            None => return String::from("[unknown]"),
+        };
+        let budget = &mut self.budget;
+        let symbols = self
+            .binaries
+            .entry(mapping.filename.as_str())
+            .or_insert_with(|| {
+                let mut binary_budget = SymbolBudget::new(
+                    std::cmp::min(MAX_BINARY_BYTES_READ, budget.bytes_left),
+                    std::cmp::min(MAX_BINARY_SYMBOLS_KEPT, budget.symbols_left),
+                );
+                let result = ElfSymbols::load(&mapping.filename, &mut binary_budget);
+                // The bytes are spent even if the binary is skipped, but the symbols are not.
+                budget.bytes_left -= binary_budget.bytes_spent;
+                match result {
+                    Ok(symbols) => {
+                        budget.symbols_left -= symbols.symbols.len();
+                        Some(symbols)
+                    }
+                    Err(err) => {
+                        log::debug!("load symbols of {}: {:#}", mapping.filename, err);
+                        None
+                    }
+                }
+            });
+        let file_offset = address - mapping.start + mapping.pgoff;
+        match symbols.as_ref().and_then(|s| s.lookup(file_offset)) {
+            Some(name) => name.to_string(),
+            None => format!(
+                "[{}]",
+                Path::new(&mapping.filename).file_name().map_or_else(
+                    || mapping.filename.clone(),
+                    |s| s.to_string_lossy().into_owned()
+                )
+            ),
+        }
+    }
+}
+
+/// How many bytes can still be read and how many symbols can still be kept while symbolizing.
+struct SymbolBudget {
+    bytes_left: u64,
+    symbols_left: usize,
+    /// How many bytes have been read so far, including the ones of binaries that were skipped.
+    bytes_spent: u64,
+}
+
+impl SymbolBudget {
+    fn new(bytes_left: u64, symbols_left: usize) -> SymbolBudget {
+        SymbolBudget {
+            bytes_left: bytes_left,
+            symbols_left: symbols_left,
+            bytes_spent: 0,
+        }
+    }
+
+    /// Reads `len` bytes at `offset` from `file`, failing if they do not fit in the budget.
+    fn read_at(&mut self, file: &File, offset: u64, len: u64) -> Result<Vec<u8>> {
+        if len > self.bytes_left {
+            bail!(
+                "refusing to read {} bytes, only {} are left in the budget",
+                len,
+                self.bytes_left
+            );
+        }
+        self.bytes_left -= len;
+        self.bytes_spent += len;
+        let mut buf = vec![0u8; len as usize];
+        file.read_exact_at(&mut buf, offset)
+            .with_context(|| anyhow!("read {} bytes at {}", len, offset))?;
+        Ok(buf)
+    }
+
+    /// Accounts for one more symbol being kept, failing if it does not fit in the budget.
+    fn keep_symbol(&mut self) -> Result<()> {
+        if self.symbols_left == 0 {
+            bail!("refusing to keep more symbols, the budget is exhausted");
+        }
+        self.symbols_left -= 1;
+        Ok(())
+    }
+}
+
+/// The function symbols of a little-endian ELF64 binary.
+struct ElfSymbols {
+    /// The `PT_LOAD` segments, as (file offset, file size, virtual address).
+    segments: Vec<(u64, u64, u64)>,
+    /// The function symbols, as (address, size, name), sorted by address.
+    symbols: Vec<(u64, u64, String)>,
+}
+
+impl ElfSymbols {
+    /// Loads the symbols of the binary at `path`. Fails without keeping any symbol if that would
+    /// go over `budget`.
+    fn load(path: &str, budget: &mut SymbolBudget) -> Result<ElfSymbols> {
+        const PT_LOAD: u32 = 1;
+        const SHT_SYMTAB: u32 = 2;
+        const SHT_DYNSYM: u32 = 11;
+        const STT_FUNC: u8 = 2;
+
+        let file = File::open(path).with_context(|| anyhow!("open {:?}", path))?;
+        let header = budget.read_at(&file, 0, 64)?;
+        if header[0..4] != *b"\x7fELF" || header[4] != 2 || header[5] != 1 {
+            bail!("not a little-endian ELF64 file");
+        }
+        let phoff = read_u64(&header, 32)?;
+        let shoff = read_u64(&header, 40)?;
+        let phentsize = read_u16(&header, 54)? as u64;
+        let phnum = read_u16(&header, 56)? as u64;
+        let shentsize = read_u16(&header, 58)? as u64;
+        let shnum = read_u16(&header, 60)? as u64;
+        if phentsize < 56 || shentsize < 64 {
+            bail!("unexpected header entry sizes");
+        }
+
+        let program_headers = budget.read_at(&file, phoff, phentsize * phnum)?;
+        let mut segments = Vec::new();
+        for i in 0..phnum {
+            let phdr = &program_headers[(i * phentsize) as usize..];
+            if read_u32(phdr, 0)? == PT_LOAD {
+                segments.push((read_u64(phdr, 8)?, read_u64(phdr, 32)?, read_u64(phdr, 16)?));
+            }
+        }
+
+        let section_headers = budget.read_at(&file, shoff, shentsize * shnum)?;
+        let section = |i: u64| {
+            if i >= shnum {
+                return Err(anyhow!("invalid section index {}", i));
+            }
+            Ok((i * shentsize) as usize)
+        };
+        let mut symbols = Vec::new();
+        for i in 0..shnum {
+            let shdr = &section_headers[section(i)?..];
+            let sh_type = read_u32(shdr, 4)?;
+            if sh_type != SHT_SYMTAB && sh_type != SHT_DYNSYM {
+                continue;
+            }
+            let symtab = budget.read_at(&file, read_u64(shdr, 24)?, read_u64(shdr, 32)?)?;
+            let strtab_shdr = &section_headers[section(read_u32(shdr, 40)? as u64)?..];
+            let strtab = budget.read_at(
+                &file,
+                read_u64(strtab_shdr, 24)?,
+                read_u64(strtab_shdr, 32)?,
+            )?;
+            for sym in symtab.chunks_exact(24) {
+                let value = read_u64(sym, 8)?;
+                if sym[4] & 0xf != STT_FUNC || value == 0 {
+                    continue;
+                }
+                let name = match strtab.get(read_u32(sym, 0)? as usize..) {
+                    Some(name) => &name[..name.iter().position(|&c| c == 0).unwrap_or(name.len())],
+                    None => continue,
+                };
+                budget.keep_symbol()?;
+                symbols.push((
+                    value,
+                    read_u64(sym, 16)?,
+                    String::from_utf8_lossy(name).into_owned(),
+                ));
+            }
+        }
+        symbols.sort();
+        symbols.dedup_by_key(|(address, _, _)| *address);
+
+        Ok(ElfSymbols { segments, symbols })
+    }
+
+    fn lookup(&self, file_offset: u64) -> Option<&str> {
+        let address = self
+            .segments
+            .iter()
+            .find(|(offset, size, _)| *offset <= file_offset && file_offset - offset < *size)
+            .map(|(offset, _, vaddr)| file_offset - offset + vaddr)?;
+        let index = match self
+            .symbols
+            .binary_search_by_key(&address, |(address, _, _)| *address)
+        {
+            Ok(index) => index,
+            Err(0) => return None,
+            Err(index) => index - 1,
+        };
+        let (start, size, name) = &self.symbols[index];
+        if *size != 0 && address - start >= *size {
+            return None;
+        }
+        Some(name)
+    }
+}
@@ -3,6 +3,7 @@
 
 mod args;
 pub mod jail;
+pub mod metrics;
 #[doc(hidden)]
 pub mod sys;
 
@@ -0,0 +1,502 @@
+//! Host-wide metrics, aggregated across invocations.
+//!
+//! Every invocation of omegajail is a short-lived process, so nothing in it can accumulate
+//! statistics about the host. Instead, the metrics live in a small file with a fixed layout (by
+//! default in [`DEFAULT_METRICS_PATH`]) that every invocation maps into memory and updates with
+//! atomic operations once each jail exits. There are no locks, so a reader might observe some of
+//! the counters of an invocation before the rest, which is fine for monitoring. The
+//! `omegajail-metrics` binary dumps the metrics in the Prometheus text format.
+//!
+//! Counters are indexed by the discriminant of [`Language`], so new languages need to be added at
+//! the end of the enum. Any other change to the layout needs a new [`VERSION`]: invocations leave
+//! files with a different version alone.
+
+use std::fmt::Write as _;
+use std::fs::File;
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use anyhow::{anyhow, bail, Context, Result};
+use clap::ArgEnum;
+use nix::sys::mman::{mmap, munmap, MapFlags, ProtFlags};
+
+use crate::args::Language;
+
+/// Where the metrics are recorded, unless otherwise specified.
+pub const DEFAULT_METRICS_PATH: &str = "/run/omegajail/metrics";
+
+/// Identifies a metrics file.
+const MAGIC: u64 = u64::from_le_bytes(*b"OMJMETR\0");
+/// The version of the layout of [`Region`].
+const VERSION: u64 = 1;
+/// The number of per-language counters. This is larger than the number of languages so that new
+/// ones can be added without changing the layout.
+const LANGUAGE_SLOTS: usize = 64;
+/// The upper bounds of the latency histogram buckets, in microseconds. There is an additional
+/// bucket for everything above the last bound.
+const LATENCY_BUCKETS_USEC: [u64; 16] = [
+    100, 250, 500, 1_000, 2_500, 5_000, 10_000, 25_000, 50_000, 100_000, 250_000, 500_000,
+    1_000_000, 2_500_000, 5_000_000, 10_000_000,
+];
+
+/// What a jail was spawned for.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub(crate) enum SpawnKind {
+    Compile(Language),
+    Run(Language),
+}
+
+/// What happened to a single jail.
+#[derive(Debug)]
+pub(crate) struct JailEvent {
+    /// What the jail was spawned for.
+    pub spawn_kind: Option<SpawnKind>,
+    /// The time it took to create the sandboxed init and set up its namespaces and cgroups, or
+    /// `None` if the setup failed.
+    pub setup_latency: Option<Duration>,
+    /// The time the jail was alive but the sandboxed process was not running.
+    pub overhead: Duration,
+    /// Whether the process was killed for invoking a forbidden syscall.
+    pub seccomp_killed: bool,
+    /// Whether the process reached its memory limit.
+    pub oom: bool,
+    /// Whether the SIGSYS-based seccomp filter had to be used.
+    pub sigsys_fallback: bool,
+    /// Whether the cgroup of the process could not be set up.
+    pub cgroup_failed: bool,
+}
+
+#[repr(C)]
+struct Histogram {
+    buckets: [AtomicU64; LATENCY_BUCKETS_USEC.len() + 1],
+    sum_usec: AtomicU64,
+}
+
+impl Histogram {
+    fn observe(&self, value: Duration) {
+        let value_usec = value.as_micros().try_into().unwrap_or(u64::MAX);
+        let bucket = LATENCY_BUCKETS_USEC
+            .iter()
+            .position(|&bound| value_usec <= bound)
+            .unwrap_or(LATENCY_BUCKETS_USEC.len());
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.sum_usec.fetch_add(value_usec, Ordering::Relaxed);
+    }
+
+    fn write_prometheus(&self, out: &mut String, name: &str, help: &str) {
+        let _ = writeln!(out, "# HELP {} {}", name, help);
+        let _ = writeln!(out, "# TYPE {} histogram", name);
+        let mut count = 0;
+        for (i, bucket) in self.buckets.iter().enumerate() {
+            count += bucket.load(Ordering::Relaxed);
+            let le = match LATENCY_BUCKETS_USEC.get(i) {
+                Some(bound) => format!("{}", *bound as f64 / 1e6),
+                None => String::from("+Inf"),
+            };
+            let _ = writeln!(out, "{}_bucket{{le=\"{}\"}} {}", name, le, count);
+        }
+        let _ = writeln!(
+            out,
+            "{}_sum {}",
+            name,
+            self.sum_usec.load(Ordering::Relaxed) as f64 / 1e6
+        );
+        let _ = writeln!(out, "{}_count {}", name, count);
+    }
+}
+
+/// The layout of the metrics file. A zero-filled file is a valid, empty region.
+#[repr(C)]
+struct Region {
+    magic: AtomicU64,
+    version: AtomicU64,
+    compiles: [AtomicU64; LANGUAGE_SLOTS],
+    runs: [AtomicU64; LANGUAGE_SLOTS],
+    setup_latency: Histogram,
+    overhead: Histogram,
+    setup_failures: AtomicU64,
+    cgroup_failures: AtomicU64,
+    seccomp_kills: AtomicU64,
+    ooms: AtomicU64,
+    sigsys_fallbacks: AtomicU64,
+}
+
+/// A mapping of the host-wide metrics file.
+pub struct Metrics {
+    region: NonNull<Region>,
+}
+
+impl Metrics {
+    /// Maps the metrics file at `path` for updating, creating it if needed.
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Metrics> {
+        let path = path.as_ref();
+        let file = File::options()
+            .read(true)
+            .write(true)
+            .create(true)
+            .mode(0o644)
+            .open(path)
+            .with_context(|| anyhow!("open {:?}", path))?;
+        let size = std::mem::size_of::<Region>() as u64;
+        if file
+            .metadata()
+            .with_context(|| anyhow!("stat {:?}", path))?
+            .len()
+            < size
+        {
+            // Concurrent invocations might race to do this, but they all grow it to the same size.
+            file.set_len(size)
+                .with_context(|| anyhow!("truncate {:?}", path))?;
+        }
+        let metrics = Metrics::map(&file, ProtFlags::PROT_READ | ProtFlags::PROT_WRITE)
+            .with_context(|| anyhow!("map {:?}", path))?;
+        let region = metrics.region();
+        let _ = region
+            .magic
+            .compare_exchange(0, MAGIC, Ordering::AcqRel, Ordering::Acquire);
+        let _ = region
+            .version
+            .compare_exchange(0, VERSION, Ordering::AcqRel, Ordering::Acquire);
+        metrics
+            .check()
+            .with_context(|| anyhow!("check {:?}", path))?;
+        Ok(metrics)
+    }
+
+    /// Maps the metrics file at `path` for reading.
+    pub fn open_readonly<P: AsRef<Path>>(path: P) -> Result<Metrics> {
+        let path = path.as_ref();
+        let file = File::open(path).with_context(|| anyhow!("open {:?}", path))?;
+        if file
+            .metadata()
+            .with_context(|| anyhow!("stat {:?}", path))?
+            .len()
+            < std::mem::size_of::<Region>() as u64
+        {
+            bail!("{:?} is too small to be a metrics file", path);
+        }
+        let metrics =
+            Metrics::map(&file, ProtFlags::PROT_READ).with_context(|| anyhow!("map {:?}", path))?;
+        metrics
+            .check()
+            .with_context(|| anyhow!("check {:?}", path))?;
+        Ok(metrics)
+    }
+
+    fn map(file: &File, prot: ProtFlags) -> Result<Metrics> {
+        let addr = unsafe {
+            mmap(
+                std::ptr::null_mut(),
+                std::mem::size_of::<Region>(),
+                prot,
+                MapFlags::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        }
+        .context("mmap")?;
+        Ok(Metrics {
+            region: NonNull::new(addr as *mut Region).ok_or_else(|| anyhow!("null mapping"))?,
+        })
+    }
+
+    fn region(&self) -> &Region {
+        // The mapping is at least as large as the region, lives as long as `self`, and every
+        // field is an atomic for which any bit pattern is valid.
+        unsafe { self.region.as_ref() }
+    }
+
+    fn check(&self) -> Result<()> {
+        let region = self.region();
+        let magic = region.magic.load(Ordering::Acquire);
+        if magic != MAGIC {
+            bail!("not a metrics file (magic {:#x})", magic);
+        }
+        let version = region.version.load(Ordering::Acquire);
+        if version != VERSION {
+            bail!("unsupported metrics version {}", version);
+        }
+        Ok(())
+    }
+
+    /// Adds what happened to a jail to the metrics.
+    pub(crate) fn record(&self, event: &JailEvent) {
+        let region = self.region();
+        let add = |counter: &AtomicU64, happened: bool| {
+            if happened {
+                counter.fetch_add(1, Ordering::Relaxed);
+            }
+        };
+        let spawns = match event.spawn_kind {
+            Some(SpawnKind::Compile(lang)) => region.compiles.get(lang as usize),
+            Some(SpawnKind::Run(lang)) => region.runs.get(lang as usize),
+            None => None,
+        };
+        if let Some(spawns) = spawns {
+            add(spawns, true);
+        }
+        match event.setup_latency {
+            Some(setup_latency) => region.setup_latency.observe(setup_latency),
+            None => add(&region.setup_failures, true),
+        }
+        region.overhead.observe(event.overhead);
+        add(&region.cgroup_failures, event.cgroup_failed);
+        add(&region.seccomp_kills, event.seccomp_killed);
+        add(&region.ooms, event.oom);
+        add(&region.sigsys_fallbacks, event.sigsys_fallback);
+    }
+
+    /// Returns the metrics in the Prometheus text exposition format.
+    pub fn to_prometheus(&self) -> String {
+        let region = self.region();
+        let mut out = String::new();
+
+        let _ = writeln!(
+            out,
+            "# HELP omegajail_spawns_total Number of jails spawned, by mode and language."
+        );
+        let _ = writeln!(out, "# TYPE omegajail_spawns_total counter");
+        for (mode, counters) in [("compile", &region.compiles), ("run", &region.runs)] {
+            for lang in Language::value_variants() {
+                let count = counters
+                    .get(*lang as usize)
+                    .map_or(0, |counter| counter.load(Ordering::Relaxed));
+                if count == 0 {
+                    continue;
+                }
+                let name = lang
+                    .to_possible_value()
+                    .map_or_else(|| format!("{:?}", lang), |v| v.get_name().to_string());
+                let _ = writeln!(
+                    out,
+                    "omegajail_spawns_total{{mode=\"{}\",language=\"{}\"}} {}",
+                    mode, name, count
+                );
+            }
+        }
+
+        region.setup_latency.write_prometheus(
+            &mut out,
+            "omegajail_setup_latency_seconds",
+            "Time to create the sandbox and set up its namespaces and cgroups.",
+        );
+        region.overhead.write_prometheus(
+            &mut out,
+            "omegajail_overhead_seconds",
+            "Lifetime of a jail during which the sandboxed process was not running.",
+        );
+
+        for (name, help, counter) in [
+            (
+                "omegajail_setup_failures_total",
+                "Jails whose sandbox could not be set up.",
+                &region.setup_failures,
+            ),
+            (
+                "omegajail_cgroup_failures_total",
+                "Jails whose cgroup could not be set up.",
+                &region.cgroup_failures,
+            ),
+            (
+                "omegajail_seccomp_kills_total",
+                "Processes killed for invoking a forbidden syscall.",
+                &region.seccomp_kills,
+            ),
+            (
+                "omegajail_ooms_total",
+                "Processes that reached their memory limit.",
+                &region.ooms,
+            ),
+            (
+                "omegajail_sigsys_fallbacks_total",
+                "Jails that used the SIGSYS-based seccomp filter.",
+                &region.sigsys_fallbacks,
+            ),
+        ] {
+            let _ = writeln!(out, "# HELP {} {}", name, help);
+            let _ = writeln!(out, "# TYPE {} counter", name);
+            let _ = writeln!(out, "{} {}", name, counter.load(Ordering::Relaxed));
+        }
+
+        out
+    }
+}
+
+impl Drop for Metrics {
+    fn drop(&mut self) {
+        if let Err(err) = unsafe {
+            munmap(
+                self.region.as_ptr() as *mut libc::c_void,
+                std::mem::size_of::<Region>(),
+            )
+        } {
+            log::error!("munmap metrics: {:#}", err);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs::write;
+    use std::sync::atomic::{AtomicU64, Ordering};
+    use std::time::Duration;
+
+    use anyhow::Result;
+    use tempdir::TempDir;
+
+    use crate::args::Language;
+    use crate::metrics::{
+        Histogram, JailEvent, Metrics, SpawnKind, LATENCY_BUCKETS_USEC, MAGIC, VERSION,
+    };
+
+    fn histogram() -> Histogram {
+        Histogram {
+            buckets: Default::default(),
+            sum_usec: AtomicU64::new(0),
+        }
+    }
+
+    fn bucket_counts(histogram: &Histogram) -> Vec<u64> {
+        histogram
+            .buckets
+            .iter()
+            .map(|bucket| bucket.load(Ordering::Relaxed))
+            .collect()
+    }
+
+    #[test]
+    fn histogram_observe_uses_inclusive_upper_bounds() {
+        let histogram = histogram();
+        histogram.observe(Duration::ZERO);
+        histogram.observe(Duration::from_micros(100));
+        histogram.observe(Duration::from_micros(101));
+        histogram.observe(Duration::from_secs(10));
+        histogram.observe(Duration::from_secs(11));
+
+        let mut expected = vec![0; LATENCY_BUCKETS_USEC.len() + 1];
+        expected[0] = 2;
+        expected[1] = 1;
+        expected[LATENCY_BUCKETS_USEC.len() - 1] = 1;
+        expected[LATENCY_BUCKETS_USEC.len()] = 1;
+        assert_eq!(bucket_counts(&histogram), expected);
+        assert_eq!(
+            histogram.sum_usec.load(Ordering::Relaxed),
+            100 + 101 + 10_000_000 + 11_000_000
+        );
+
+        // Durations that do not fit in a u64 of microseconds still land in the last bucket.
+        histogram.observe(Duration::MAX);
+        assert_eq!(
+            histogram.buckets[LATENCY_BUCKETS_USEC.len()].load(Ordering::Relaxed),
+            2
+        );
+    }
+
+    #[test]
+    fn histogram_write_prometheus_is_cumulative() {
+        let histogram = histogram();
+        histogram.observe(Duration::from_micros(50));
+        histogram.observe(Duration::from_micros(300));
+        histogram.observe(Duration::from_secs(20));
+
+        let mut out = String::new();
+        histogram.write_prometheus(&mut out, "latency_seconds", "Some latency.");
+        let lines: Vec<&str> = out.lines().collect();
+        assert_eq!(lines[0], "# HELP latency_seconds Some latency.");
+        assert_eq!(lines[1], "# TYPE latency_seconds histogram");
+        assert_eq!(lines[2], "latency_seconds_bucket{le=\"0.0001\"} 1");
+        assert_eq!(lines[3], "latency_seconds_bucket{le=\"0.00025\"} 1");
+        assert_eq!(lines[4], "latency_seconds_bucket{le=\"0.0005\"} 2");
+        assert_eq!(lines[17], "latency_seconds_bucket{le=\"10\"} 2");
+        assert_eq!(lines[18], "latency_seconds_bucket{le=\"+Inf\"} 3");
+        assert_eq!(lines[19], "latency_seconds_sum 20.00035");
+        assert_eq!(lines[20], "latency_seconds_count 3");
+        assert_eq!(lines.len(), 21);
+    }
+
+    #[test]
+    fn metrics_are_shared_across_mappings() -> Result<()> {
+        let tmp_dir = TempDir::new("metrics")?;
+        let path = tmp_dir.path().join("metrics");
+
+        for spawn_kind in [
+            Some(SpawnKind::Run(Language::Python3)),
+            Some(SpawnKind::Run(Language::Python3)),
+            Some(SpawnKind::Compile(Language::Java)),
+        ] {
+            Metrics::open(&path)?.record(&JailEvent {
+                spawn_kind: spawn_kind,
+                setup_latency: Some(Duration::from_millis(2)),
+                overhead: Duration::from_millis(3),
+                seccomp_killed: false,
+                oom: true,
+                sigsys_fallback: false,
+                cgroup_failed: false,
+            });
+        }
+        Metrics::open(&path)?.record(&JailEvent {
+            spawn_kind: None,
+            setup_latency: None,
+            overhead: Duration::ZERO,
+            seccomp_killed: true,
+            oom: false,
+            sigsys_fallback: true,
+            cgroup_failed: true,
+        });
+
+        let out = Metrics::open_readonly(&path)?.to_prometheus();
+        let lines: Vec<&str> = out.lines().collect();
+        for expected in [
+            "omegajail_spawns_total{mode=\"compile\",language=\"java\"} 1",
+            "omegajail_spawns_total{mode=\"run\",language=\"py3\"} 2",
+            "omegajail_setup_latency_seconds_count 3",
+            "omegajail_setup_latency_seconds_sum 0.006",
+            "omegajail_overhead_seconds_count 4",
+            "omegajail_setup_failures_total 1",
+            "omegajail_cgroup_failures_total 1",
+            "omegajail_seccomp_kills_total 1",
+            "omegajail_ooms_total 3",
+            "omegajail_sigsys_fallbacks_total 1",
+        ] {
+            assert!(lines.contains(&expected), "{:?} not in:\n{}", expected, out);
+        }
+        // Languages that were never spawned are omitted.
+        assert_eq!(
+            lines
+                .iter()
+                .filter(|line| line.starts_with("omegajail_spawns_total{"))
+                .count(),
+            2
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn metrics_reject_foreign_files() -> Result<()> {
+        let tmp_dir = TempDir::new("metrics")?;
+
+        let missing = tmp_dir.path().join("missing");
+        assert!(Metrics::open_readonly(&missing).is_err());
+
+        let small = tmp_dir.path().join("small");
+        write(&small, b"OMJMETR\0")?;
+        assert!(Metrics::open_readonly(&small).is_err());
+
+        let foreign = tmp_dir.path().join("foreign");
+        write(&foreign, vec![0xff; 1 << 16])?;
+        assert!(Metrics::open(&foreign).is_err());
+        assert!(Metrics::open_readonly(&foreign).is_err());
+
+        let newer = tmp_dir.path().join("newer");
+        let mut contents = vec![0u8; 1 << 16];
+        contents[0..8].copy_from_slice(&MAGIC.to_le_bytes());
+        contents[8..16].copy_from_slice(&(VERSION + 1).to_le_bytes());
+        write(&newer, contents)?;
+        assert!(Metrics::open(&newer).is_err());
+        Ok(())
+    }
+}
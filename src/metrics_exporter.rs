@@ -0,0 +1,45 @@
+use std::fs::{self, File};
+use std::io::Write;
+
+use anyhow::{anyhow, Context, Result};
+use clap::Parser;
+
+use omegajail::metrics::{Metrics, DEFAULT_METRICS_PATH};
+
+#[derive(Parser, Clone, Debug)]
+#[clap(author, version, about, long_about = None)]
+struct Args {
+    /// The path of the host-wide metrics file
+    #[clap(long, default_value = DEFAULT_METRICS_PATH)]
+    metrics: String,
+
+    /// The file where the metrics are written in the Prometheus text format, for the textfile
+    /// collector of the node exporter. It is replaced atomically. The metrics are printed to
+    /// stdout if it is not provided
+    #[clap(long)]
+    output: Option<String>,
+}
+
+#[doc(hidden)]
+fn main() -> Result<()> {
+    let args = Args::parse();
+
+    let metrics = Metrics::open_readonly(&args.metrics)?.to_prometheus();
+    match &args.output {
+        Some(output) => {
+            let tmp_path = format!("{}.tmp", output);
+            let mut f = File::create(&tmp_path).with_context(|| anyhow!("create {}", tmp_path))?;
+            f.write_all(metrics.as_bytes())
+                .with_context(|| anyhow!("write {}", tmp_path))?;
+            f.sync_all().with_context(|| anyhow!("sync {}", tmp_path))?;
+            fs::rename(&tmp_path, output)
+                .with_context(|| anyhow!("rename {} to {}", tmp_path, output))?;
+        }
+        None => {
+            std::io::stdout()
+                .write_all(metrics.as_bytes())
+                .context("write metrics")?;
+        }
+    }
+    Ok(())
+}
@@ -9,8 +9,9 @@ use nix::unistd::dup2;
 fn main() -> Result<()> {
     let args = omegajail::Args::parse();
 
-    // Redirect all logging to the stderr file.
-    if let Some(stderr) = &args.stderr {
+    // Redirect all logging to the stderr file. In multi-case mode each case has its own stderr
+    // file, so logging goes to the real stderr.
+    if let (Some(stderr), None) = (&args.stderr, &args.cases) {
         // Rust does not allow the combination of create, truncate, and append. Create+truncate the
         // file first, and then open for appending.
         File::options()
@@ -29,7 +30,42 @@ fn main() -> Result<()> {
         .filter(None, log::LevelFilter::Info)
         .init();
 
-    let result = omegajail::Command::new(args).spawn()?.wait()?;
+    if args.cases.is_some() {
+        let results = omegajail::Command::new(args).status_cases()?;
+        let failed = results.iter().filter(|r| r.failed).count();
+        let skipped = results
+            .iter()
+            .filter(|r| r.result.is_none() && r.error.is_none())
+            .count();
+        if failed != 0 {
+            bail!(
+                "{} of {} cases failed, {} skipped",
+                failed,
+                results.len(),
+                skipped
+            );
+        }
+        return Ok(());
+    }
+
+    if args.checker.is_some() {
+        let checked_result = omegajail::Command::new(args).status_with_checker()?;
+        match (
+            &checked_result.result.status,
+            &checked_result.checker_result,
+        ) {
+            (omegajail::sys::WaitStatus::Exited(_, 0), Some(checker_result)) => {
+                match checker_result.status {
+                    omegajail::sys::WaitStatus::Exited(_, 0) => {}
+                    _ => bail!("checker did not exit cleanly: {:?}", checker_result),
+                }
+            }
+            _ => bail!("jail did not exit cleanly: {:?}", checked_result.result),
+        }
+        return Ok(());
+    }
+
+    let result = omegajail::Command::new(args).status()?;
     match result.status {
         omegajail::sys::WaitStatus::Exited(_, 0) => {}
         _ => {
@@ -16,8 +16,12 @@ use serde::{Deserialize, Serialize};
 /// Error checker for libc functions.
 ///
 /// Returns an [`std::io::Error`] with the stringified error if the result of the function call is
-/// negative, and the result of the function as-is otherwise.
+/// negative, and the result of the function as-is otherwise. `libc::syscall` returns -1 and sets
+/// `errno`, so that is what gets reported in that case.
 fn check_err(num: libc::c_long) -> Result<libc::c_long> {
+    if num == -1 {
+        return Err(Error::new(Errno::last()));
+    }
     if num < 0 {
         match Errno::from_i32(-num.try_into()?) {
             Errno::UnknownErrno => {
@@ -217,6 +221,42 @@ pub(crate) fn set_no_new_privs() -> Result<()> {
     Ok(())
 }
 
+/// Disables Transparent Huge Pages for the calling process and its children. If
+/// `except_advised` is set, regions that were explicitly `madvise(MADV_HUGEPAGE)`d can still use
+/// them (only supported since Linux 6.18).
+pub(crate) fn set_thp_disable(except_advised: bool) -> Result<()> {
+    const PR_SET_THP_DISABLE: i32 = 41;
+    const PR_THP_DISABLE_EXCEPT_ADVISED: u64 = 1 << 1;
+
+    let flags = if except_advised {
+        PR_THP_DISABLE_EXCEPT_ADVISED
+    } else {
+        0
+    };
+    check_err(unsafe { libc::syscall(libc::SYS_prctl, PR_SET_THP_DISABLE, 1, flags, 0, 0) })
+        .with_context(|| format!("prctl(PR_SET_THP_DISABLE, 1, {:#x})", flags))?;
+
+    Ok(())
+}
+
+/// Returns whether the running kernel supports `set_thp_disable(true)`. Older kernels reject the
+/// flag with `EINVAL`, which the child would only find out about after the jail was set up.
+pub(crate) fn thp_disable_except_advised_supported() -> Result<bool> {
+    let release =
+        read_to_string("/proc/sys/kernel/osrelease").context("read(/proc/sys/kernel/osrelease)")?;
+    Ok(parse_kernel_version(&release)
+        .with_context(|| format!("parse kernel release {:?}", release.trim()))?
+        >= (6, 18))
+}
+
+/// Parses the `(major, minor)` version out of a kernel release like `6.18.2-arch1-1`.
+fn parse_kernel_version(release: &str) -> Result<(u32, u32)> {
+    let mut parts = release.trim().split(|c: char| !c.is_ascii_digit());
+    let major = parts.next().unwrap_or_default().parse()?;
+    let minor = parts.next().unwrap_or_default().parse()?;
+    Ok((major, minor))
+}
+
 pub(crate) fn seccomp_set_mode_filter(filter: &[u8]) -> Result<()> {
     const SECCOMP_SET_MODE_FILTER: i32 = 1;
 
@@ -338,20 +378,62 @@ ioctl_readwrite!(
     SeccompNotif
 );
 
-pub(crate) fn seccomp_read_notification(fd: RawFd, buf: &mut [u8]) -> Result<SeccompNotif> {
+/// Reads the next seccomp notification.
+///
+/// Returns `None` if the notification is no longer valid, which happens when the process that
+/// made the syscall was killed before the notification could be read.
+pub(crate) fn seccomp_read_notification(fd: RawFd, buf: &mut [u8]) -> Result<Option<SeccompNotif>> {
     loop {
+        // The kernel refuses to fill in a buffer that is not zeroed.
+        buf.fill(0);
         match unsafe { seccomp_notif_recv(fd, buf as *mut _ as *mut SeccompNotif) } {
             Err(Errno::EINTR) => {}
-            Err(err) => {
-                log::error!("failed: {:#}", err);
-                break;
-            }
-            Ok(_) => {
-                break;
-            }
+            Err(Errno::ENOENT) => return Ok(None),
+            Err(err) => return Err(Error::new(err).context("ioctl(SECCOMP_IOCTL_NOTIF_RECV)")),
+            Ok(_) => break,
+        }
+    }
+    Ok(Some(
+        unsafe { &*(buf as *mut _ as *mut SeccompNotif) }.clone(),
+    ))
+}
+
+/// Let the syscall of a seccomp notification run as if the filter had allowed it.
+pub(crate) const SECCOMP_USER_NOTIF_FLAG_CONTINUE: u32 = 1 << 0;
+
+#[doc(hidden)]
+#[repr(C)]
+pub struct SeccompNotifResp {
+    pub id: u64,
+    pub val: i64,
+    pub error: i32,
+    pub flags: u32,
+}
+
+ioctl_readwrite!(
+    #[doc(hidden)]
+    seccomp_notif_send,
+    SECCOMP_IOC_MAGIC,
+    1,
+    SeccompNotifResp
+);
+
+/// Answers the seccomp notification `id`.
+///
+/// Returns `false` if the notification is no longer valid, which happens when the process that
+/// made the syscall was killed or interrupted by a signal while the notification was pending.
+pub(crate) fn seccomp_send_notification_response(
+    fd: RawFd,
+    response: &mut SeccompNotifResp,
+) -> Result<bool> {
+    loop {
+        match unsafe { seccomp_notif_send(fd, response as *mut SeccompNotifResp) } {
+            Err(Errno::EINTR) => {}
+            Err(Errno::ENOENT) => return Ok(false),
+            Err(err) => return Err(Error::new(err).context("ioctl(SECCOMP_IOCTL_NOTIF_SEND)")),
+            Ok(_) => return Ok(true),
         }
     }
-    Ok(unsafe { &*(buf as *mut _ as *mut SeccompNotif) }.clone())
 }
 
 pub(crate) fn pidfd_open(pid: Pid, flags: i32) -> Result<File> {
@@ -366,6 +448,207 @@ pub(crate) fn close_range(first: RawFd, last: Option<RawFd>, flags: u32) -> Resu
     Ok(())
 }
 
+/// The subset of `struct perf_event_attr` (up to `PERF_ATTR_SIZE_VER5`) that is used to sample a
+/// process.
+#[repr(C)]
+#[derive(Default)]
+pub(crate) struct PerfEventAttr {
+    pub(crate) type_: u32,
+    pub(crate) size: u32,
+    pub(crate) config: u64,
+    pub(crate) sample_period: u64,
+    pub(crate) sample_type: u64,
+    pub(crate) read_format: u64,
+    pub(crate) flags: u64,
+    pub(crate) wakeup_watermark: u32,
+    pub(crate) bp_type: u32,
+    pub(crate) config1: u64,
+    pub(crate) config2: u64,
+    pub(crate) branch_sample_type: u64,
+    pub(crate) sample_regs_user: u64,
+    pub(crate) sample_stack_user: u32,
+    pub(crate) clockid: i32,
+    pub(crate) sample_regs_intr: u64,
+    pub(crate) aux_watermark: u32,
+    pub(crate) sample_max_stack: u16,
+    pub(crate) reserved: u16,
+}
+static_assertions::assert_eq_size!(PerfEventAttr, [u8; 112]);
+
+pub(crate) const PERF_TYPE_SOFTWARE: u32 = 1;
+pub(crate) const PERF_COUNT_SW_TASK_CLOCK: u64 = 1;
+
+pub(crate) const PERF_SAMPLE_IP: u64 = 1 << 0;
+pub(crate) const PERF_SAMPLE_TID: u64 = 1 << 1;
+pub(crate) const PERF_SAMPLE_CALLCHAIN: u64 = 1 << 5;
+
+pub(crate) const PERF_ATTR_FLAG_DISABLED: u64 = 1 << 0;
+pub(crate) const PERF_ATTR_FLAG_INHERIT: u64 = 1 << 1;
+pub(crate) const PERF_ATTR_FLAG_EXCLUDE_KERNEL: u64 = 1 << 5;
+pub(crate) const PERF_ATTR_FLAG_EXCLUDE_HV: u64 = 1 << 6;
+pub(crate) const PERF_ATTR_FLAG_MMAP: u64 = 1 << 8;
+pub(crate) const PERF_ATTR_FLAG_ENABLE_ON_EXEC: u64 = 1 << 12;
+pub(crate) const PERF_ATTR_FLAG_WATERMARK: u64 = 1 << 14;
+pub(crate) const PERF_ATTR_FLAG_EXCLUDE_CALLCHAIN_KERNEL: u64 = 1 << 21;
+
+/// Opens a perf event that monitors `pid` while it runs on `cpu`, or in any CPU if it's -1.
+pub(crate) fn perf_event_open(attr: &mut PerfEventAttr, pid: Pid, cpu: i32) -> Result<File> {
+    const PERF_FLAG_FD_CLOEXEC: libc::c_ulong = 1 << 3;
+
+    attr.size = std::mem::size_of::<PerfEventAttr>().try_into()?;
+    let fd: RawFd = check_err(unsafe {
+        libc::syscall(
+            libc::SYS_perf_event_open,
+            attr as *const _ as *const libc::c_void,
+            pid.as_raw(),
+            cpu,
+            -1,
+            PERF_FLAG_FD_CLOEXEC,
+        )
+    })
+    .with_context(|| format!("perf_event_open({}, {})", pid, cpu))?
+    .try_into()?;
+
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+// The Landlock syscalls have the same number in all architectures.
+const SYS_LANDLOCK_CREATE_RULESET: libc::c_long = 444;
+const SYS_LANDLOCK_ADD_RULE: libc::c_long = 445;
+const SYS_LANDLOCK_RESTRICT_SELF: libc::c_long = 446;
+
+pub(crate) const LANDLOCK_ACCESS_FS_EXECUTE: u64 = 1 << 0;
+pub(crate) const LANDLOCK_ACCESS_FS_WRITE_FILE: u64 = 1 << 1;
+pub(crate) const LANDLOCK_ACCESS_FS_READ_FILE: u64 = 1 << 2;
+pub(crate) const LANDLOCK_ACCESS_FS_READ_DIR: u64 = 1 << 3;
+pub(crate) const LANDLOCK_ACCESS_FS_REMOVE_DIR: u64 = 1 << 4;
+pub(crate) const LANDLOCK_ACCESS_FS_REMOVE_FILE: u64 = 1 << 5;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_CHAR: u64 = 1 << 6;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_DIR: u64 = 1 << 7;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_REG: u64 = 1 << 8;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_SOCK: u64 = 1 << 9;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_FIFO: u64 = 1 << 10;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_BLOCK: u64 = 1 << 11;
+pub(crate) const LANDLOCK_ACCESS_FS_MAKE_SYM: u64 = 1 << 12;
+/// Available since Landlock ABI version 2.
+pub(crate) const LANDLOCK_ACCESS_FS_REFER: u64 = 1 << 13;
+/// Available since Landlock ABI version 3.
+pub(crate) const LANDLOCK_ACCESS_FS_TRUNCATE: u64 = 1 << 14;
+/// Available since Landlock ABI version 4.
+pub(crate) const LANDLOCK_ACCESS_NET_BIND_TCP: u64 = 1 << 0;
+/// Available since Landlock ABI version 4.
+pub(crate) const LANDLOCK_ACCESS_NET_CONNECT_TCP: u64 = 1 << 1;
+/// Available since Landlock ABI version 6.
+pub(crate) const LANDLOCK_SCOPE_ABSTRACT_UNIX_SOCKET: u64 = 1 << 0;
+/// Available since Landlock ABI version 6.
+pub(crate) const LANDLOCK_SCOPE_SIGNAL: u64 = 1 << 1;
+
+/// The access rights that can be granted on a regular file, as opposed to a directory.
+pub(crate) const LANDLOCK_ACCESS_FS_FILE: u64 = LANDLOCK_ACCESS_FS_EXECUTE
+    | LANDLOCK_ACCESS_FS_WRITE_FILE
+    | LANDLOCK_ACCESS_FS_READ_FILE
+    | LANDLOCK_ACCESS_FS_TRUNCATE;
+
+/// Returns the highest Landlock ABI version supported by the kernel. Fails with `ENOSYS` or
+/// `EOPNOTSUPP` if Landlock is not available.
+pub(crate) fn landlock_abi_version() -> Result<u32> {
+    const LANDLOCK_CREATE_RULESET_VERSION: u32 = 1 << 0;
+
+    let version = check_err(unsafe {
+        libc::syscall(
+            SYS_LANDLOCK_CREATE_RULESET,
+            std::ptr::null::<libc::c_void>(),
+            0,
+            LANDLOCK_CREATE_RULESET_VERSION,
+        )
+    })
+    .context("landlock_create_ruleset(NULL, 0, LANDLOCK_CREATE_RULESET_VERSION)")?;
+
+    Ok(version.try_into()?)
+}
+
+/// The attributes of a Landlock ruleset.
+#[repr(C)]
+#[derive(Debug)]
+pub(crate) struct LandlockRulesetAttr {
+    pub(crate) handled_access_fs: u64,
+    /// Available since Landlock ABI version 4.
+    pub(crate) handled_access_net: u64,
+    /// Available since Landlock ABI version 6.
+    pub(crate) scoped: u64,
+}
+
+/// Creates a Landlock ruleset with the restrictions in `attr`. Only the fields of `attr` that are
+/// known to the kernel's `abi_version` are passed, since older kernels reject a larger struct.
+pub(crate) fn landlock_create_ruleset(
+    attr: &LandlockRulesetAttr,
+    abi_version: u32,
+) -> Result<File> {
+    let size = match abi_version {
+        0..=3 => std::mem::size_of::<u64>(),
+        4 | 5 => 2 * std::mem::size_of::<u64>(),
+        _ => std::mem::size_of::<LandlockRulesetAttr>(),
+    };
+    let fd: RawFd = check_err(unsafe {
+        libc::syscall(
+            SYS_LANDLOCK_CREATE_RULESET,
+            attr as *const _ as *const libc::c_void,
+            size,
+            0,
+        )
+    })
+    .with_context(|| format!("landlock_create_ruleset({:?})", attr))?
+    .try_into()?;
+
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+/// Allows `allowed_access` on the file or directory hierarchy opened as `parent` (typically with
+/// `O_PATH`).
+pub(crate) fn landlock_add_path_beneath_rule(
+    ruleset: &File,
+    parent: &File,
+    allowed_access: u64,
+) -> Result<()> {
+    const LANDLOCK_RULE_PATH_BENEATH: i32 = 1;
+
+    #[repr(C, packed)]
+    struct LandlockPathBeneathAttr {
+        allowed_access: u64,
+        parent_fd: i32,
+    }
+
+    let attr = LandlockPathBeneathAttr {
+        allowed_access,
+        parent_fd: parent.as_raw_fd(),
+    };
+    check_err(unsafe {
+        libc::syscall(
+            SYS_LANDLOCK_ADD_RULE,
+            ruleset.as_raw_fd(),
+            LANDLOCK_RULE_PATH_BENEATH,
+            &attr as *const _ as *const libc::c_void,
+            0,
+        )
+    })
+    .with_context(|| {
+        format!(
+            "landlock_add_rule(LANDLOCK_RULE_PATH_BENEATH, {:#x})",
+            allowed_access
+        )
+    })?;
+
+    Ok(())
+}
+
+/// Enforces a Landlock ruleset on the calling thread. Requires `PR_SET_NO_NEW_PRIVS`.
+pub(crate) fn landlock_restrict_self(ruleset: &File) -> Result<()> {
+    check_err(unsafe { libc::syscall(SYS_LANDLOCK_RESTRICT_SELF, ruleset.as_raw_fd(), 0) })
+        .context("landlock_restrict_self")?;
+
+    Ok(())
+}
+
 pub(crate) enum WaitidWhich {
     Pid(Pid),
 }
@@ -462,6 +745,23 @@ pub struct WaitidStatus {
     pub wall_time: Duration,
     /// The maximum Resident Set Size (memory) consumed by the process.
     pub max_rss: u64,
+    /// The maximum amount of anonymous memory backed by Transparent Huge Pages observed while the
+    /// process was running, if it was sampled.
+    #[serde(default)]
+    pub max_anon_huge_pages: Option<u64>,
+    /// The amount of CPU time spent by the main thread of the process, if its threads were
+    /// sampled.
+    #[serde(default)]
+    pub main_thread_time: Option<Duration>,
+    /// The amount of CPU time spent by the rest of the threads of the process (the JIT compiler,
+    /// the garbage collector, and other service threads of the runtime), if its threads were
+    /// sampled.
+    #[serde(default)]
+    pub runtime_threads_time: Option<Duration>,
+    /// Whether the process ran under the SIGSYS-based seccomp filter because seccomp
+    /// notifications were not available.
+    #[serde(default)]
+    pub sigsys_fallback: bool,
 }
 
 pub(crate) fn waitid(which: WaitidWhich, options: WaitPidFlag) -> Result<WaitidStatus> {
@@ -580,6 +880,10 @@ pub(crate) fn waitid(which: WaitidWhich, options: WaitPidFlag) -> Result<WaitidS
             + Duration::from_micros(rusage.ru_utime.tv_usec.try_into()?),
         wall_time: Duration::ZERO,
         max_rss: (rusage.ru_maxrss * 1024).try_into()?,
+        max_anon_huge_pages: None,
+        main_thread_time: None,
+        runtime_threads_time: None,
+        sigsys_fallback: false,
     })
 }
 
@@ -606,3 +910,17 @@ impl SendFile for UnixStream {
         Ok(())
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn parse_kernel_version_handles_distro_releases() {
+        assert_eq!(parse_kernel_version("6.18.44-fc-v139\n").unwrap(), (6, 18));
+        assert_eq!(parse_kernel_version("5.4.0-150-generic").unwrap(), (5, 4));
+        assert_eq!(parse_kernel_version("6.19").unwrap(), (6, 19));
+        assert!(parse_kernel_version("6").is_err());
+        assert!(parse_kernel_version("").is_err());
+    }
+}
@@ -0,0 +1,533 @@
+#!/usr/bin/python3
+"""Replays a recorded grading workload against the local omegajail.
+
+Synthetic load does not reproduce contest-start bursts, where hundreds of
+submissions need to be compiled within a minute and each one then fans out
+into its test cases. This tool has two modes:
+
+* `record` reads the runs in a standalone grader database (the same Runs
+  table that standalone_grader.py loads) and writes a trace, one JSON object
+  per line, with the arrival time, language, sources, cases and limits of
+  every run.
+* `replay` submits every run in a trace to a pool of workers at its recorded
+  arrival time (optionally accelerated), compiles it, runs all its cases, and
+  reports percentiles of the queueing delay, the spawn latency (the wall time
+  of the omegajail invocation that was not spent running the program) and the
+  end-to-end grading latency.
+
+Cases are run with the real inputs if the problem repository is available,
+and with synthetic inputs of the recorded size otherwise.
+"""
+
+import argparse
+import concurrent.futures
+import json
+import logging
+import math
+import os
+import os.path
+import re
+import shutil
+import sqlite3
+import subprocess
+import tempfile
+import threading
+import time
+
+from typing import Any, Dict, Iterator, List, NamedTuple, Optional, Tuple
+
+_EXTENSIONS = {
+    'c11-gcc': 'c',
+    'c11-clang': 'c',
+    'cpp03-gcc': 'cpp',
+    'cpp03-clang': 'cpp',
+    'cpp11': 'cpp',
+    'cpp11-gcc': 'cpp',
+    'cpp11-clang': 'cpp',
+    'cpp17-gcc': 'cpp',
+    'cpp17-clang': 'cpp',
+    'cpp20-gcc': 'cpp',
+    'cpp20-clang': 'cpp',
+    'py2': 'py',
+    'py3': 'py',
+    'cs-aot': 'cs',
+}
+_DURATION_RE = re.compile(r'^(\d+(?:\.\d+)?)(ms|s|m)$')
+_DURATION_UNITS = {'ms': 1, 's': 1000, 'm': 60 * 1000}
+_LS_TREE_CASE_RE = re.compile(
+    r'^\d+ blob [0-9a-f]+\s+(\d+)\tcases/([^/]+)\.in$')
+_PERCENTILES = (50, 90, 99, 100)
+
+_DEFAULT_TIME_LIMIT_MSEC = 1000
+_DEFAULT_MEMORY_LIMIT = 256 * 1024 * 1024
+_DEFAULT_OUTPUT_LIMIT = 10 * 1024
+_COMPILE_TIME_LIMIT_MSEC = 30000
+_COMPILE_OUTPUT_LIMIT = 10 * 1024 * 1024
+
+
+class Case(NamedTuple):
+    """A test case of a traced run."""
+    name: str
+    size: int
+
+
+class TracedRun(NamedTuple):
+    """A single entry of a trace."""
+    run_id: int
+    arrival: float
+    language: str
+    sources: List[str]
+    alias: str
+    version: str
+    cases: List[Case]
+    time_limit: int
+    memory_limit: int
+    output_limit: int
+
+    @staticmethod
+    def from_json(entry: Dict[str, Any]) -> 'TracedRun':
+        """Parses a trace entry, filling in the default limits."""
+        return TracedRun(
+            run_id=entry.get('run_id', 0),
+            arrival=float(entry['arrival']),
+            language=entry['language'],
+            sources=entry['sources'],
+            alias=entry.get('alias', ''),
+            version=entry.get('version', ''),
+            cases=[Case(case['name'], case['size']) for case in entry['cases']],
+            time_limit=entry.get('time_limit', _DEFAULT_TIME_LIMIT_MSEC),
+            memory_limit=entry.get('memory_limit', _DEFAULT_MEMORY_LIMIT),
+            output_limit=entry.get('output_limit', _DEFAULT_OUTPUT_LIMIT),
+        )
+
+    def to_json(self) -> Dict[str, Any]:
+        """Returns the trace entry for this run."""
+        entry = self._asdict()
+        entry['cases'] = [case._asdict() for case in self.cases]
+        return entry
+
+
+def _parse_duration(duration: Any, default: int) -> int:
+    """Parses an omegaUp duration (e.g. "1.5s") into milliseconds."""
+    if isinstance(duration, (int, float)):
+        return int(duration)
+    match = _DURATION_RE.match(str(duration or '').strip())
+    if not match:
+        return default
+    return int(float(match.group(1)) * _DURATION_UNITS[match.group(2)])
+
+
+def _problem_cases(problem_path: str, version: str) -> List[Case]:
+    """Returns the cases of a problem version, with the size of each input."""
+    output = subprocess.check_output(
+        ['/usr/bin/git', 'ls-tree', '-l', '-r', version, 'cases/'],
+        cwd=problem_path,
+        universal_newlines=True)
+    cases: List[Case] = []
+    for line in output.splitlines():
+        match = _LS_TREE_CASE_RE.match(line)
+        if match:
+            cases.append(Case(match.group(2), int(match.group(1))))
+    return cases
+
+
+def _problem_limits(problem_path: str, version: str) -> Dict[str, int]:
+    """Returns the limits in the settings.json of a problem version."""
+    try:
+        settings = json.loads(
+            subprocess.check_output(
+                ['/usr/bin/git', 'show', f'{version}:settings.json'],
+                cwd=problem_path,
+                stderr=subprocess.DEVNULL))
+    except (subprocess.CalledProcessError, ValueError):
+        settings = {}
+    limits = settings.get('Limits', {})
+    return {
+        'time_limit':
+        _parse_duration(limits.get('TimeLimit'), _DEFAULT_TIME_LIMIT_MSEC),
+        'memory_limit':
+        int(limits.get('MemoryLimit', _DEFAULT_MEMORY_LIMIT)),
+        'output_limit':
+        int(limits.get('OutputLimit', _DEFAULT_OUTPUT_LIMIT)),
+    }
+
+
+def _record(database_path: str, problems_dir: str, submissions_dir: str,
+            arrival_column: Optional[str],
+            arrival_interval: float) -> Iterator[TracedRun]:
+    """Yields a traced run for every run in a standalone grader database."""
+    with sqlite3.connect(f'file:{database_path}?mode=ro', uri=True) as db:
+        cursor = db.cursor()
+        cursor.execute('PRAGMA table_info(Runs);')
+        columns = set(row[1] for row in cursor.fetchall())
+        if arrival_column is not None and arrival_column not in columns:
+            raise ValueError(
+                f'Runs table does not have a "{arrival_column}" column')
+        arrival = arrival_column or 'run_id'
+        cursor.execute(f'''
+        SELECT
+            run_id, alias, guid, language, version, {arrival}
+        FROM
+            Runs
+        ORDER BY
+            {arrival} ASC, run_id ASC;
+        ''')
+        rows = cursor.fetchall()
+
+    first_arrival: Optional[float] = None
+    limits_cache: Dict[Tuple[str, str], Dict[str, int]] = {}
+    cases_cache: Dict[Tuple[str, str], List[Case]] = {}
+    for i, (run_id, alias, guid, language, version,
+            arrival_value) in enumerate(rows):
+        if arrival_column is None:
+            arrival_time = i * arrival_interval
+        else:
+            if first_arrival is None:
+                first_arrival = float(arrival_value)
+            arrival_time = float(arrival_value) - first_arrival
+        problem_path = os.path.join(problems_dir, alias)
+        key = (alias, version)
+        if key not in cases_cache:
+            try:
+                cases_cache[key] = _problem_cases(problem_path, version)
+                limits_cache[key] = _problem_limits(problem_path, version)
+            except (OSError, subprocess.CalledProcessError):
+                logging.warning('Failed to read problem %s at %s', alias,
+                                version)
+                cases_cache[key] = []
+                limits_cache[key] = {}
+        if not cases_cache[key]:
+            continue
+        yield TracedRun(
+            run_id=run_id,
+            arrival=arrival_time,
+            language=language,
+            sources=[os.path.join(submissions_dir, guid[:2], guid[2:])],
+            alias=alias,
+            version=version,
+            cases=cases_cache[key],
+            time_limit=limits_cache[key].get('time_limit',
+                                             _DEFAULT_TIME_LIMIT_MSEC),
+            memory_limit=limits_cache[key].get('memory_limit',
+                                               _DEFAULT_MEMORY_LIMIT),
+            output_limit=limits_cache[key].get('output_limit',
+                                               _DEFAULT_OUTPUT_LIMIT),
+        )
+
+
+def _read_meta(meta_path: str) -> Dict[str, str]:
+    meta: Dict[str, str] = {}
+    try:
+        with open(meta_path) as f:
+            for line in f:
+                key, _, value = line.strip().partition(':')
+                meta[key] = value
+    except FileNotFoundError:
+        pass
+    return meta
+
+
+class Samples:
+    """Thread-safe collection of latency samples, in seconds."""
+    def __init__(self) -> None:
+        self._lock = threading.Lock()
+        self._samples: Dict[str, List[float]] = {}
+
+    def add(self, metric: str, value: float) -> None:
+        with self._lock:
+            self._samples.setdefault(metric, []).append(value)
+
+    def report(self) -> Dict[str, Dict[str, float]]:
+        """Returns the count and percentiles of every metric."""
+        report: Dict[str, Dict[str, float]] = {}
+        with self._lock:
+            for metric, values in sorted(self._samples.items()):
+                values = sorted(values)
+                summary: Dict[str, float] = {'count': len(values)}
+                for percentile in _PERCENTILES:
+                    rank = max(1, math.ceil(percentile / 100 * len(values)))
+                    summary[f'p{percentile}'] = values[rank - 1]
+                report[metric] = summary
+        return report
+
+
+class Replayer:
+    """Compiles and runs the traced runs with a fixed number of workers.
+
+    Compiles and cases share the same first-in, first-out queue, so that the
+    cases of the runs that arrived first compete with the compiles of the
+    runs that arrive later, like in a grader host.
+    """
+    def __init__(self, omegajail_root: str, cgroup_path: Optional[str],
+                 problems_dir: Optional[str], work_dir: str, jobs: int):
+        self._omegajail = os.path.join(omegajail_root, 'bin/omegajail')
+        self._omegajail_root = omegajail_root
+        self._cgroup_path = cgroup_path
+        self._problems_dir = problems_dir
+        self._work_dir = work_dir
+        self._executor = concurrent.futures.ThreadPoolExecutor(
+            max_workers=jobs, thread_name_prefix='replay')
+        self._samples = Samples()
+        self._lock = threading.Lock()
+        self._pending = 0
+        self._compile_errors = 0
+        self._idle = threading.Condition(self._lock)
+
+    @property
+    def samples(self) -> Samples:
+        return self._samples
+
+    @property
+    def compile_errors(self) -> int:
+        return self._compile_errors
+
+    def submit(self, run: TracedRun) -> None:
+        """Queues the compile of |run|, which then queues its cases."""
+        with self._lock:
+            self._pending += 1
+        arrival = time.monotonic()
+        self._executor.submit(self._compile, run, arrival)
+
+    def wait(self) -> None:
+        """Waits for all submitted runs to be graded."""
+        with self._idle:
+            while self._pending:
+                self._idle.wait()
+        self._executor.shutdown()
+
+    def _omegajail_call(self, args: List[str], meta_path: str) -> bool:
+        """Calls omegajail and records its spawn latency."""
+        start = time.monotonic()
+        result = subprocess.run([self._omegajail, *args],
+                                stdin=subprocess.DEVNULL,
+                                stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL,
+                                check=False)
+        elapsed = time.monotonic() - start
+        meta = _read_meta(meta_path)
+        if 'time-wall' in meta:
+            self._samples.add('spawn',
+                              max(0.0, elapsed - int(meta['time-wall']) / 1e6))
+        if result.returncode != 0:
+            logging.debug('omegajail %s exited with %d', ' '.join(args),
+                          result.returncode)
+        return result.returncode == 0 and meta.get('status', '0') == '0'
+
+    def _input(self, run: TracedRun, case: Case, run_dir: str) -> str:
+        """Writes the input of |case|, preferring the real one."""
+        input_path = os.path.join(run_dir, f'{case.name}.in')
+        if self._problems_dir and run.alias and run.version:
+            problem_path = os.path.join(self._problems_dir, run.alias)
+            try:
+                with open(input_path, 'wb') as f:
+                    subprocess.check_call([
+                        '/usr/bin/git', 'cat-file', 'blob',
+                        f'{run.version}:cases/{case.name}.in'
+                    ],
+                                          cwd=problem_path,
+                                          stdout=f,
+                                          stderr=subprocess.DEVNULL)
+                return input_path
+            except (OSError, subprocess.CalledProcessError):
+                pass
+        # A stream of small numbers is a valid input for most problems, so
+        # that programs at least get to read all of it.
+        pattern = b'1 ' * 4096
+        with open(input_path, 'wb') as f:
+            remaining = case.size
+            while remaining > 0:
+                f.write(pattern[:remaining])
+                remaining -= len(pattern)
+        return input_path
+
+    def _compile(self, run: TracedRun, arrival: float) -> None:
+        self._samples.add('queue:compile', time.monotonic() - arrival)
+        run_dir = os.path.join(self._work_dir, str(run.run_id))
+        # The executor drops exceptions, so a compile that raises must still
+        # finish its run. Otherwise wait() would never return.
+        try:
+            shutil.rmtree(run_dir, ignore_errors=True)
+            os.makedirs(run_dir)
+            extension = _EXTENSIONS.get(run.language, run.language)
+            sources: List[str] = []
+            for i, source in enumerate(run.sources):
+                name = 'Main.{}'.format(
+                    extension) if i == 0 else os.path.basename(source)
+                shutil.copyfile(source, os.path.join(run_dir, name))
+                sources.extend(['--compile-source', name])
+            meta_path = os.path.join(run_dir, 'compile.meta')
+            args = [
+                '--homedir', run_dir, '--homedir-writable', '-1',
+                os.path.join(run_dir, 'compile.out'), '-2',
+                os.path.join(run_dir, 'compile.err'), '-M', meta_path, '-t',
+                str(_COMPILE_TIME_LIMIT_MSEC), '-O',
+                str(_COMPILE_OUTPUT_LIMIT), '--root', self._omegajail_root,
+                '--compile', run.language, *sources, '--compile-target',
+                'Main'
+            ]
+            if self._cgroup_path:
+                args.extend(['--cgroup-path', self._cgroup_path])
+            compiled = self._omegajail_call(args, meta_path)
+        except Exception:  # pylint: disable=broad-except
+            logging.exception('Failed to compile run %d', run.run_id)
+            compiled = False
+        if not compiled:
+            with self._lock:
+                self._compile_errors += 1
+            self._finish(run, arrival, run_dir)
+            return
+        if not run.cases:
+            self._finish(run, arrival, run_dir)
+            return
+        remaining = [len(run.cases)]
+        for case in run.cases:
+            self._executor.submit(self._run_case, run, case, arrival,
+                                  time.monotonic(), run_dir, remaining)
+
+    def _run_case(self, run: TracedRun, case: Case, arrival: float,
+                  queued: float, run_dir: str, remaining: List[int]) -> None:
+        self._samples.add('queue:case', time.monotonic() - queued)
+        try:
+            input_path = self._input(run, case, run_dir)
+            meta_path = os.path.join(run_dir, f'{case.name}.meta')
+            args = [
+                '--homedir', run_dir, '-0', input_path, '-1',
+                os.path.join(run_dir, f'{case.name}.out'), '-2',
+                os.path.join(run_dir, f'{case.name}.err'), '-M', meta_path,
+                '-t',
+                str(run.time_limit), '-w', '1000', '-O',
+                str(run.output_limit), '-m',
+                str(run.memory_limit), '--root', self._omegajail_root,
+                '--run', run.language, '--run-target', 'Main'
+            ]
+            if self._cgroup_path:
+                args.extend(['--cgroup-path', self._cgroup_path])
+            self._omegajail_call(args, meta_path)
+        finally:
+            with self._lock:
+                remaining[0] -= 1
+                done = not remaining[0]
+            if done:
+                self._finish(run, arrival, run_dir)
+
+    def _finish(self, run: TracedRun, arrival: float, run_dir: str) -> None:
+        latency = time.monotonic() - arrival
+        self._samples.add('end-to-end', latency)
+        self._samples.add(f'end-to-end:{run.language}', latency)
+        shutil.rmtree(run_dir, ignore_errors=True)
+        with self._idle:
+            self._pending -= 1
+            self._idle.notify_all()
+
+
+def _replay(trace_path: str, replayer: Replayer, speed: float) -> None:
+    """Submits every run in the trace at its (scaled) arrival time."""
+    with open(trace_path) as f:
+        runs = sorted((TracedRun.from_json(json.loads(line))
+                       for line in f if line.strip()),
+                      key=lambda run: run.arrival)
+    if not runs:
+        return
+    start = time.monotonic()
+    first_arrival = runs[0].arrival
+    for run in runs:
+        if speed > 0:
+            delay = (run.arrival - first_arrival) / speed - (time.monotonic() -
+                                                             start)
+            if delay > 0:
+                time.sleep(delay)
+        replayer.submit(run)
+    replayer.wait()
+    logging.info('Replayed %d runs in %.1fs', len(runs),
+                 time.monotonic() - start)
+
+
+def _main() -> None:
+    parser = argparse.ArgumentParser()
+    subparsers = parser.add_subparsers(dest='command', required=True)
+
+    record = subparsers.add_parser(
+        'record', help='Write a trace from a standalone grader database')
+    record.add_argument('database', help='Path to the runs SQLite database')
+    record.add_argument('trace', help='Path of the trace to write')
+    record.add_argument('--problems-dir',
+                        default='/var/lib/omegaup/problems.git')
+    record.add_argument('--submissions-dir',
+                        default='/var/lib/omegaup/submissions')
+    record.add_argument(
+        '--arrival-column',
+        type=str,
+        help='Column of the Runs table with the submission time, in seconds. '
+        'Without it, runs arrive in run_id order every --arrival-interval')
+    record.add_argument('--arrival-interval',
+                        type=float,
+                        default=0.1,
+                        help='Seconds between arrivals without '
+                        '--arrival-column')
+
+    replay = subparsers.add_parser(
+        'replay', help='Replay a trace and report latency percentiles')
+    replay.add_argument('trace', help='Path of the trace to replay')
+    replay.add_argument('--root', default='/var/lib/omegajail', type=str)
+    replay.add_argument('--cgroup-path', type=str)
+    replay.add_argument(
+        '--problems-dir',
+        type=str,
+        help='Directory with the problem repositories, to run with the real '
+        'inputs instead of synthetic ones of the same size')
+    replay.add_argument(
+        '--speed',
+        type=float,
+        default=1.0,
+        help='Replay speed relative to the recorded arrival times. 0 submits '
+        'everything at once')
+    replay.add_argument(
+        '--jobs',
+        type=int,
+        default=0,
+        help='Number of concurrent omegajail invocations. Defaults to one '
+        'per available core')
+    replay.add_argument('--work-dir',
+                        type=str,
+                        help='Directory for the runs. Defaults to a '
+                        'temporary directory')
+    replay.add_argument('--json',
+                        type=str,
+                        help='Also write the report to this JSON file')
+
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO,
+                        format='%(asctime)s [%(levelname)-8s] %(message)s')
+
+    if args.command == 'record':
+        count = 0
+        with open(args.trace, 'w') as f:
+            for run in _record(args.database, args.problems_dir,
+                               args.submissions_dir, args.arrival_column,
+                               args.arrival_interval):
+                f.write(json.dumps(run.to_json()) + '\n')
+                count += 1
+        logging.info('Recorded %d runs', count)
+        return
+
+    jobs = args.jobs or len(os.sched_getaffinity(0))
+    with tempfile.TemporaryDirectory(prefix='replay-') as tmp_dir:
+        replayer = Replayer(os.path.abspath(args.root), args.cgroup_path,
+                            args.problems_dir, args.work_dir or tmp_dir, jobs)
+        _replay(args.trace, replayer, args.speed)
+    report = replayer.samples.report()
+    if replayer.compile_errors:
+        logging.warning('%d runs did not compile', replayer.compile_errors)
+    for metric, summary in report.items():
+        print(f'{metric:32s} n={int(summary["count"]):<7d} ' + ' '.join(
+            f'p{percentile}={summary[f"p{percentile}"] * 1000:.1f}ms'
+            for percentile in _PERCENTILES))
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+
+
+if __name__ == '__main__':
+    _main()
@@ -0,0 +1,108 @@
+#!/usr/bin/python3
+"""Tests for the bookkeeping of replay_benchmark.Replayer."""
+
+import os.path
+import tempfile
+import threading
+import unittest
+
+from typing import List, Optional
+
+import replay_benchmark
+
+# How long wait() may take before the test considers it hung.
+_WAIT_TIMEOUT = 10.0
+
+
+def _run(cases: List[str], sources: List[str]) -> replay_benchmark.TracedRun:
+    return replay_benchmark.TracedRun(
+        run_id=1,
+        arrival=0.0,
+        language='c11-gcc',
+        sources=sources,
+        alias='',
+        version='',
+        cases=[replay_benchmark.Case(name, 4) for name in cases],
+        time_limit=1000,
+        memory_limit=64 * 1024 * 1024,
+        output_limit=1024,
+    )
+
+
+class _FakeReplayer(replay_benchmark.Replayer):
+    """A replayer whose omegajail calls succeed, fail or raise on demand."""
+    def __init__(self, work_dir: str, compile_result: Optional[bool]):
+        super().__init__('/nonexistent', None, None, work_dir, 2)
+        self._compile_result = compile_result
+        self.calls: List[List[str]] = []
+
+    def _omegajail_call(self, args: List[str], meta_path: str) -> bool:
+        self.calls.append(args)
+        if '--compile' not in args:
+            return True
+        if self._compile_result is None:
+            raise OSError('omegajail not found')
+        return self._compile_result
+
+
+class ReplayerTest(unittest.TestCase):
+    """Checks that every submitted run is finished exactly once."""
+    def setUp(self) -> None:
+        self._tmp_dir = tempfile.TemporaryDirectory(prefix='replay-test-')
+        self.addCleanup(self._tmp_dir.cleanup)
+        self._source = os.path.join(self._tmp_dir.name, 'sumas.c')
+        with open(self._source, 'w') as f:
+            f.write('int main() { return 0; }\n')
+        self._work_dir = os.path.join(self._tmp_dir.name, 'work')
+
+    def _replay(self, replayer: replay_benchmark.Replayer,
+                run: replay_benchmark.TracedRun) -> None:
+        replayer.submit(run)
+        waiter = threading.Thread(target=replayer.wait, daemon=True)
+        waiter.start()
+        waiter.join(_WAIT_TIMEOUT)
+        self.assertFalse(waiter.is_alive(), 'wait() did not return')
+
+    def _count(self, replayer: replay_benchmark.Replayer, metric: str) -> int:
+        return int(replayer.samples.report().get(metric, {}).get('count', 0))
+
+    def test_runs_every_case(self) -> None:
+        replayer = _FakeReplayer(self._work_dir, True)
+        self._replay(replayer, _run(['1', '2', '3'], [self._source]))
+        self.assertEqual(len(replayer.calls), 4)
+        self.assertEqual(self._count(replayer, 'queue:case'), 3)
+        self.assertEqual(self._count(replayer, 'end-to-end'), 1)
+        self.assertEqual(replayer.compile_errors, 0)
+
+    def test_finishes_runs_without_cases(self) -> None:
+        replayer = _FakeReplayer(self._work_dir, True)
+        self._replay(replayer, _run([], [self._source]))
+        self.assertEqual(self._count(replayer, 'end-to-end'), 1)
+        self.assertEqual(replayer.compile_errors, 0)
+
+    def test_finishes_runs_that_do_not_compile(self) -> None:
+        replayer = _FakeReplayer(self._work_dir, False)
+        self._replay(replayer, _run(['1'], [self._source]))
+        self.assertEqual(len(replayer.calls), 1)
+        self.assertEqual(self._count(replayer, 'end-to-end'), 1)
+        self.assertEqual(replayer.compile_errors, 1)
+
+    def test_finishes_runs_whose_compile_raises(self) -> None:
+        replayer = _FakeReplayer(self._work_dir, None)
+        with self.assertLogs(level='ERROR'):
+            self._replay(replayer, _run(['1'], [self._source]))
+        self.assertEqual(self._count(replayer, 'end-to-end'), 1)
+        self.assertEqual(replayer.compile_errors, 1)
+
+    def test_finishes_runs_with_missing_sources(self) -> None:
+        replayer = _FakeReplayer(self._work_dir, True)
+        missing = os.path.join(self._tmp_dir.name, 'missing.c')
+        with self.assertLogs(level='ERROR'):
+            self._replay(replayer, _run(['1'], [missing]))
+        self.assertEqual(replayer.calls, [])
+        self.assertEqual(self._count(replayer, 'end-to-end'), 1)
+        self.assertEqual(replayer.compile_errors, 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
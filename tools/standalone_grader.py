@@ -5,9 +5,12 @@ This runs each submission in a SQLite3 database.
 """
 
 import argparse
+import asyncio
+import concurrent.futures
 import configparser
+import functools
 import hashlib
-import http.server
+import http
 import io
 import itertools
 import json
@@ -18,26 +21,47 @@ import queue
 import random
 import re
 import shutil
-import socketserver
 import sqlite3
 import ssl
+import struct
 import subprocess
 import sys
 import tarfile
 import threading
 import time
 import zipfile
+import zlib
 
-from typing import (Any, BinaryIO, Dict, Iterable, List, MutableMapping,
-                    NamedTuple, Optional, Sequence, Tuple, Type, Union)
+from typing import (Any, AsyncIterator, BinaryIO, Callable, Dict, Iterable,
+                    List, Mapping, MutableMapping, NamedTuple, Optional,
+                    Sequence, Tuple, TypeVar)
 
 import OpenSSL.crypto  # type: ignore
 
+try:
+    import zstandard  # type: ignore
+except ImportError:
+    zstandard = None
+
 _ROOT = os.path.dirname(__file__)
 
 _LS_TREE_RE = re.compile(b'(\d+) (\w+) ([0-9a-f]+)\s+(\d+|-)\t([^\x00]+)\x00')
-_RUN_RESULTS_RE = re.compile(r'^/run/(\d+)/(results|results.zip)/?$')
+_RUN_RESULTS_RE = re.compile(
+    r'^/run/(\d+)/(results|results.zip|results.stream)/?$')
 _FILENAME_RE = re.compile(r'^.*filename="([^"]+)".*$')
+# Each file in a results stream is framed as (name length, payload length),
+# followed by the UTF-8 name and the payload.
+_RESULTS_STREAM_HEADER = struct.Struct('>HQ')
+# A results stream only contains details.json and a directory for each config.
+# Anything else could clobber the files that the grader adds to the artifacts
+# (the source symlink and the verdict).
+_RESULTS_STREAM_CONFIGS = ('bionic', 'focal')
+# The largest a results stream may get once decompressed.
+_MAX_RESULTS_STREAM_SIZE = 1024**3
+# Request bodies are read and written in pieces of at most this size.
+_BODY_CHUNK_SIZE = 65536
+
+_T = TypeVar('_T')
 
 _CA_CERT = """\
 -----BEGIN CERTIFICATE-----
@@ -212,67 +236,56 @@ def _load_runs(database_path: str,
     return q
 
 
-class ChunkedReader(BinaryIO):
-    def __init__(self, r: BinaryIO):
-        self._r = r
-        self._chunk = b''
-        self._eof = False
+async def _read_chunked(
+        reader: asyncio.StreamReader) -> AsyncIterator[bytes]:
+    """Yields the body of a chunked request as it arrives.
 
-    def _read_chunk(self) -> None:
-        line = b''
-        while True:
-            c = self._r.read(1)
-            if not c:
-                logging.error('Stream reached EOF while reading chunk length')
-                raise EOFError
-            line += c
-            if c == b'\n':
-                break
-        chunklen = int(line.decode('ascii').strip(), 16)
+    Large chunks are yielded in pieces, so a single chunk is never held in
+    memory in its entirety.
+    """
+    while True:
+        line = await reader.readline()
+        if not line.endswith(b'\n'):
+            logging.error('Stream reached EOF while reading chunk length')
+            raise EOFError
+        chunklen = int(line.split(b';', 1)[0].decode('ascii').strip(), 16)
         if not chunklen:
-            self._eof = True
-        self._chunk = b''
+            break
         while chunklen:
-            c = self._r.read(chunklen)
-            if not c:
+            buf = await reader.read(min(chunklen, _BODY_CHUNK_SIZE))
+            if not buf:
                 logging.error('Stream reached EOF while reading chunk')
                 raise EOFError
-            chunklen -= len(c)
-            self._chunk += c
-        c = self._r.read(2)
-        if c != b'\r\n':
+            chunklen -= len(buf)
+            yield buf
+        if await reader.readexactly(2) != b'\r\n':
             logging.error('Stream reached EOF while reading chunk trailer')
             raise EOFError
+    # Skip the trailers.
+    while True:
+        line = await reader.readline()
+        if not line:
+            logging.error('Stream reached EOF while reading trailers')
+            raise EOFError
+        if line in (b'\r\n', b'\n'):
+            break
 
-    def read(self, size: int = -1) -> bytes:
-        if size == -1:
-            return self.readall()
-        if self._eof:
-            return b''
-        if not self._chunk:
-            self._read_chunk()
-        if size >= len(self._chunk):
-            result = self._chunk
-            self._chunk = b''
-            return result
-        result = self._chunk[:size]
-        self._chunk = self._chunk[size:]
-        return result
-
-    def readall(self) -> bytes:
-        result = b''
-        while True:
-            buf = self.read(4096)
-            if not buf:
-                break
-            result += buf
-        return result
-
-    def readinto(self, b: bytes) -> Optional[int]:
-        raise OSError('Not supported')
 
-    def write(self, b: bytes) -> int:
-        raise OSError('Not supported')
+async def _read_body(reader: asyncio.StreamReader,
+                     headers: Mapping[str, str]) -> AsyncIterator[bytes]:
+    """Yields the body of a request as it arrives."""
+    if headers.get('transfer-encoding', '').lower() == 'chunked':
+        async for buf in _read_chunked(reader):
+            yield buf
+        return
+    remaining = int(headers.get('content-length', '0'))
+    while remaining:
+        buf = await reader.read(min(remaining, _BODY_CHUNK_SIZE))
+        if not buf:
+            logging.error('Stream reached EOF while reading body')
+            raise EOFError
+        remaining -= len(buf)
+        yield buf
 
 
 def multipart_reader(raw: BinaryIO) -> Iterable[Tuple[Dict[str, str], bytes]]:
@@ -309,6 +322,117 @@ def multipart_reader(raw: BinaryIO) -> Iterable[Tuple[Dict[str, str], bytes]]:
             break
 
 
+def _is_valid_results_stream_name(name: str) -> bool:
+    """Returns whether name is details.json or a file of a config."""
+    if name == 'details.json':
+        return True
+    components = name.split('/')
+    return (len(components) >= 2 and components[0] in _RESULTS_STREAM_CONFIGS
+            and all(component not in ('', '.', '..')
+                    for component in components))
+
+
+class _DeflateStreamWriter:
+    """Decompresses a deflate stream into a writer, a bounded piece at a time.
+    """
+    def __init__(self, writer: 'ResultsStreamWriter'):
+        self._writer = writer
+        self._decompressor = zlib.decompressobj()
+
+    def write(self, data: bytes) -> None:
+        while data:
+            self._writer.write(
+                self._decompressor.decompress(data, _BODY_CHUNK_SIZE))
+            data = self._decompressor.unconsumed_tail
+
+    def flush(self) -> None:
+        self._writer.write(self._decompressor.flush())
+
+
+def results_stream_decompressor(
+        encoding: str, writer: 'ResultsStreamWriter') -> Optional[Any]:
+    """Returns a decompressor that feeds a results stream into writer.
+
+    The decompressed data is written in pieces of at most _BODY_CHUNK_SIZE
+    bytes, so that a small, highly-compressible body cannot expand in memory
+    before the writer gets to enforce its size limit.
+    """
+    if encoding == 'zstd' and zstandard is not None:
+        return zstandard.ZstdDecompressor().stream_writer(
+            writer, write_size=_BODY_CHUNK_SIZE)
+    if encoding == 'deflate':
+        return _DeflateStreamWriter(writer)
+    return None
+
+
+class ResultsStreamWriter:
+    """Unpacks a (decompressed) results stream into a directory.
+
+    Data can be fed in arbitrarily-sized pieces as it arrives from the
+    network, so the whole stream never needs to be held in memory or written
+    to disk before it is unpacked. Streams that are larger than max_size or
+    that contain unexpected names are rejected with a ValueError.
+    """
+    def __init__(self, path: str, max_size: int = _MAX_RESULTS_STREAM_SIZE):
+        self._path = path
+        self._buffer = b''
+        self._file: Optional[BinaryIO] = None
+        self._remaining = 0
+        self._size = 0
+        self._max_size = max_size
+
+    def write(self, data: bytes) -> int:
+        """Unpacks the next piece of the stream."""
+        self._size += len(data)
+        if self._size > self._max_size:
+            raise ValueError(
+                f'Results stream is larger than {self._max_size} bytes')
+        self._buffer += data
+        while self._buffer:
+            if self._file is None:
+                if not self._open_next():
+                    return len(data)
+                continue
+            payload = self._buffer[:self._remaining]
+            self._buffer = self._buffer[len(payload):]
+            self._file.write(payload)
+            self._remaining -= len(payload)
+            if not self._remaining:
+                self._file.close()
+                self._file = None
+        return len(data)
+
+    def close(self) -> None:
+        """Finishes the stream, failing if it was truncated."""
+        if self._file is not None or self._buffer:
+            logging.error('Results stream was truncated')
+            raise EOFError
+
+    def _open_next(self) -> bool:
+        header_size = _RESULTS_STREAM_HEADER.size
+        if len(self._buffer) < header_size:
+            return False
+        name_size, payload_size = _RESULTS_STREAM_HEADER.unpack_from(
+            self._buffer)
+        if len(self._buffer) < header_size + name_size:
+            return False
+        name = self._buffer[header_size:header_size +
+                            name_size].decode('utf-8')
+        if not _is_valid_results_stream_name(name):
+            raise ValueError(f'Invalid filename in results stream: {name!r}')
+        self._buffer = self._buffer[header_size + name_size:]
+
+        file_path = os.path.join(self._path, name)
+        os.makedirs(os.path.dirname(file_path), exist_ok=True)
+        f = open(file_path, 'wb')  # pylint: disable=consider-using-with
+        if not payload_size:
+            f.close()
+        else:
+            self._file = f
+            self._remaining = payload_size
+        return True
+
+
 class InputEntry(NamedTuple):
     size: int
     path: str
@@ -384,27 +508,145 @@ class InputCache:
             return entry
 
 
-class GraderServer(socketserver.ThreadingTCPServer):
-    allow_reuse_address = True
+_Operation = Tuple[Callable[[sqlite3.Cursor], Any],
+                   'concurrent.futures.Future[Any]']
+
+
+class DatabaseWriter:
+    """A single writer for the runs database.
+
+    SQLite only allows one writer at a time and every commit is an fsync, so
+    opening a connection and committing once per run serializes all the
+    handler threads. Instead, all statements are executed by a single thread
+    that owns a long-lived connection in WAL mode, and are grouped into
+    transactions that are committed every |flush_interval| seconds or every
+    |batch_size| operations, whichever comes first.
 
+    Operations are callables that receive a cursor. Each one runs in its own
+    savepoint, so an operation that raises has its writes rolled back and its
+    future fails with the exception, without affecting the rest of the batch.
+    The results of the others are only available through the returned future
+    once the transaction they belong to has been committed. If the commit
+    fails, the whole transaction is rolled back and all its futures fail with
+    the commit error.
+    """
+    def __init__(self,
+                 database_path: str,
+                 batch_size: int = 256,
+                 flush_interval: float = 1.0):
+        self._database_path = database_path
+        self._batch_size = batch_size
+        self._flush_interval = flush_interval
+        self._queue = queue.Queue()  # type: queue.Queue[Optional[_Operation]]
+        self._thread = threading.Thread(target=self._run,
+                                        name='database-writer',
+                                        daemon=True)
+        self._thread.start()
+
+    def submit(
+        self, operation: Callable[[sqlite3.Cursor], Any]
+    ) -> 'concurrent.futures.Future[Any]':
+        """Queues |operation| to be run in the writer thread."""
+        future = concurrent.futures.Future(
+        )  # type: concurrent.futures.Future[Any]
+        self._queue.put((operation, future))
+        return future
+
+    def close(self) -> None:
+        """Commits any pending operations and stops the writer thread."""
+        self._queue.put(None)
+        self._thread.join()
+
+    def _run(self) -> None:
+        db = sqlite3.connect(self._database_path, isolation_level=None)
+        db.execute('PRAGMA journal_mode=WAL;')
+        db.execute('PRAGMA synchronous=NORMAL;')
+        cursor = db.cursor()
+
+        # The futures of the operations of the current transaction, along with
+        # their results.
+        pending = []  # type: List[Tuple[concurrent.futures.Future[Any], Any]]
+        deadline = 0.0
+
+        def _commit() -> None:
+            if not db.in_transaction:
+                return
+            try:
+                cursor.execute('COMMIT;')
+            except sqlite3.Error as e:
+                logging.exception('Failed to commit %d operations',
+                                  len(pending))
+                cursor.execute('ROLLBACK;')
+                for future, _ in pending:
+                    future.set_exception(e)
+            else:
+                for future, result in pending:
+                    future.set_result(result)
+            pending.clear()
+
+        while True:
+            try:
+                item = self._queue.get(timeout=(
+                    max(0.0, deadline - time.monotonic())
+                    if db.in_transaction else None))
+            except queue.Empty:
+                _commit()
+                continue
+            if item is None:
+                _commit()
+                break
+            operation, future = item
+            if not future.set_running_or_notify_cancel():
+                continue
+            if not db.in_transaction:
+                cursor.execute('BEGIN;')
+                deadline = time.monotonic() + self._flush_interval
+            cursor.execute('SAVEPOINT operation;')
+            try:
+                result = operation(cursor)
+            except Exception as e:  # pylint: disable=broad-except
+                if db.in_transaction:
+                    cursor.execute('ROLLBACK TO operation;')
+                    cursor.execute('RELEASE operation;')
+                else:
+                    # Some errors make SQLite roll back the whole
+                    # transaction, along with the rest of the batch.
+                    for pending_future, _ in pending:
+                        pending_future.set_exception(e)
+                    pending.clear()
+                future.set_exception(e)
+            else:
+                cursor.execute('RELEASE operation;')
+                pending.append((future, result))
+            if len(pending) >= self._batch_size:
+                _commit()
+        db.close()
+
+
+class GraderServer:
+    """The state of the grader.
+
+    Every method except for run can block (on disk I/O, git, or the database
+    writer), so GraderHandler calls them from its worker pool.
+    """
     def __init__(self,
-                 server_address: Tuple[str, int],
-                 RequestHandlerClass: Type[socketserver.BaseRequestHandler],
                  runs: 'queue.Queue[Run]',
                  cache: InputCache,
                  grade_dir: str,
                  artifacts_dir: str,
-                 database_path: str,
+                 database: DatabaseWriter,
                  preserve_artifacts: bool = False):
-        super().__init__(server_address, RequestHandlerClass)
         self._runs = runs
         self._version_mapping = {}  # type: MutableMapping[str, str]
         self._cache = cache
         self._grade_dir = grade_dir
         self._artifacts_dir = artifacts_dir
-        self._database_path = database_path
+        self._db = database
         self._preserve_artifacts = preserve_artifacts
 
+    def close(self) -> None:
+        self._db.close()
+
     @property
     def grade_dir(self) -> str:
         return self._grade_dir
@@ -420,15 +662,37 @@ class GraderServer(socketserver.ThreadingTCPServer):
         self._runs.task_done()
         return run
 
+    def request_payload(self, run: Run) -> bytes:
+        """Returns the body of the response to /run/request/ for run."""
+        with open(
+                os.path.join('/var/lib/omegaup/submissions/{}/{}'.format(
+                    run.guid[:2], run.guid[2:]))) as submission_file:
+            return json.dumps({
+                'attempt_id': run.id,
+                'source': submission_file.read(),
+                'language': run.language,
+                'input_hash': run.version,
+                'max_score': 100,
+                'debug': False,
+            }).encode('utf-8')
+
     def entry(self, version: str) -> Optional[InputEntry]:
         if version not in self._version_mapping:
             return None
         return self._cache.entry(self._version_mapping[version], version)
 
+    def _guid(self, run_id: int) -> str:
+        def _select(cursor: sqlite3.Cursor) -> str:
+            cursor.execute('SELECT guid FROM Runs WHERE run_id = ?;',
+                           (run_id, ))
+            (guid, ) = cursor.fetchone()
+            return guid
+
+        return self._db.submit(_select).result()
+
     def update_verdict(self, run_id: int, new_verdict: str, new_score: float,
                        judged_by: str) -> bool:
-        with sqlite3.connect(self._database_path) as db:
-            cursor = db.cursor()
+        def _update(cursor: sqlite3.Cursor) -> Tuple[str, float]:
             cursor.execute('SELECT verdict, score FROM Runs WHERE run_id = ?;',
                            (run_id, ))
             verdict: str = ''
@@ -444,8 +708,9 @@ class GraderServer(socketserver.ThreadingTCPServer):
             WHERE
                 run_id = ?;
             ''', (new_verdict, new_score, judged_by, run_id))
-            db.commit()
+            return verdict, score
 
+        verdict, score = self._db.submit(_update).result()
         if verdict != new_verdict or abs(score - new_score) > 5e-3:
             logging.error('%-19s %8d: (%3s, %.2f) changed to (%3s, %.2f)',
                           judged_by, run_id, verdict, score, new_verdict,
@@ -456,8 +721,7 @@ class GraderServer(socketserver.ThreadingTCPServer):
         return False
 
     def delete_missing_run(self, run_id: int) -> None:
-        with sqlite3.connect(self._database_path) as db:
-            cursor = db.cursor()
+        def _delete(cursor: sqlite3.Cursor) -> None:
             cursor.execute(
                 '''
             DELETE FROM
@@ -465,7 +729,8 @@ class GraderServer(socketserver.ThreadingTCPServer):
             WHERE
                 run_id = ?;
             ''', (run_id, ))
-            db.commit()
+
+        self._db.submit(_delete).result()
 
     def process(self, run_id: int, client: str) -> bool:
         filename = os.path.join(self.grade_dir, str(run_id))
@@ -499,15 +764,10 @@ class GraderServer(socketserver.ThreadingTCPServer):
         if os.path.isdir(artifacts_path):
             shutil.rmtree(artifacts_path)
         os.makedirs(artifacts_path)
-        with sqlite3.connect(self._database_path) as db:
-            cursor = db.cursor()
-            cursor.execute('SELECT guid FROM Runs WHERE run_id = ?;',
-                           (run_id, ))
-            (guid, ) = cursor.fetchone()
-            os.symlink(
-                '/var/lib/omegaup/submissions/{}/{}'.format(
-                    guid[:2], guid[2:]), os.path.join(artifacts_path,
-                                                      'source'))
+        guid = self._guid(run_id)
+        os.symlink(
+            '/var/lib/omegaup/submissions/{}/{}'.format(guid[:2], guid[2:]),
+            os.path.join(artifacts_path, 'source'))
         with open(os.path.join(artifacts_path, verdict), 'w') as _:
             pass
         with open(filename, 'rb') as f:
@@ -529,6 +789,33 @@ class GraderServer(socketserver.ThreadingTCPServer):
             with zf.open('details.json') as df:
                 details = json.load(df)
 
+        if self._record_multi(run_id, client, details):
+            with zipfile.ZipFile(zip_path) as z:
+                z.extractall(os.path.join(self._artifacts_dir, str(run_id)))
+        os.unlink(zip_path)
+
+    def process_stream(self, run_id: int, client: str,
+                       staging_path: str) -> None:
+        """Processes a results stream that was unpacked into staging_path."""
+        with open(os.path.join(staging_path, 'details.json')) as df:
+            details = json.load(df)
+
+        if self._record_multi(run_id, client, details):
+            artifacts_path = os.path.join(self._artifacts_dir, str(run_id))
+            # Only the config directories are moved, so that nothing in the
+            # stream can replace what _record_multi() wrote.
+            for name in _RESULTS_STREAM_CONFIGS:
+                if os.path.isdir(os.path.join(staging_path, name)):
+                    os.rename(os.path.join(staging_path, name),
+                              os.path.join(artifacts_path, name))
+        shutil.rmtree(staging_path)
+
+    def _record_multi(self, run_id: int, client: str,
+                      details: Dict[str, Any]) -> bool:
+        """Records the verdicts of a multi-config run.
+
+        Returns whether the rest of the artifacts should be preserved.
+        """
         artifacts_path = os.path.join(self._artifacts_dir, str(run_id))
         if os.path.isdir(artifacts_path):
             shutil.rmtree(artifacts_path)
@@ -536,21 +823,15 @@ class GraderServer(socketserver.ThreadingTCPServer):
         with open(os.path.join(artifacts_path, 'details.json'), 'w') as af:
             json.dump(details, af)
 
-        with sqlite3.connect(self._database_path) as db:
-            cursor = db.cursor()
-            cursor.execute('SELECT guid FROM Runs WHERE run_id = ?;',
-                           (run_id, ))
-            (guid, ) = cursor.fetchone()
-            os.symlink(
-                '/var/lib/omegaup/submissions/{}/{}'.format(
-                    guid[:2], guid[2:]), os.path.join(artifacts_path,
-                                                      'source'))
+        guid = self._guid(run_id)
+        os.symlink(
+            '/var/lib/omegaup/submissions/{}/{}'.format(guid[:2], guid[2:]),
+            os.path.join(artifacts_path, 'source'))
         with open(os.path.join(artifacts_path, details['focal']['verdict']),
                   'w') as f:
             pass
 
-        with sqlite3.connect(self._database_path) as db:
-            cursor = db.cursor()
+        def _update(cursor: sqlite3.Cursor) -> None:
             cursor.execute(
                 '''
             UPDATE
@@ -568,7 +849,8 @@ class GraderServer(socketserver.ThreadingTCPServer):
                     client,
                     run_id,
                 ))
-            db.commit()
+
+        self._db.submit(_update).result()
 
         changed_verdict: Optional[str] = None
         if (details['bionic']['verdict'] != details['focal']['verdict']
@@ -586,147 +868,241 @@ class GraderServer(socketserver.ThreadingTCPServer):
                          details['bionic']['verdict'],
                          details['bionic']['score'])
 
-        if self._preserve_artifacts or (changed_verdict is not None
-                                        and changed_verdict != 'CE'):
-            with zipfile.ZipFile(zip_path) as z:
-                z.extractall(artifacts_path)
-        os.unlink(zip_path)
+        return self._preserve_artifacts or (changed_verdict is not None
+                                            and changed_verdict != 'CE')
+
+
+class GraderHandler:
+    """Handles a single request from a runner.
+
+    Requests are read and answered in the event loop, and anything that can
+    block or that is CPU-bound (decompressing and unpacking uploads, reading
+    files, building inputs, updating the database) runs in a bounded worker
+    pool. Request bodies are consumed one piece at a time, and the next piece
+    is not read until the previous one has been processed, so a slow disk
+    makes the runners slow down their uploads through TCP flow control
+    instead of making the grader buffer them. At most |upload_slots| uploads
+    are processed at once; the rest wait before their body is read.
+    """
+    def __init__(self, server: GraderServer,
+                 executor: concurrent.futures.ThreadPoolExecutor,
+                 upload_slots: asyncio.Semaphore,
+                 reader: asyncio.StreamReader, writer: asyncio.StreamWriter):
+        self.server = server
+        self._executor = executor
+        self._upload_slots = upload_slots
+        self._reader = reader
+        self._writer = writer
+        self.command = ''
+        self.path = ''
+        self.request_version = ''
+        self.headers: Dict[str, str] = {}
+
+    async def handle(self) -> None:
+        """Reads the request, dispatches it, and closes the connection."""
+        try:
+            request_line = await self._reader.readline()
+            if not request_line:
+                return
+            (self.command, self.path,
+             self.request_version) = request_line.decode('latin-1').rstrip(
+                 '\r\n').split(' ', 2)
+            while True:
+                header = await self._reader.readline()
+                if not header:
+                    raise EOFError
+                if header in (b'\r\n', b'\n'):
+                    break
+                name, value = header.decode('latin-1').split(':', 1)
+                self.headers[name.strip().lower()] = value.strip()
+
+            if self.command == 'GET':
+                await self.do_GET()
+            elif self.command == 'POST':
+                await self.do_POST()
+            else:
+                await self._send_response(501)
+        except (EOFError, ValueError, ConnectionError,
+                asyncio.IncompleteReadError, ssl.SSLError) as e:
+            logging.error('"%s %s %s": %r', self.command, self.path,
+                          self.request_version, e)
+        except Exception:  # pylint: disable=broad-except
+            logging.exception('"%s %s %s": failed', self.command, self.path,
+                              self.request_version)
+        finally:
+            self._writer.close()
+            try:
+                await self._writer.wait_closed()
+            except (ConnectionError, ssl.SSLError):
+                pass
 
+    @property
+    def _peer_name(self) -> str:
+        return dict(
+            itertools.chain(*self._writer.get_extra_info('peercert')
+                            ['subject']))['commonName'].split('.')[0]
 
-class GraderHandler(http.server.BaseHTTPRequestHandler):
-    protocol_version = 'HTTP/1.1'
+    async def _call(self, fn: Callable[..., _T], *args: Any) -> _T:
+        """Runs fn in the worker pool."""
+        return await asyncio.get_running_loop().run_in_executor(
+            self._executor, functools.partial(fn, *args))
+
+    async def _send_response(self,
+                             code: int,
+                             headers: Optional[Dict[str, str]] = None,
+                             body: bytes = b'') -> None:
+        """Sends the response headers, and the body if provided.
+
+        Every connection only serves a single request, like the runners
+        expect.
+        """
+        all_headers = {'Content-Length': str(len(body))}
+        all_headers.update(headers or {})
+        all_headers['Connection'] = 'close'
+        self._writer.write(
+            (f'HTTP/1.1 {code} {http.HTTPStatus(code).phrase}\r\n' +
+             ''.join(f'{name}: {value}\r\n'
+                     for name, value in all_headers.items()) +
+             '\r\n').encode('latin-1') + body)
+        await self._writer.drain()
+        logging.debug('"%s %s %s" %s %s', self.command, self.path,
+                      self.request_version, code,
+                      all_headers['Content-Length'])
 
-    def do_GET(self) -> None:
-        peer_name = dict(
-            itertools.chain(*self.connection.getpeercert()
-                            ['subject']))['commonName'].split('.')[0]
+    async def _receive_file(self, path: str) -> None:
+        """Writes the request body to path as it arrives."""
+        f = await self._call(open, path, 'wb')
+        try:
+            async for buf in _read_body(self._reader, self.headers):
+                await self._call(f.write, buf)
+        finally:
+            await self._call(f.close)
+
+    async def do_GET(self) -> None:
+        peer_name = self._peer_name
         logging.debug('%s: peer %s', self.path, peer_name)
 
         if self.path == '/run/request/':
             while True:
+                run = self.server.run
+                if not run:
+                    logging.info('%-19s %8s: No more runs', peer_name, '')
+                    await self._send_response(
+                        404, {'Sync-Id': str(int(time.time() * 1e6))})
+                    return
+
                 try:
-                    run = self.server.run
-                    if not run:
-                        logging.info('%-19s %8s: No more runs', peer_name, '')
-                        self.send_response(404)
-                        self.send_header('Sync-Id',
-                                         str(int(time.time() * 1e6)))
-                        self.send_header('Content-Length', '0')
-                        self.send_header('Connection', 'close')
-                        self.end_headers()
-                        return
-
-                    with open(
-                            os.path.join(
-                                '/var/lib/omegaup/submissions/{}/{}'.format(
-                                    run.guid[:2],
-                                    run.guid[2:]))) as submission_file:
-                        payload = json.dumps({
-                            'attempt_id': run.id,
-                            'source': submission_file.read(),
-                            'language': run.language,
-                            'input_hash': run.version,
-                            'max_score': 100,
-                            'debug': False,
-                        }).encode('utf-8')
-                    self.send_response(200)
-                    self.send_header('Sync-Id', str(int(time.time() * 1e6)))
-                    self.send_header('Content-Type', 'text/json')
-                    self.send_header('Content-Length', str(len(payload)))
-                    self.send_header('Connection', 'close')
-                    self.end_headers()
-                    logging.debug('%s: sending %r', self.path, run)
-
-                    self.wfile.write(payload)
-                    break
+                    payload = await self._call(self.server.request_payload,
+                                               run)
                 except FileNotFoundError:
                     logging.exception('Missing source file')
-                    self.server.delete_missing_run(run.id)
+                    await self._call(self.server.delete_missing_run, run.id)
+                    continue
+                logging.debug('%s: sending %r', self.path, run)
+                await self._send_response(
+                    200, {
+                        'Sync-Id': str(int(time.time() * 1e6)),
+                        'Content-Type': 'text/json',
+                    }, payload)
+                return
 
         elif self.path.startswith('/input/'):
-            entry = self.server.entry(self.path.strip('/').split('/')[-1])
+            entry = await self._call(self.server.entry,
+                                     self.path.strip('/').split('/')[-1])
             if not entry:
                 logging.info('%s: Not found', self.path)
-                self.send_response(404)
-                self.send_header('Content-Length', '0')
-                self.send_header('Connection', 'close')
-                self.end_headers()
+                await self._send_response(404)
                 return
-            with open(entry.path, 'rb') as entry_file:
-                self.send_response(200)
-                self.send_header('Content-Type', 'application/tar+gzip')
-                self.send_header('Content-Length', str(entry.size))
-                self.send_header('X-Content-Uncompressed-Size',
-                                 str(entry.uncompressed_size))
-                self.send_header('Content-SHA1', entry.hash)
-                self.send_header('Connection', 'close')
-                self.end_headers()
-
-                entry_file.seek(0, os.SEEK_SET)
+            with await self._call(open, entry.path, 'rb') as entry_file:
+                await self._send_response(
+                    200, {
+                        'Content-Type': 'application/tar+gzip',
+                        'Content-Length': str(entry.size),
+                        'X-Content-Uncompressed-Size':
+                        str(entry.uncompressed_size),
+                        'Content-SHA1': entry.hash,
+                    })
                 while True:
-                    buf = entry_file.read(4096)
+                    buf = await self._call(entry_file.read, _BODY_CHUNK_SIZE)
                     if not buf:
                         break
-                    self.wfile.write(buf)
+                    self._writer.write(buf)
+                    await self._writer.drain()
         else:
             logging.info('%s: Not found', self.path)
-            self.send_response(404)
-            self.send_header('Content-Length', '0')
-            self.send_header('Connection', 'close')
-            self.end_headers()
-
-    def do_POST(self) -> None:
-        judged_by = dict(
-            itertools.chain(*self.connection.getpeercert()
-                            ['subject']))['commonName'].split('.')[0]
+            await self._send_response(404)
+
+    async def do_POST(self) -> None:
+        judged_by = self._peer_name
         match = _RUN_RESULTS_RE.match(self.path)
         if not match:
             logging.info('%s: Not found', self.path)
-            self.send_response(404)
-            self.send_header('Content-Length', '0')
-            self.send_header('Connection', 'close')
-            self.end_headers()
+            await self._send_response(404)
             return
 
         run_id = int(match.group(1))
-        if match.group(2) == 'results.zip':
-            with open(os.path.join(self.server.grade_dir, f'{run_id}.zip'),
-                      'wb') as run_zip_file:
-                buf = self.rfile.read(int(self.headers['Content-Length']))
-                run_zip_file.write(buf)
-            self.server.process_multi(run_id, judged_by)
-
-            self.send_response(204)
-            self.send_header('Content-Length', '0')
-            self.send_header('Connection', 'close')
-            self.end_headers()
-        else:
-            r = ChunkedReader(self.rfile)
-            with open(os.path.join(self.server.grade_dir, str(run_id)),
-                      'wb') as run_results_file:
-                while True:
-                    buf = r.read(4096)
-                    if not buf:
-                        break
-                    run_results_file.write(buf)
-            self.server.process(run_id, judged_by)
+        async with self._upload_slots:
+            if match.group(2) == 'results.zip':
+                await self._receive_file(
+                    os.path.join(self.server.grade_dir, f'{run_id}.zip'))
+                await self._call(self.server.process_multi, run_id,
+                                 judged_by)
+            elif match.group(2) == 'results.stream':
+                staging_path = os.path.join(self.server.grade_dir,
+                                            f'{run_id}.stream')
+                writer = ResultsStreamWriter(staging_path)
+                decompressor = results_stream_decompressor(
+                    self.headers.get('content-encoding', ''), writer)
+                if (decompressor is None
+                        or self.headers.get('transfer-encoding') !=
+                        'chunked'):
+                    logging.error('%s: Unsupported encoding %r', self.path,
+                                  self.headers.get('content-encoding'))
+                    await self._send_response(415)
+                    return
+                await self._call(shutil.rmtree, staging_path, True)
+                await self._call(os.makedirs, staging_path)
+
+                def _finish() -> None:
+                    decompressor.flush()
+                    writer.close()
+                    self.server.process_stream(run_id, judged_by,
+                                               staging_path)
 
-            self.send_response(204)
-            self.send_header('Content-Length', '0')
-            self.send_header('Connection', 'close')
-            self.end_headers()
-
-    def log_error(self, format_string: str, *args: Any) -> None:
-        logging.error(format_string, *args)
-
-    def log_message(self, format_string: str, *args: Any) -> None:
-        logging.info(format_string, *args)
-
-    def log_request(self,
-                    code: Union[int, str] = '-',
-                    size: Union[int, str] = '-') -> None:
-        logging.debug('"%s %s %s" %s %s', self.command, self.path,
-                      self.request_version, code, size)
+                try:
+                    async for buf in _read_chunked(self._reader):
+                        await self._call(decompressor.write, buf)
+                    await self._call(_finish)
+                except Exception:
+                    await self._call(shutil.rmtree, staging_path, True)
+                    raise
+            else:
+                await self._receive_file(
+                    os.path.join(self.server.grade_dir, str(run_id)))
+                await self._call(self.server.process, run_id, judged_by)
+
+        await self._send_response(204)
+
+
+async def _serve(server: GraderServer, port: int, ssl_ctx: ssl.SSLContext,
+                 workers: int, max_uploads: int) -> None:
+    """Serves the runners until cancelled."""
+    with concurrent.futures.ThreadPoolExecutor(
+            max_workers=workers, thread_name_prefix='grader') as executor:
+        upload_slots = asyncio.Semaphore(max_uploads)
+
+        async def _handle(reader: asyncio.StreamReader,
+                          writer: asyncio.StreamWriter) -> None:
+            await GraderHandler(server, executor, upload_slots, reader,
+                                writer).handle()
+
+        httpd = await asyncio.start_server(_handle,
+                                           port=port,
+                                           ssl=ssl_ctx,
+                                           reuse_address=True)
+        logging.info('serving at port %d', port)
+        async with httpd:
+            await httpd.serve_forever()
 
 
 def _main() -> None:
@@ -749,6 +1125,24 @@ def _main() -> None:
                         help='Fully-qualified domain name for the certificate')
     parser.add_argument('--preserve-artifacts', action='store_true')
     parser.add_argument('--database', type=str, default='runs.db')
+    parser.add_argument('--database-batch-size',
+                        type=int,
+                        default=256,
+                        help='Maximum number of updates per transaction')
+    parser.add_argument('--database-flush-interval',
+                        type=float,
+                        default=1.0,
+                        help='Maximum number of seconds an update can wait '
+                        'before being committed')
+    parser.add_argument('--workers',
+                        type=int,
+                        default=min(32, (os.cpu_count() or 1) + 4),
+                        help='Number of threads that process requests')
+    parser.add_argument('--max-uploads',
+                        type=int,
+                        default=64,
+                        help='Maximum number of uploads processed at once. '
+                        'Further uploads are not read until a slot frees up')
     parser.add_argument('--runs', type=str)
     parser.add_argument('--verbose', action='store_true')
     args = parser.parse_args()
@@ -785,12 +1179,20 @@ def _main() -> None:
     else:
         runs = _load_all_runs(args.database)
 
-    with GraderServer(("", args.port), GraderHandler, runs, cache,
-                      args.grade_dir, args.artifacts_dir, args.database,
-                      args.preserve_artifacts) as httpd:
-        httpd.socket = ssl_ctx.wrap_socket(httpd.socket, server_side=True)
-        logging.info('serving at port %d', args.port)
-        httpd.serve_forever()
+    database = DatabaseWriter(args.database,
+                              batch_size=args.database_batch_size,
+                              flush_interval=args.database_flush_interval)
+
+    server = GraderServer(runs, cache, args.grade_dir, args.artifacts_dir,
+                          database, args.preserve_artifacts)
+    try:
+        asyncio.run(
+            _serve(server, args.port, ssl_ctx, args.workers,
+                   args.max_uploads))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
 
 
 if __name__ == '__main__':
@@ -8,28 +8,41 @@ compilers / runtimes.
 # pylint: disable=too-many-locals,invalid-name,too-few-public-methods
 
 import argparse
+import concurrent.futures
 import http.client
+import itertools
 import json
 import logging
+import math
 import os
 import os.path
+import queue
 import random
 import shutil
 import socket
 import ssl
+import struct
 import subprocess
 import sys
 import tarfile
 import tempfile
 import textwrap
+import threading
 import time
 import urllib.parse
 import zipfile
+import zlib
 
-from typing import Any, Dict, List, NamedTuple, Optional
+from typing import (Any, Dict, Iterator, List, NamedTuple, Optional, TextIO,
+                    Tuple)
 
 import OpenSSL.crypto  # type: ignore
 
+try:
+    import zstandard  # type: ignore
+except ImportError:
+    zstandard = None
+
 _ROOT = os.path.dirname(__file__)
 
 _CONFIGS = {
@@ -74,6 +87,14 @@ _CONFIGS = {
       }
     }"""),
 }
+# Each file in a results stream is framed as (name length, payload length),
+# followed by the UTF-8 name and the payload.
+_RESULTS_STREAM_HEADER = struct.Struct('>HQ')
+_RESULTS_STREAM_CHUNK_SIZE = 1024 * 1024
+
+# The metrics from each case's .meta file that are compared between configs.
+_PERF_METRICS = ('time', 'time-wall', 'mem')
+
 _OMEGAUP_RUNNER_URL = ('https://github.com/omegaup/quark/releases/download/'
                        'v1.1.37/omegaup-runner.tar.xz')
 
@@ -266,7 +287,9 @@ class InputCache:
     Every time entry() is called, it will return the cached entry (if present
     in the filesystem), or fetch the problem from the grader. This will evict
     as many previous input sets as needed to get the total size to be under the
-    cache size limit.
+    cache size limit. Entries that are still in use (returned by entry() and
+    not yet release()d) are never evicted, since the runner might be executing
+    a run with them while the next one is being prefetched.
     """
     def __init__(self, conn: http.client.HTTPSConnection, path: str,
                  cache_size: int):
@@ -274,35 +297,46 @@ class InputCache:
         self._path = path
         self._cache_size = cache_size
         self._lru: List[InputEntry] = []
+        self._pins: Dict[str, int] = {}
         self._size = 0
+        self._lock = threading.Lock()
         shutil.rmtree(path, ignore_errors=True)
         os.makedirs(path, exist_ok=True)
 
     def entry(self, version: str) -> InputEntry:
-        """Returns an InputEntry for the provided version."""
+        """Returns an InputEntry for the provided version.
+
+        The entry is pinned until release() is called.
+        """
         output_path = os.path.join(self._path, version)
 
-        for i, entry in enumerate(self._lru):
-            if entry.path == output_path:
-                self._lru = self._lru[:i] + self._lru[i + 1:] + [self._lru[i]]
-                return entry
+        with self._lock:
+            for i, entry in enumerate(self._lru):
+                if entry.path == output_path:
+                    self._lru = self._lru[:i] + self._lru[i + 1:] + [
+                        self._lru[i]
+                    ]
+                    self._pins[version] = self._pins.get(version, 0) + 1
+                    return entry
 
         logging.info('Getting input %s', version)
-        tar_path = f'{output_path}.tar.gz'
         self._conn.request('GET', f'/input/{version}')
         response = self._conn.getresponse()
         if response.status == 404:
+            response.read()
             raise FileNotFoundError(version)
 
-        with open(tar_path, 'wb') as f:
-            while True:
-                chunk = response.read(4096)
-                if not chunk:
-                    break
-                f.write(chunk)
-        with tarfile.open(tar_path, mode='r:gz') as tar:
-            tar.extractall(output_path)
-        os.unlink(tar_path)
+        # Extract the tarball while it is being downloaded, so that the
+        # network transfer and the decompression overlap.
+        tmp_output_path = f'{output_path}.tmp'
+        shutil.rmtree(tmp_output_path, ignore_errors=True)
+        try:
+            with tarfile.open(fileobj=response, mode='r|gz') as tar:
+                tar.extractall(tmp_output_path)
+        except Exception:
+            shutil.rmtree(tmp_output_path, ignore_errors=True)
+            raise
+        os.rename(tmp_output_path, output_path)
 
         entry_size = 0
         for dirpath, _, filenames in os.walk(output_path):
@@ -310,20 +344,35 @@ class InputCache:
                 st = os.stat(os.path.join(dirpath, filename))
                 entry_size += st.st_size
 
-        while self._lru and self._size + entry_size > self._cache_size:
-            entry = self._lru.pop(0)
-            logging.info('Evicting input %s', entry.version)
-            shutil.rmtree(entry.path)
-            self._size -= entry.size
-
-        entry = InputEntry(entry_size, output_path, version)
-        self._size += entry.size
-        self._lru.append(entry)
-        return entry
-
-
-def _download_run(
-        conn: http.client.HTTPSConnection) -> Optional[Dict[str, Any]]:
+        with self._lock:
+            i = 0
+            while i < len(self._lru) and (self._size + entry_size >
+                                          self._cache_size):
+                entry = self._lru[i]
+                if self._pins.get(entry.version, 0):
+                    i += 1
+                    continue
+                self._lru.pop(i)
+                logging.info('Evicting input %s', entry.version)
+                shutil.rmtree(entry.path)
+                self._size -= entry.size
+
+            entry = InputEntry(entry_size, output_path, version)
+            self._size += entry.size
+            self._lru.append(entry)
+            self._pins[version] = self._pins.get(version, 0) + 1
+            return entry
+
+    def release(self, entry: InputEntry) -> None:
+        """Unpins an entry previously returned by entry()."""
+        with self._lock:
+            self._pins[entry.version] -= 1
+            if not self._pins[entry.version]:
+                del self._pins[entry.version]
+
+
+def _download_run(conn: http.client.HTTPSConnection,
+                  requests_dir: str) -> Optional[Dict[str, Any]]:
     try:
         conn.request('GET', '/run/request/')
         response = conn.getresponse()
@@ -333,56 +382,208 @@ def _download_run(
         return None
     if response.status == 404:
         return None
-    with open(os.path.join(_ROOT, 'request.json'), 'wb') as fb:
-        fb.write(data)
     request: Dict[str, Any] = json.loads(data.decode('utf-8'))
-    with open(os.path.join(_ROOT, 'source'), 'w') as f:
+    # Each attempt gets its own files, since the next run is downloaded while
+    # the previous one is still being executed.
+    request_path = os.path.join(requests_dir, str(request['attempt_id']))
+    with open(f'{request_path}.json', 'wb') as fb:
+        fb.write(data)
+    with open(f'{request_path}.source', 'w') as f:
         f.write(request['source'])
     return request
 
 
-def _run(input_cache: InputCache, request: Dict[str, Any],
-         configs: Dict[str, Any], omegaup_runner_path: str) -> str:
-    """Run a single submission and return the path of the generated results.zip"""
-    entry = input_cache.entry(request['input_hash'])
-    cases_zip_path = os.path.join(_ROOT, 'cases.zip')
+class PendingRun(NamedTuple):
+    """A run whose request and inputs are already on disk."""
+    request: Dict[str, Any]
+    request_path: str
+    entry: InputEntry
 
-    result: Dict[str, Any] = {}
-    with zipfile.ZipFile(cases_zip_path,
-                         mode='w',
-                         compression=zipfile.ZIP_DEFLATED) as z:
-        for config_name in configs:
-            with tempfile.TemporaryDirectory() as d:
-                omegaup_runner_args = [
-                    omegaup_runner_path,
-                    ('-config=' + os.path.join(_ROOT, f'{config_name}.json')),
-                    '-oneshot=run',
-                    f'-input={entry.path}',
-                    '-request=' + os.path.join(_ROOT, 'request.json'),
-                    f'-results={d}',
-                ]
-                logging.info('Running %8s: id=%7s version=%s language=%s: %s',
-                             config_name, request['attempt_id'],
-                             request['input_hash'], request['language'],
-                             ' '.join(omegaup_runner_args))
-                run_result = subprocess.run(omegaup_runner_args,
-                                            stdout=subprocess.PIPE,
-                                            stderr=subprocess.PIPE,
-                                            check=True)
-                for rootdir, _, filenames in os.walk(d):
-                    for filename in filenames:
-                        file_path = os.path.join(rootdir, filename)
-                        z.write(file_path,
-                                arcname=os.path.join(
-                                    config_name, os.path.relpath(file_path,
-                                                                 d)))
-            result[config_name] = json.loads(run_result.stdout)
-            result[config_name]['logs'] = run_result.stderr.decode('utf-8')
 
+class Prefetcher:
+    """Downloads the next run and its inputs in the background.
+
+    This lets the network transfer and the input extraction of the next run
+    overlap with the execution of the current one.
+    """
+    def __init__(self, conn: http.client.HTTPSConnection, cache_size: int):
+        self._conn = conn
+        self._requests_dir = os.path.join(_ROOT, 'requests')
+        shutil.rmtree(self._requests_dir, ignore_errors=True)
+        os.makedirs(self._requests_dir, exist_ok=True)
+        self._input_cache = InputCache(self._conn,
+                                       os.path.join(_ROOT, 'inputs'),
+                                       cache_size)
+        self._executor = concurrent.futures.ThreadPoolExecutor(
+            max_workers=1, thread_name_prefix='prefetch')
+
+    def prefetch(self) -> 'concurrent.futures.Future[Optional[PendingRun]]':
+        """Starts fetching the next run."""
+        return self._executor.submit(self._fetch)
+
+    def release(self, pending: PendingRun) -> None:
+        """Releases the resources associated with a run that has finished."""
+        self._input_cache.release(pending.entry)
+        os.unlink(pending.request_path)
+        os.unlink(os.path.splitext(pending.request_path)[0] + '.source')
+
+    def _fetch(self) -> Optional[PendingRun]:
+        request = _download_run(self._conn, self._requests_dir)
+        if request is None:
+            logging.info('No runs found. Sleeping 10s')
+            time.sleep(10)
+            # The grader closes the connection after every response, so the
+            # next request will reconnect.
+            self._conn.close()
+            return None
+        request_path = os.path.join(self._requests_dir,
+                                    str(request['attempt_id']))
+        try:
+            entry = self._input_cache.entry(request['input_hash'])
+        except Exception:  # pylint: disable=broad-except
+            # A run whose inputs cannot be fetched is skipped, so that it does
+            # not take the whole runner down with it.
+            logging.exception('Failed to get input %s for run %s',
+                              request['input_hash'], request['attempt_id'])
+            # The connection might have been left in the middle of a
+            # response.
+            self._conn.close()
+            for extension in ('.json', '.source'):
+                try:
+                    os.unlink(request_path + extension)
+                except FileNotFoundError:
+                    pass
+            return None
+        return PendingRun(request, f'{request_path}.json', entry)
+
+
+def _run_config(config_name: str, pending: PendingRun,
+                omegaup_runner_path: str, results_dir: str,
+                cpus: 'queue.Queue[int]') -> Dict[str, Any]:
+    """Runs a submission with a single config."""
+    # Each concurrent config gets a core of its own. omegajail pins itself to
+    # the first core in its affinity mask, so without this all of them would
+    # end up sharing the same one.
+    cpu = cpus.get()
+    try:
+        omegaup_runner_args = [
+            '/usr/bin/taskset',
+            '--cpu-list',
+            str(cpu),
+            omegaup_runner_path,
+            ('-config=' + os.path.join(_ROOT, f'{config_name}.json')),
+            '-oneshot=run',
+            f'-input={pending.entry.path}',
+            f'-request={pending.request_path}',
+            f'-results={results_dir}',
+        ]
+        logging.info('Running %8s: id=%7s version=%s language=%s: %s',
+                     config_name, pending.request['attempt_id'],
+                     pending.request['input_hash'],
+                     pending.request['language'],
+                     ' '.join(omegaup_runner_args))
+        run_result = subprocess.run(omegaup_runner_args,
+                                    stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE,
+                                    check=True)
+    finally:
+        cpus.put(cpu)
+    result: Dict[str, Any] = json.loads(run_result.stdout)
+    result['logs'] = run_result.stderr.decode('utf-8')
+    return result
+
+
+def _run_configs(pending: PendingRun, configs: Dict[str, Any],
+                 omegaup_runner_path: str,
+                 executor: concurrent.futures.ThreadPoolExecutor,
+                 cpus: 'queue.Queue[int]', d: str,
+                 perf_samples: Optional[TextIO]
+                 ) -> Iterator[Tuple[str, Dict[str, Any], str]]:
+    """Runs all configs concurrently.
+
+    This yields the name, result and results directory of each config in the
+    order in which they were provided, as soon as each one is done. If
+    perf_samples is provided, the per-case metrics of all configs are appended
+    to it as a single JSON line once all of them finish.
+    """
+    futures: Dict[str, 'concurrent.futures.Future[Dict[str, Any]]'] = {}
+    for config_name in configs:
+        results_dir = os.path.join(d, config_name)
+        os.makedirs(results_dir)
+        futures[config_name] = executor.submit(_run_config, config_name,
+                                               pending, omegaup_runner_path,
+                                               results_dir, cpus)
+    perf: Dict[str, Dict[str, Dict[str, float]]] = {}
+    for config_name, future in futures.items():
+        results_dir = os.path.join(d, config_name)
+        result = future.result()
+        if perf_samples is not None:
+            perf[config_name] = _collect_perf(results_dir)
+        yield config_name, result, results_dir
+
+    if perf_samples is not None:
+        perf_samples.write(
+            json.dumps({
+                'attempt_id': pending.request['attempt_id'],
+                'language': pending.request['language'],
+                'input_hash': pending.request['input_hash'],
+                'configs': perf,
+            }) + '\n')
+        perf_samples.flush()
+
+
+def _walk_results(results_dir: str) -> Iterator[Tuple[str, str]]:
+    """Yields the path and the relative path of every file in results_dir."""
+    for rootdir, _, filenames in os.walk(results_dir):
+        for filename in filenames:
+            file_path = os.path.join(rootdir, filename)
+            yield file_path, os.path.relpath(file_path, results_dir)
+
+
+def _collect_perf(results_dir: str) -> Dict[str, Dict[str, float]]:
+    """Returns the metrics of every .meta file in results_dir, keyed by case."""
+    perf: Dict[str, Dict[str, float]] = {}
+    for file_path, relpath in _walk_results(results_dir):
+        if not relpath.endswith('.meta'):
+            continue
+        metrics: Dict[str, float] = {}
+        with open(file_path) as f:
+            for line in f:
+                key, _, value = line.strip().partition(':')
+                if key in _PERF_METRICS:
+                    metrics[key] = float(value)
+        perf[relpath[:-len('.meta')]] = metrics
+    return perf
+
+
+def _log_results(result: Dict[str, Any]) -> None:
     logging.info(
         '%s', ' '.join(
             f'{name} ({meta["verdict"]:3s}, {meta["score"]:.2f}, {meta["time"]:.2f})'
             for (name, meta) in result.items()))
+
+
+def _run(pending: PendingRun, configs: Dict[str, Any],
+         omegaup_runner_path: str,
+         executor: concurrent.futures.ThreadPoolExecutor,
+         cpus: 'queue.Queue[int]', perf_samples: Optional[TextIO]) -> str:
+    """Run a single submission and return the path of the generated results.zip"""
+    cases_zip_path = os.path.join(_ROOT, 'cases.zip')
+
+    result: Dict[str, Any] = {}
+    with tempfile.TemporaryDirectory() as d:
+        with zipfile.ZipFile(cases_zip_path,
+                             mode='w',
+                             compression=zipfile.ZIP_DEFLATED) as z:
+            for config_name, config_result, results_dir in _run_configs(
+                    pending, configs, omegaup_runner_path, executor, cpus, d,
+                    perf_samples):
+                result[config_name] = config_result
+                for file_path, relpath in _walk_results(results_dir):
+                    z.write(file_path,
+                            arcname=os.path.join(config_name, relpath))
+
+    _log_results(result)
     results_path = os.path.join(_ROOT, 'results.zip')
     with zipfile.ZipFile(results_path,
                          mode='w',
@@ -392,13 +593,215 @@ def _run(input_cache: InputCache, request: Dict[str, Any],
     return results_path
 
 
+def _results_stream_encoding() -> str:
+    """Returns the Content-Encoding that _stream_results() will use."""
+    return 'zstd' if zstandard is not None else 'deflate'
+
+
+def _stream_results(pending: PendingRun, configs: Dict[str, Any],
+                    omegaup_runner_path: str,
+                    executor: concurrent.futures.ThreadPoolExecutor,
+                    cpus: 'queue.Queue[int]',
+                    perf_samples: Optional[TextIO]) -> Iterator[bytes]:
+    """Run a single submission and stream its results.
+
+    Instead of building a results.zip (which would compress everything twice
+    and make the grader unpack it twice), every file is framed and compressed
+    once into a single stream, which is sent to the grader as each config
+    finishes. details.json is always the last file in the stream.
+    """
+    if zstandard is not None:
+        compressor = zstandard.ZstdCompressor(level=3).compressobj()
+    else:
+        compressor = zlib.compressobj(1)
+
+    def _frame(name: str, size: int) -> bytes:
+        encoded_name = name.encode('utf-8')
+        return compressor.compress(
+            _RESULTS_STREAM_HEADER.pack(len(encoded_name), size) +
+            encoded_name)
+
+    result: Dict[str, Any] = {}
+    with tempfile.TemporaryDirectory() as d:
+        for config_name, config_result, results_dir in _run_configs(
+                pending, configs, omegaup_runner_path, executor, cpus, d,
+                perf_samples):
+            result[config_name] = config_result
+            for file_path, relpath in _walk_results(results_dir):
+                with open(file_path, 'rb') as f:
+                    yield _frame(os.path.join(config_name, relpath),
+                                 os.fstat(f.fileno()).st_size)
+                    while True:
+                        buf = f.read(_RESULTS_STREAM_CHUNK_SIZE)
+                        if not buf:
+                            break
+                        yield compressor.compress(buf)
+
+    _log_results(result)
+    details = json.dumps(result).encode('utf-8')
+    yield _frame('details.json', len(details))
+    yield compressor.compress(details)
+    yield compressor.flush()
+
+
+def _wilcoxon(differences: List[float]) -> Tuple[float, float]:
+    """Two-sided Wilcoxon signed-rank test.
+
+    This uses the normal approximation (with tie correction), which is
+    accurate enough for the sample sizes of a rejudge. Zero differences are
+    discarded. Returns the z-score and the p-value.
+    """
+    differences = [d for d in differences if d != 0]
+    n = len(differences)
+    if not n:
+        return 0.0, 1.0
+    order = sorted(range(n), key=lambda i: abs(differences[i]))
+    ranks = [0.0] * n
+    tie_correction = 0.0
+    i = 0
+    while i < n:
+        j = i
+        while j + 1 < n and abs(differences[order[j + 1]]) == abs(
+                differences[order[i]]):
+            j += 1
+        for k in range(i, j + 1):
+            ranks[order[k]] = (i + j) / 2 + 1
+        tie_correction += (j - i + 1)**3 - (j - i + 1)
+        i = j + 1
+    positive_ranks = sum(rank for rank, d in zip(ranks, differences) if d > 0)
+    variance = n * (n + 1) * (2 * n + 1) / 24 - tie_correction / 48
+    if variance <= 0:
+        return 0.0, 1.0
+    z = (positive_ranks - n * (n + 1) / 4) / math.sqrt(variance)
+    return z, math.erfc(abs(z) / math.sqrt(2))
+
+
+class PerfComparison(NamedTuple):
+    """The comparison of a single metric of a group of cases."""
+    group: str
+    config: str
+    metric: str
+    samples: int
+    median_ratio: float
+    p_value: float
+    q_value: float
+
+
+def _perf_report(samples_path: str, alpha: float, threshold: float,
+                 min_samples: int) -> List[PerfComparison]:
+    """Compares the per-case metrics of every config against the first one.
+
+    Cases are paired by run and case name, and grouped both by language and
+    by problem. Each (group, config, metric) is tested independently, and the
+    p-values are then adjusted for multiple comparisons with the
+    Benjamini-Hochberg procedure.
+    """
+    pairs: Dict[Tuple[str, str, str], List[Tuple[float, float]]] = {}
+    with open(samples_path) as f:
+        for line in f:
+            sample = json.loads(line)
+            configs = sample['configs']
+            if len(configs) < 2:
+                continue
+            baseline_name = next(iter(configs))
+            baseline = configs[baseline_name]
+            for config_name, cases in configs.items():
+                if config_name == baseline_name:
+                    continue
+                for case_name, metrics in cases.items():
+                    if case_name not in baseline:
+                        continue
+                    for metric in _PERF_METRICS:
+                        if (metric not in metrics
+                                or metric not in baseline[case_name]):
+                            continue
+                        pair = (baseline[case_name][metric], metrics[metric])
+                        for group in (f'language:{sample["language"]}',
+                                      f'problem:{sample["input_hash"]}'):
+                            pairs.setdefault((group, config_name, metric),
+                                             []).append(pair)
+
+    tests: List[Tuple[Tuple[str, str, str], int, float, float]] = []
+    for key, values in pairs.items():
+        if len(values) < min_samples:
+            continue
+        ratios = sorted(new / old for old, new in values if old > 0)
+        if not ratios:
+            continue
+        _, p_value = _wilcoxon([new - old for old, new in values])
+        tests.append((key, len(values), ratios[len(ratios) // 2], p_value))
+
+    # Benjamini-Hochberg, keeping the adjusted q-values monotonic.
+    tests.sort(key=lambda test: test[3])
+    comparisons: List[PerfComparison] = []
+    q_value = 1.0
+    for rank, test in reversed(list(enumerate(tests, start=1))):
+        (group, config, metric), samples, median_ratio, p_value = test
+        q_value = min(q_value, p_value * len(tests) / rank)
+        comparisons.append(
+            PerfComparison(group, config, metric, samples, median_ratio,
+                           p_value, q_value))
+    comparisons.reverse()
+
+    for comparison in comparisons:
+        if comparison.q_value >= alpha:
+            continue
+        if comparison.median_ratio > 1 + threshold:
+            status = 'SLOWER'
+        elif comparison.median_ratio < 1 - threshold:
+            status = 'faster'
+        else:
+            continue
+        print(f'{status:6s} {comparison.group:48s} {comparison.config:8s} '
+              f'{comparison.metric:9s} n={comparison.samples:<6d} '
+              f'ratio={comparison.median_ratio:.3f} '
+              f'q={comparison.q_value:.2g}')
+    return comparisons
+
+
 def _main() -> None:
     parser = argparse.ArgumentParser()
     parser.add_argument(
         'config',
-        nargs='+',
+        nargs='*',
         help=
         'Name of an omegaup-runner config profile (one of "focal", "bionic")')
+    parser.add_argument(
+        '--jobs',
+        type=int,
+        default=0,
+        help='Maximum number of configs to run concurrently, each on its own '
+        'core. Defaults to one per config, bounded by the available cores')
+    parser.add_argument(
+        '--results-format',
+        choices=('stream', 'zip'),
+        default='stream',
+        help='How results are uploaded to the grader. "zip" is understood '
+        'by older graders')
+    parser.add_argument(
+        '--perf-samples',
+        type=str,
+        help='Append the time, time-wall and mem of every case of every '
+        'config to this JSON lines file')
+    parser.add_argument(
+        '--perf-report',
+        action='store_true',
+        help='Instead of running, compare the samples in --perf-samples '
+        'against the first config and print the significant changes')
+    parser.add_argument('--perf-alpha',
+                        type=float,
+                        default=0.01,
+                        help='False discovery rate for --perf-report')
+    parser.add_argument(
+        '--perf-threshold',
+        type=float,
+        default=0.02,
+        help='Minimum relative change of the median for --perf-report')
+    parser.add_argument(
+        '--perf-min-samples',
+        type=int,
+        default=20,
+        help='Minimum number of paired cases per group for --perf-report')
     parser.add_argument('--verbose', action='store_true')
     args = parser.parse_args()
 
@@ -409,6 +812,15 @@ def _main() -> None:
         logging.basicConfig(level=logging.INFO,
                             format='%(asctime)s [%(levelname)-8s] %(message)s')
 
+    if args.perf_report:
+        if not args.perf_samples:
+            parser.error('--perf-report requires --perf-samples')
+        _perf_report(args.perf_samples, args.perf_alpha, args.perf_threshold,
+                     args.perf_min_samples)
+        return
+    if not args.config:
+        parser.error('at least one config is required')
+
     omegaup_runner_path = os.path.join(_ROOT, 'omegaup-runner')
     if not os.path.isfile(omegaup_runner_path):
         _download_runner(omegaup_runner_path)
@@ -437,38 +849,80 @@ def _main() -> None:
     ssl_ctx.load_verify_locations(cafile=certfile_path)
     ssl_ctx.verify_mode = ssl.CERT_REQUIRED
 
-    conn = http.client.HTTPSConnection(url.hostname,
-                                       port=url.port,
-                                       context=ssl_ctx)
-
-    input_cache = InputCache(conn, os.path.join(_ROOT, 'inputs'), 1024**3)
+    def _connect() -> http.client.HTTPSConnection:
+        return http.client.HTTPSConnection(url.hostname,
+                                           port=url.port,
+                                           context=ssl_ctx)
+
+    available_cpus = sorted(os.sched_getaffinity(0))
+    jobs = args.jobs or len(configs)
+    if jobs > len(available_cpus):
+        logging.warning(
+            'Requested %d concurrent configs, but only %d cores are available',
+            jobs, len(available_cpus))
+        jobs = len(available_cpus)
+    cpus: 'queue.Queue[int]' = queue.Queue()
+    for cpu in available_cpus[:jobs]:
+        cpus.put(cpu)
+    executor = concurrent.futures.ThreadPoolExecutor(
+        max_workers=jobs, thread_name_prefix='config')
+
+    perf_samples: Optional[TextIO] = None
+    if args.perf_samples:
+        perf_samples = open(  # pylint: disable=consider-using-with
+            args.perf_samples, 'a')
+
+    conn = _connect()
+    prefetcher = Prefetcher(_connect(), 1024**3)
+    next_run = prefetcher.prefetch()
 
     while True:
-        request = _download_run(conn)
-        if request is None:
-            logging.info('No runs found. Sleeping 10s')
-            time.sleep(10)
-            conn = http.client.HTTPSConnection(url.hostname,
-                                               port=url.port,
-                                               context=ssl_ctx)
+        pending = next_run.result()
+        next_run = prefetcher.prefetch()
+        if pending is None:
             continue
 
-        results_path = _run(input_cache, request, configs, omegaup_runner_path)
-
-        with open(results_path, 'rb') as results_file:
-            conn.request('POST',
-                         f'/run/{request["attempt_id"]}/results.zip',
-                         body=results_file,
-                         headers={
-                             'Content-Length':
-                             str(os.stat(results_path).st_size),
-                             'Content-Type': 'application/zip',
-                         })
+        try:
+            if args.results_format == 'zip':
+                results_path = _run(pending, configs, omegaup_runner_path,
+                                    executor, cpus, perf_samples)
+                with open(results_path, 'rb') as results_file:
+                    conn.request(
+                        'POST',
+                        f'/run/{pending.request["attempt_id"]}/results.zip',
+                        body=results_file,
+                        headers={
+                            'Content-Length':
+                            str(os.stat(results_path).st_size),
+                            'Content-Type': 'application/zip',
+                        })
+            else:
+                results = _stream_results(pending, configs,
+                                          omegaup_runner_path, executor, cpus,
+                                          perf_samples)
+                # The request is only sent once the first config is done, so
+                # that the grader connection and its upload slot are not held
+                # for the whole run.
+                first_chunk = next(results)
+                conn.request(
+                    'POST',
+                    f'/run/{pending.request["attempt_id"]}/results.stream',
+                    body=itertools.chain([first_chunk], results),
+                    headers={
+                        'Content-Encoding': _results_stream_encoding(),
+                        'Content-Type': 'application/octet-stream',
+                        'Transfer-Encoding': 'chunked',
+                    },
+                    encode_chunked=True)
+        finally:
+            prefetcher.release(pending)
+
         response = conn.getresponse()
         data = response.read()
         if response.status != 204:
             logging.error('failed to upload results for %d: HTTP/%d: %s',
-                          request['attempt_id'], response.status, data)
+                          pending.request['attempt_id'], response.status,
+                          data)
 
 
 if __name__ == '__main__':